@@ -0,0 +1,184 @@
+#!/bin/bash
+# Throughput benchmark of the tools on virtual devices, so that it runs on
+# any Linux box: no NIC, no hugepages. Every scenario is swept over burst
+# sizes, queue counts and frame sizes, and each run is one row of
+# results.csv and results.json in the output directory, next to its log.
+#
+#   bench/bench.sh [output_dir]      (default bench/results/<date>-<commit>)
+#
+# Scenarios:
+#   wire            wire_ports(), net_null rx -> net_null without rx
+#   wire_pipeline   the -W pipeline on the same ports, swept over WORKERS
+#   wire_pcap       wire_ports() on real frames: net_pcap replayed in a loop
+#   classifier      wire_pcap with -A and a ruleset of NB_RULES rules
+#   generator       the generator sending to net_null
+#   generator_loop  the generator on a net_ring looped back, with latency probes
+#
+# Environment (lists are swept):
+#   SCENARIOS        default: all of the above
+#   BURSTS           rx burst of the wire, tx burst of the generator ("8 32")
+#   QUEUES           queues per port ("1 2"), each adds lcores
+#   SIZES            frame sizes without CRC ("64 512 1500")
+#   WORKERS          pipeline workers per direction ("1 2")
+#   NB_RULES         classifier rules (1024)
+#   SECONDS_PER_RUN  length of a run (8), the first WARMUP (2) reports are skipped
+#   CPU_MHZ          core clock for cycles/packet (default: cpufreq or /proc/cpuinfo)
+#   MEM_MB           EAL memory (1024)
+#   NB_CPUS          cpus available, runs that need more are skipped (nproc)
+#   BIN              directory of the built tools (default: the repo)
+#
+# The classifier scenarios need python3 with scapy.
+set -e
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+BIN=${BIN:-$ROOT/examples}
+SCENARIOS=${SCENARIOS:-"wire wire_pipeline wire_pcap classifier generator generator_loop"}
+BURSTS=${BURSTS:-"8 32"}
+QUEUES=${QUEUES:-"1 2"}
+SIZES=${SIZES:-"64 512 1500"}
+WORKERS=${WORKERS:-"1 2"}
+NB_RULES=${NB_RULES:-1024}
+SECONDS_PER_RUN=${SECONDS_PER_RUN:-8}
+WARMUP=${WARMUP:-2}
+MEM_MB=${MEM_MB:-1024}
+COMMIT=$(git -C "$ROOT" rev-parse --short HEAD 2>/dev/null || echo unknown)
+OUT=${1:-$ROOT/bench/results/$(date +%Y%m%d-%H%M%S)-$COMMIT}
+NB_CPUS=${NB_CPUS:-$(nproc)}
+
+# busy polling lcores spend every cycle, so cycles/packet is the clock of
+# the lcores a tool occupies over its packet rate
+if [ -z "$CPU_MHZ" ]; then
+    if [ -r /sys/devices/system/cpu/cpu0/cpufreq/cpuinfo_max_freq ]; then
+        CPU_MHZ=$(( $(cat /sys/devices/system/cpu/cpu0/cpufreq/cpuinfo_max_freq) / 1000 ))
+    else
+        CPU_MHZ=$(awk -F: '/cpu MHz/ { printf "%d", $2; exit }' /proc/cpuinfo)
+    fi
+fi
+CPU_MHZ=${CPU_MHZ:-0}
+
+mkdir -p "$OUT"
+CSV=$OUT/results.csv
+echo "scenario,burst,queues,size,workers,lcores,mpps,drop_mpps,cycles_per_pkt,p50_us,p99_us,status" > "$CSV"
+EAL="--no-huge -m $MEM_MB --no-pci --in-memory"
+
+# flows.pcap of the given frame size, and the ruleset of the classifier:
+# rules that miss the traffic, so the lookup is the only difference with
+# wire_pcap, plus one that marks everything at the end
+make_inputs() {
+    local size=$1
+    [ -f "$OUT/flows_$size.pcap" ] && return
+    python3 - "$OUT/flows_$size.pcap" "$size" <<'PY'
+import sys
+from scapy.all import Ether, IP, UDP, Raw, wrpcap
+size = int(sys.argv[2])
+pad = max(size - 42, 0)
+wrpcap(sys.argv[1], [Ether() / IP(src="10.1.%d.%d" % (i >> 8 & 255, i & 255), dst="10.2.0.1") /
+                     UDP(sport=1024 + i, dport=4789) / Raw(b"x" * pad)
+                     for i in range(4096)])
+PY
+    if [ ! -f "$OUT/rules.txt" ]; then
+        for ((i = 0; i < NB_RULES - 1; i++)); do
+            echo "$((i + 1)) src_ip=192.168.$((i >> 8 & 255)).$((i & 255))/32 proto=udp dst_port=$((i % 1000 + 1)) drop"
+        done > "$OUT/rules.txt"
+        echo "$NB_RULES dst_ip=10.2.0.0/16 proto=udp mark=1" >> "$OUT/rules.txt"
+    fi
+}
+
+# Run a tool for SECONDS_PER_RUN and append its row.
+#   run <scenario> <burst> <queues> <size> <workers> <lcores> <tool> <args...>
+run() {
+    local scenario=$1 burst=$2 queues=$3 size=$4 workers=$5 lcores=$6 tool=$7
+    shift 7
+    local name="${scenario}_b${burst}_q${queues}_s${size}_w${workers}"
+    local log=$OUT/$name.log
+
+    if [ $((lcores + 1)) -gt "$NB_CPUS" ]; then
+        echo "$scenario,$burst,$queues,$size,$workers,$lcores,,,,,,skipped" >> "$CSV"
+        echo "$name: skipped, needs $((lcores + 1)) cpus"
+        return
+    fi
+    # line buffered, the generator has no ctrl-c handler to flush its output
+    timeout -s INT -k 10 "$SECONDS_PER_RUN" stdbuf -oL \
+        "$BIN/$tool/$tool" -l 0-"$lcores" $EAL "$@" > "$log" 2>&1 || true
+
+    # average rates of the periodic reports after the warmup, from the
+    # "total" rows (wire: rx tx drop, generator: tx) and the latency lines
+    awk -v tool="$tool" -v warmup="$WARMUP" -v lcores="$lcores" -v mhz="$CPU_MHZ" '
+        /Final wire stats/ { exit }
+        $1 == "total" && ++n > warmup {
+            if (tool == "wire") { rate += $3; drop += $4 } else { rate += $2 }
+            m++
+        }
+        /^Latency \(us\)/ && n > warmup { p50 = $8; p99 = $10 }
+        END {
+            if (m == 0) { printf ",,,,,failed\n"; exit }
+            rate /= m
+            drops = tool == "wire" ? sprintf("%.3f", drop / m) : ""
+            cycles = rate > 0 && mhz > 0 ? sprintf("%.1f", lcores * mhz / rate) : ""
+            printf "%.3f,%s,%s,%s,%s,ok\n", rate, drops, cycles, p50, p99
+        }' "$log" | { read -r metrics; echo "$scenario,$burst,$queues,$size,$workers,$lcores,$metrics"; } |
+        tee -a "$CSV" | sed "s/^/$name: /"
+}
+
+echo "Results in $OUT (cpu $CPU_MHZ MHz, $NB_CPUS cpus, commit $COMMIT)"
+for scenario in $SCENARIOS; do
+    for size in $SIZES; do
+        for burst in $BURSTS; do
+            case $scenario in
+            wire)
+                for q in $QUEUES; do
+                    run wire "$burst" "$q" "$size" 0 $((2 * q)) wire \
+                        --vdev=net_null0,size="$size" --vdev=net_null1,no-rx=1 -- \
+                        -q "$q" -b "$burst" 0 1
+                done ;;
+            wire_pipeline)
+                for w in $WORKERS; do
+                    run wire_pipeline "$burst" 1 "$size" "$w" $((2 * (w + 2))) wire \
+                        --vdev=net_null0,size="$size" --vdev=net_null1,no-rx=1 -- \
+                        -W "$w" -b "$burst" 0 1
+                done ;;
+            wire_pcap|classifier)
+                make_inputs "$size"
+                acl_args=()
+                [ "$scenario" = classifier ] && acl_args=(-A "$OUT/rules.txt")
+                for q in $QUEUES; do
+                    # one replayed copy of the pcap per rx queue
+                    pcap_rx=$(for ((i = 0; i < q; i++)); do printf ",rx_pcap=%s" "$OUT/flows_$size.pcap"; done)
+                    run "$scenario" "$burst" "$q" "$size" 0 $((2 * q)) wire \
+                        --vdev=net_pcap0"$pcap_rx",infinite_rx=1 --vdev=net_null0,no-rx=1 -- \
+                        -q "$q" -b "$burst" "${acl_args[@]}" 0 1
+                done ;;
+            generator)
+                for q in $QUEUES; do
+                    run generator "$burst" "$q" "$size" 0 "$q" generator \
+                        --vdev=net_null0 -- -q "$q" -b "$burst" -s "$size" 0
+                done ;;
+            generator_loop)
+                for q in $QUEUES; do
+                    run generator_loop "$burst" "$q" "$size" 0 $((2 * q)) generator \
+                        --vdev=net_ring0 -- -q "$q" -b "$burst" -s "$size" -L 0 0
+                done ;;
+            *)
+                echo "Unknown scenario $scenario" >&2
+                exit 1 ;;
+            esac
+        done
+    done
+done
+
+# the same rows as JSON, with what is needed to compare two result sets
+python3 - "$CSV" "$OUT/results.json" "$COMMIT" "$CPU_MHZ" <<'PY'
+import csv, json, platform, sys, time
+rows = []
+for r in csv.DictReader(open(sys.argv[1])):
+    for k in ("burst", "queues", "size", "workers", "lcores"):
+        r[k] = int(r[k])
+    for k in ("mpps", "drop_mpps", "cycles_per_pkt", "p50_us", "p99_us"):
+        r[k] = float(r[k]) if r[k] else None
+    rows.append(r)
+meta = {"commit": sys.argv[3], "cpu_mhz": int(sys.argv[4]), "host": platform.node(),
+        "machine": platform.machine(), "kernel": platform.release(),
+        "date": time.strftime("%Y-%m-%dT%H:%M:%S")}
+json.dump({"meta": meta, "results": rows}, open(sys.argv[2], "w"), indent=1)
+PY
+echo "Wrote $CSV and $OUT/results.json"
@@ -0,0 +1,66 @@
+#!/usr/bin/env python3
+"""Compare two bench.sh result sets and flag the runs that got slower.
+
+    bench/compare.py [--threshold PCT] base/results.json new/results.json
+
+Runs are matched on (scenario, burst, queues, size, workers). A run whose
+rate dropped by more than the threshold (default 5%) is a regression, and
+the exit status is 1 if there is any. Takes results.csv files as well.
+"""
+import argparse
+import csv
+import json
+import sys
+
+KEY = ("scenario", "burst", "queues", "size", "workers")
+
+
+def load(path):
+    if path.endswith(".csv"):
+        rows = list(csv.DictReader(open(path)))
+        meta = {}
+    else:
+        data = json.load(open(path))
+        rows, meta = data["results"], data.get("meta", {})
+    runs = {}
+    for r in rows:
+        rate = r.get("mpps")
+        if rate in (None, ""):
+            continue
+        runs[tuple(str(r[k]) for k in KEY)] = (float(rate), r.get("cycles_per_pkt"))
+    return runs, meta
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    ap.add_argument("--threshold", type=float, default=5.0,
+                    help="rate drop in percent that counts as a regression")
+    ap.add_argument("base")
+    ap.add_argument("new")
+    args = ap.parse_args()
+
+    base, base_meta = load(args.base)
+    new, new_meta = load(args.new)
+    if base_meta or new_meta:
+        print("base %s, new %s" % (base_meta.get("commit", args.base),
+                                   new_meta.get("commit", args.new)))
+    print("%-15s %5s %6s %5s %7s %9s %9s %8s" %
+          ("scenario", "burst", "queues", "size", "workers", "base Mpps", "new Mpps", "change"))
+    regressions = 0
+    for key in sorted(base.keys() & new.keys(), key=lambda k: (k[0],) + tuple(map(int, k[1:]))):
+        b, n = base[key][0], new[key][0]
+        change = 100.0 * (n - b) / b if b > 0 else 0.0
+        flag = ""
+        if change < -args.threshold:
+            flag = "  REGRESSION"
+            regressions += 1
+        print("%-15s %5s %6s %5s %7s %9.3f %9.3f %+7.1f%%%s" % (key + (b, n, change, flag)))
+    for key in sorted(base.keys() ^ new.keys()):
+        print("%-15s %5s %6s %5s %7s only in %s" %
+              (key + ("base" if key in base else "new",)))
+    print("%d regression(s) over %.1f%%" % (regressions, args.threshold))
+    return 1 if regressions else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -1,353 +1,1164 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
-#include <ifaddrs.h>
-#include <sys/socket.h>
-#include <linux/if_packet.h>
-#include <net/if.h>
+#include <strings.h>
+#include <math.h>
+#include <arpa/inet.h>
 
 // #include <rte_eal.h>
 #include <rte_ethdev.h>
 #include <rte_dev.h>
 // #include <rte_flow.h>
 #include <rte_mbuf.h>
+#include <rte_lcore.h>
+#include <rte_launch.h>
+#include <rte_cycles.h>
+#include <rte_random.h>
 
 #include <rte_ether.h>
 #include <rte_ip.h>
 #include <rte_udp.h>
 
-#define RING_SIZE 1024
-#define NUM_MBUFS 1024
-#define MBUF_CACHE_SIZE 250
-// Open a DPDK port
-int port_init(uint16_t port) {
-	struct rte_mempool *mbuf_pool;
-	struct rte_eth_conf port_conf;
-	const uint16_t rx_rings = 1, tx_rings = 1;
-	uint16_t nb_rxd = RING_SIZE;
-	uint16_t nb_txd = RING_SIZE;
-	int retval;
-	uint16_t q;
-	struct rte_eth_dev_info dev_info;
-	struct rte_eth_txconf txconf;
-
-	if (!rte_eth_dev_is_valid_port(port))
-		return -1;
-
-	// allocate the mbuf pool
-	mbuf_pool = rte_pktmbuf_pool_create("RX_MBUF_POOL", NUM_MBUFS,
-		MBUF_CACHE_SIZE, 0, RTE_MBUF_DEFAULT_BUF_SIZE, rte_socket_id());
-	if (mbuf_pool == NULL) {
-		int required_mem = (NUM_MBUFS * (2048 + sizeof(struct rte_mbuf))) * 1 + (MBUF_CACHE_SIZE * sizeof(struct rte_mbuf) * 1);
-		rte_exit(EXIT_FAILURE, "Cannot create mbuf pool. the memory required was: %i\n", required_mem);
-	}
-
-	// set up the port configuration
-	memset(&port_conf, 0, sizeof(struct rte_eth_conf));
-
-	// get device info
-	retval = rte_eth_dev_info_get(port, &dev_info);
-	if (retval != 0) {
-		printf("Error during getting device (port %u) info: %s\n",
-				port, strerror(-retval));
-		return retval;
-	}
-
-	// if (dev_info.tx_offload_capa & RTE_ETH_TX_OFFLOAD_MBUF_FAST_FREE)
-	// 	port_conf.txmode.offloads |=
-	// 		RTE_ETH_TX_OFFLOAD_MBUF_FAST_FREE;
-
-	/* Configure the Ethernet device. */
-	retval = rte_eth_dev_configure(port, rx_rings, tx_rings, &port_conf);
-	if (retval != 0)
-		return retval;
-
-	retval = rte_eth_dev_adjust_nb_rx_tx_desc(port, &nb_rxd, &nb_txd);
-	if (retval != 0)
-		return retval;
-
-	/* Allocate and set up 1 RX queue per Ethernet port. */
-	for (q = 0; q < rx_rings; q++) {
-		retval = rte_eth_rx_queue_setup(port, q, nb_rxd,
-				rte_eth_dev_socket_id(port), NULL, mbuf_pool);
-		if (retval < 0)
-			return retval;
-	}
-
-	txconf = dev_info.default_txconf;
-	txconf.offloads = port_conf.txmode.offloads;
-	/* Allocate and set up 1 TX queue per Ethernet port. */
-	for (q = 0; q < tx_rings; q++) {
-		retval = rte_eth_tx_queue_setup(port, q, nb_txd,
-				rte_eth_dev_socket_id(port), &txconf);
-		if (retval < 0)
-			return retval;
-	}
-
-	/* Starting Ethernet port. 8< */
-	retval = rte_eth_dev_start(port);
-	/* >8 End of starting of ethernet port. */
-	if (retval < 0)
-		return retval;
-
-	/* Display the port MAC address. */
-	struct rte_ether_addr addr;
-	retval = rte_eth_macaddr_get(port, &addr);
-	if (retval != 0)
-		return retval;
-
-	printf("Port %u MAC: %02" PRIx8 " %02" PRIx8 " %02" PRIx8
-			   " %02" PRIx8 " %02" PRIx8 " %02" PRIx8 "\n",
-			port, RTE_ETHER_ADDR_BYTES(&addr));
-
-	/* Enable RX in promiscuous mode for the Ethernet device. */
-	retval = rte_eth_promiscuous_enable(port);
-	/* End of setting RX port in promiscuous mode. */
-	if (retval != 0)
-		return retval;
-
-	return 0;
-}
-
-static struct rte_mempool *g_mbuf_pool = NULL;
-int internal_mbuf_init() {
-    struct rte_mempool *mbuf_pool;
-    mbuf_pool = rte_pktmbuf_pool_create("TX_MBUF_POOL", NUM_MBUFS,
-        MBUF_CACHE_SIZE, 0, RTE_MBUF_DEFAULT_BUF_SIZE, rte_socket_id());
-    if (mbuf_pool == NULL) {
-        int required_mem = (NUM_MBUFS * (2048 + sizeof(struct rte_mbuf))) * 1 + (MBUF_CACHE_SIZE * sizeof(struct rte_mbuf) * 1);
-        rte_exit(EXIT_FAILURE, "Cannot create mbuf pool. the memory required was: %i\n", required_mem);
-    }
-    g_mbuf_pool = mbuf_pool;  // Save for packet generation
-}
-
-#define PKT_SIZE 128
-
-// Create a simple UDP packet
-static struct rte_mbuf* create_udp_packet(void) {
-    struct rte_mbuf *pkt;
+#include "bfdev_port.h"
+#include "bfdev_metrics.h"
+
+#define DEFAULT_PKT_SIZE 64   // frame size without the CRC
+#define MIN_PKT_SIZE (RTE_ETHER_MIN_LEN - RTE_ETHER_CRC_LEN)
+#define MAX_PKT_SIZE (RTE_ETHER_MAX_LEN - RTE_ETHER_CRC_LEN)
+#define MAX_TX_BURST 64
+// bytes a frame occupies on the wire besides its own: CRC, preamble + SFD, IFG
+#define WIRE_OVERHEAD (RTE_ETHER_CRC_LEN + 8 + 12)
+
+// Rate profiles. The configured rate is the peak, the profile scales it
+// over time and repeats every period.
+enum rate_profile {
+    PROFILE_CONST = 0,  // always the configured rate
+    PROFILE_STEP,       // rate/steps, 2*rate/steps, ..., rate, each held period/steps
+    PROFILE_SWEEP,      // linear ramp from 0 to the rate over the period
+    PROFILE_SINE,       // rate * (1 + sin) / 2, one cycle per period
+};
+static const char *profile_names[] = {"const", "step", "sweep", "sine"};
+
+#define PROFILE_UPDATE_HZ 1000  // how often the tx loops re-evaluate the profile
+
+// Header fields that can vary from packet to packet. Every field holds a
+// [min, max] range: the template packet is built with min, and fields with
+// max > min are rewritten on every packet, counting up or at random.
+enum gen_field {
+    FIELD_SMAC = 0,
+    FIELD_DMAC,
+    FIELD_VLAN,
+    FIELD_SIP,
+    FIELD_DIP,
+    FIELD_SPORT,
+    FIELD_DPORT,
+    NB_FIELDS,
+};
+static const char *field_names[NB_FIELDS] = {
+    "smac", "dmac", "vlan", "sip", "dip", "sport", "dport"
+};
+
+struct field_spec {
+    uint64_t min;
+    uint64_t max;
+    int random;   // uniform random in [min, max] instead of counting up
+};
+
+// Packet sizes: fixed, uniform random in a range, or simple IMIX
+enum size_mode {
+    SIZE_FIXED = 0,
+    SIZE_RANGE,
+    SIZE_IMIX,
+};
+
+// Simple IMIX, 7:4:1 of 64, 594 and 1518 byte frames (60, 590, 1514 without
+// CRC). Sent in this order, which spreads the large frames out.
+static const uint16_t imix_sizes[] = {
+    60, 60, 590, 60, 60, 590, 60, 1514, 60, 590, 60, 590,
+};
+
+// Generator settings, shared read-only by all tx lcores
+struct gen_conf {
+    uint16_t port;
+    uint16_t nb_queues;
+    enum size_mode size_mode;
+    uint16_t pkt_size;           // fixed size, or the min of a range
+    uint16_t pkt_size_max;       // max of a range
+    uint16_t burst;
+    double rate_pps;             // total target rate, 0 = as fast as possible
+    unsigned tb_depth;           // token bucket depth in packets, per queue
+    enum rate_profile profile;
+    unsigned profile_steps;
+    double profile_period;       // seconds
+    struct field_spec fields[NB_FIELDS];
+    int vlan;                    // packets carry a VLAN tag
+    uint16_t l3_off;             // offset of the IPv4 header
+    uint32_t ip_base_sum;        // IPv4 header sum without addresses and length
+    int tx_ip_cksum;             // the port computes the IPv4 checksum on tx
+    int rewrite;                 // some field or the size changes per packet
+    int latency;                 // send latency probes and receive them
+    uint16_t rx_port;            // latency mode: port the probes come back on
+};
+static struct gen_conf gconf = {
+    .pkt_size = DEFAULT_PKT_SIZE,
+    .burst = BFDEV_MAX_PKT_BURST,
+    .nb_queues = 1,
+    .profile_steps = 10,
+    .profile_period = 10,
+    .fields = {
+        [FIELD_SMAC] = {0, 0, 0},
+        [FIELD_DMAC] = {0xFFFFFFFFFFFFULL, 0xFFFFFFFFFFFFULL, 0}, // Broadcast
+        [FIELD_SIP] = {0x0A000001, 0x0A000001, 0},  // 10.0.0.1
+        [FIELD_DIP] = {0x0A000002, 0x0A000002, 0},  // 10.0.0.2
+        [FIELD_SPORT] = {12345, 12345, 0},
+        [FIELD_DPORT] = {54321, 54321, 0},
+    },
+    .l3_off = sizeof(struct rte_ether_hdr),
+};
+
+// Per-lcore tx counters, written only by their own lcore
+struct gen_stats {
+    uint64_t tx;
+    uint64_t tx_bytes;
+    uint64_t tx_full;      // tx_burst calls that did not take the whole burst
+    uint64_t alloc_fail;
+} __rte_cache_aligned;
+
+static struct gen_stats lcore_stats[RTE_MAX_LCORE];
+
+// One tx thread per tx queue, each with its own template pool so that
+// fast-free sees a single pool per queue and the pool caches stay local
+struct gen_thread_args {
+    uint16_t queue;
+    unsigned lcore_id;
+    struct rte_mempool *pool;
+};
+
+// Latency probe, written at the start of the UDP payload of every packet
+// in latency mode. Each tx queue is a stream with its own sequence numbers.
+#define PROBE_MAGIC 0xBF1A
+struct probe_hdr {
+    uint16_t magic;
+    uint16_t stream;   // tx queue
+    uint32_t seq;
+    uint64_t tsc;      // TSC right before rte_eth_tx_burst
+} __rte_packed;
+
+// HDR-style latency histogram in ns: values below 2^(LAT_SUB_BITS + 1) get
+// their own bucket, above that every power of two is split into
+// 2^LAT_SUB_BITS buckets, so the relative error stays under 1%.
+#define LAT_SUB_BITS 7
+#define LAT_SUB (1u << LAT_SUB_BITS)
+#define LAT_MAX_SHIFT 33   // up to 2^41 ns, about 36 minutes
+#define LAT_BUCKETS ((LAT_MAX_SHIFT + 2) * LAT_SUB)
+
+struct lat_hist {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    uint64_t buckets[LAT_BUCKETS];
+};
+
+// Per rx queue latency counters, written only by the rx lcore of the queue
+struct lat_stats {
+    uint64_t rx;                                // all packets received
+    uint64_t reordered;                         // probes older than one already seen
+    uint64_t stream_rx[BFDEV_MAX_QUEUES];       // probes received per stream
+    uint32_t stream_max_seq[BFDEV_MAX_QUEUES];  // highest seq seen per stream
+    uint8_t stream_seen[BFDEV_MAX_QUEUES];
+    struct lat_hist hist;
+} __rte_cache_aligned;
+
+static struct lat_stats rx_lat_stats[BFDEV_MAX_QUEUES];
+
+struct rx_thread_args {
+    uint16_t queue;
+    unsigned lcore_id;
+};
+
+// Per-lcore position in the counting fields and in the IMIX sequence
+struct flow_state {
+    uint64_t cur[NB_FIELDS];
+    unsigned imix_idx;
+    uint32_t seq;   // next probe sequence number
+};
+
+static void write_mac(struct rte_ether_addr *addr, uint64_t v) {
+    for (int i = RTE_ETHER_ADDR_LEN - 1; i >= 0; i--) {
+        addr->addr_bytes[i] = v & 0xFF;
+        v >>= 8;
+    }
+}
+
+// Write a simple UDP packet of size bytes into pkt, from the min of every
+// field. The payload pattern is written up to MAX_PKT_SIZE, so only the
+// lengths need to change to send a different size.
+static void create_udp_packet(struct rte_mbuf *pkt, uint16_t size) {
     struct rte_ether_hdr *eth_hdr;
     struct rte_ipv4_hdr *ip_hdr;
     struct rte_udp_hdr *udp_hdr;
     uint8_t *payload;
-    
-    // Allocate mbuf
-    pkt = rte_pktmbuf_alloc(g_mbuf_pool);
-    if (pkt == NULL)
-        return NULL;
-    
-    // Set up Ethernet header
+    const struct field_spec *f = gconf.fields;
+
+    // Set up Ethernet header, and the VLAN tag if any
     eth_hdr = rte_pktmbuf_mtod(pkt, struct rte_ether_hdr *);
-    memset(eth_hdr->dst_addr.addr_bytes, 0xFF, RTE_ETHER_ADDR_LEN); // Broadcast
-    memset(eth_hdr->src_addr.addr_bytes, 0x00, RTE_ETHER_ADDR_LEN);
-    eth_hdr->ether_type = rte_cpu_to_be_16(RTE_ETHER_TYPE_IPV4);
-    
+    write_mac(&eth_hdr->dst_addr, f[FIELD_DMAC].min);
+    write_mac(&eth_hdr->src_addr, f[FIELD_SMAC].min);
+    if (gconf.vlan) {
+        struct rte_vlan_hdr *vlan_hdr = (struct rte_vlan_hdr *)(eth_hdr + 1);
+        eth_hdr->ether_type = rte_cpu_to_be_16(RTE_ETHER_TYPE_VLAN);
+        vlan_hdr->vlan_tci = rte_cpu_to_be_16(f[FIELD_VLAN].min);
+        vlan_hdr->eth_proto = rte_cpu_to_be_16(RTE_ETHER_TYPE_IPV4);
+    } else {
+        eth_hdr->ether_type = rte_cpu_to_be_16(RTE_ETHER_TYPE_IPV4);
+    }
+
     // Set up IP header
-    ip_hdr = (struct rte_ipv4_hdr *)(eth_hdr + 1);
+    ip_hdr = rte_pktmbuf_mtod_offset(pkt, struct rte_ipv4_hdr *, gconf.l3_off);
     memset(ip_hdr, 0, sizeof(struct rte_ipv4_hdr));
     ip_hdr->version_ihl = 0x45; // IPv4, 20 byte header
-    ip_hdr->total_length = rte_cpu_to_be_16(PKT_SIZE - sizeof(struct rte_ether_hdr));
+    ip_hdr->total_length = rte_cpu_to_be_16(size - gconf.l3_off);
     ip_hdr->time_to_live = 64;
     ip_hdr->next_proto_id = IPPROTO_UDP;
-    ip_hdr->src_addr = rte_cpu_to_be_32(0x0A000001); // 10.0.0.1
-    ip_hdr->dst_addr = rte_cpu_to_be_32(0x0A000002); // 10.0.0.2
-    
+    ip_hdr->src_addr = rte_cpu_to_be_32(f[FIELD_SIP].min);
+    ip_hdr->dst_addr = rte_cpu_to_be_32(f[FIELD_DIP].min);
+    ip_hdr->hdr_checksum = rte_ipv4_cksum(ip_hdr);
+
     // Set up UDP header
     udp_hdr = (struct rte_udp_hdr *)(ip_hdr + 1);
-    udp_hdr->src_port = rte_cpu_to_be_16(12345);
-    udp_hdr->dst_port = rte_cpu_to_be_16(54321);
-    udp_hdr->dgram_len = rte_cpu_to_be_16(PKT_SIZE - sizeof(struct rte_ether_hdr) - sizeof(struct rte_ipv4_hdr));
+    udp_hdr->src_port = rte_cpu_to_be_16(f[FIELD_SPORT].min);
+    udp_hdr->dst_port = rte_cpu_to_be_16(f[FIELD_DPORT].min);
+    udp_hdr->dgram_len = rte_cpu_to_be_16(size - gconf.l3_off - sizeof(struct rte_ipv4_hdr));
     udp_hdr->dgram_cksum = 0; // Optional for UDP
-    
+
     // Fill payload with pattern
     payload = (uint8_t *)(udp_hdr + 1);
-    int payload_size = PKT_SIZE - sizeof(struct rte_ether_hdr) - sizeof(struct rte_ipv4_hdr) - sizeof(struct rte_udp_hdr);
+    int payload_size = MAX_PKT_SIZE - gconf.l3_off - sizeof(struct rte_ipv4_hdr) - sizeof(struct rte_udp_hdr);
     for (int i = 0; i < payload_size; i++) {
         payload[i] = i & 0xFF;
     }
-    
-    pkt->data_len = PKT_SIZE;
-    pkt->pkt_len = PKT_SIZE;
-    
-    return pkt;
+
+    pkt->data_len = size;
+    pkt->pkt_len = size;
 }
 
+// Sum of the IPv4 header words that never change: everything but the
+// addresses, the total length and the checksum. The checksum of a
+// rewritten header is then this sum plus the words that were written.
+static uint32_t ip_base_sum(void) {
+    struct rte_ipv4_hdr ip_hdr;
 
-// Generate packets at 1 second intervals
-static void packet_generator(uint16_t port_id) {
-    struct rte_mbuf *pkt;
-    uint64_t total_sent = 0;
-    uint16_t nb_tx;
-    
-    printf("Starting packet generator on port %u\n", port_id);
-    printf("Sending %d byte UDP packets every 1 second\n", PKT_SIZE);
-    printf("Press Ctrl+C to stop\n\n");
-    
-    while (1) {
-        // Create packet
-        pkt = create_udp_packet();
-        if (pkt == NULL) {
-            printf("Failed to allocate mbuf\n");
-            sleep(1);
+    memset(&ip_hdr, 0, sizeof(ip_hdr));
+    ip_hdr.version_ihl = 0x45;
+    ip_hdr.time_to_live = 64;
+    ip_hdr.next_proto_id = IPPROTO_UDP;
+    return rte_raw_cksum(&ip_hdr, sizeof(ip_hdr));
+}
+
+static inline uint64_t next_field(const struct field_spec *f, struct flow_state *st, int i) {
+    if (f->random)
+        return f->min + rte_rand_max(f->max - f->min + 1);
+    uint64_t v = st->cur[i];
+    st->cur[i] = v == f->max ? f->min : v + 1;
+    return v;
+}
+
+static inline uint16_t next_size(struct flow_state *st) {
+    switch (gconf.size_mode) {
+    case SIZE_RANGE:
+        return gconf.pkt_size + rte_rand_max(gconf.pkt_size_max - gconf.pkt_size + 1);
+    case SIZE_IMIX:
+        st->imix_idx = st->imix_idx + 1 == RTE_DIM(imix_sizes) ? 0 : st->imix_idx + 1;
+        return imix_sizes[st->imix_idx];
+    default:
+        return gconf.pkt_size;
+    }
+}
+
+// Rewrite the varying fields and sizes of a burst of template packets.
+// The new values of the whole burst are drawn first, column by column, then
+// written to the packets in one pass, and the IPv4 checksum is left to the
+// port when it offers it, else rebuilt from the precomputed base sum instead
+// of summing the header again.
+static void rewrite_burst(struct rte_mbuf **bufs, uint16_t n, struct flow_state *st,
+                          uint16_t *sizes) {
+    uint64_t vals[NB_FIELDS][MAX_TX_BURST];
+    const struct field_spec *f = gconf.fields;
+    const uint16_t l3_off = gconf.l3_off;
+    int vary[NB_FIELDS];
+
+    for (int k = 0; k < NB_FIELDS; k++) {
+        vary[k] = f[k].max > f[k].min;
+        if (!vary[k])
             continue;
-        }
-        
-        // Send packet
-        nb_tx = rte_eth_tx_burst(port_id, 0, &pkt, 1);
-        
-        if (nb_tx > 0) {
-            total_sent++;
-            printf("Sent packet #%lu\n", total_sent);
+        for (uint16_t i = 0; i < n; i++)
+            vals[k][i] = next_field(&f[k], st, k);
+    }
+    for (uint16_t i = 0; i < n; i++)
+        sizes[i] = next_size(st);
+
+    for (uint16_t i = 0; i < n; i++) {
+        struct rte_mbuf *m = bufs[i];
+        struct rte_ether_hdr *eth_hdr = rte_pktmbuf_mtod(m, struct rte_ether_hdr *);
+        struct rte_ipv4_hdr *ip_hdr = (struct rte_ipv4_hdr *)((char *)eth_hdr + l3_off);
+        struct rte_udp_hdr *udp_hdr = (struct rte_udp_hdr *)(ip_hdr + 1);
+
+        if (vary[FIELD_DMAC])
+            write_mac(&eth_hdr->dst_addr, vals[FIELD_DMAC][i]);
+        if (vary[FIELD_SMAC])
+            write_mac(&eth_hdr->src_addr, vals[FIELD_SMAC][i]);
+        if (vary[FIELD_VLAN])
+            ((struct rte_vlan_hdr *)(eth_hdr + 1))->vlan_tci =
+                rte_cpu_to_be_16(vals[FIELD_VLAN][i]);
+        if (vary[FIELD_SIP])
+            ip_hdr->src_addr = rte_cpu_to_be_32(vals[FIELD_SIP][i]);
+        if (vary[FIELD_DIP])
+            ip_hdr->dst_addr = rte_cpu_to_be_32(vals[FIELD_DIP][i]);
+        if (vary[FIELD_SPORT])
+            udp_hdr->src_port = rte_cpu_to_be_16(vals[FIELD_SPORT][i]);
+        if (vary[FIELD_DPORT])
+            udp_hdr->dst_port = rte_cpu_to_be_16(vals[FIELD_DPORT][i]);
+        ip_hdr->total_length = rte_cpu_to_be_16(sizes[i] - l3_off);
+        udp_hdr->dgram_len = rte_cpu_to_be_16(sizes[i] - l3_off - sizeof(struct rte_ipv4_hdr));
+
+        if (gconf.tx_ip_cksum) {
+            // alloc reset the tx offload fields, so set them on every packet
+            ip_hdr->hdr_checksum = 0;
+            m->l2_len = l3_off;
+            m->l3_len = sizeof(struct rte_ipv4_hdr);
+            m->ol_flags |= RTE_MBUF_F_TX_IPV4 | RTE_MBUF_F_TX_IP_CKSUM;
         } else {
-            // Failed to send, free the mbuf
-            rte_pktmbuf_free(pkt);
-            printf("Failed to send packet\n");
+            uint32_t sum = gconf.ip_base_sum + ip_hdr->total_length +
+                           (ip_hdr->src_addr & 0xFFFF) + (ip_hdr->src_addr >> 16) +
+                           (ip_hdr->dst_addr & 0xFFFF) + (ip_hdr->dst_addr >> 16);
+            sum = (sum & 0xFFFF) + (sum >> 16);
+            sum = (sum & 0xFFFF) + (sum >> 16);
+            ip_hdr->hdr_checksum = (uint16_t)~sum;
         }
-        
-        // Wait 1 second
-        sleep(1);
+
+        m->data_len = sizes[i];
+        m->pkt_len = sizes[i];
     }
 }
 
+static inline struct probe_hdr *pkt_probe(struct rte_mbuf *m, uint16_t l3_off) {
+    return rte_pktmbuf_mtod_offset(m, struct probe_hdr *, l3_off +
+        sizeof(struct rte_ipv4_hdr) + sizeof(struct rte_udp_hdr));
+}
 
+// Give every packet of a new burst the next sequence number of the stream
+static void stamp_seq(struct rte_mbuf **bufs, uint16_t n, uint16_t stream,
+                      struct flow_state *st) {
+    for (uint16_t i = 0; i < n; i++) {
+        struct probe_hdr *probe = pkt_probe(bufs[i], gconf.l3_off);
+        probe->magic = PROBE_MAGIC;
+        probe->stream = stream;
+        probe->seq = st->seq++;
+    }
+}
 
-// Helper function to get Linux interface name by MAC address
-int get_linux_ifname_by_mac(struct rte_ether_addr *mac, char *ifname, size_t ifname_len) {
-    struct ifaddrs *ifaddr, *ifa;
-    int found = 0;
+// Stamp the packets that are about to be passed to rte_eth_tx_burst. Packets
+// the queue did not take are stamped again on the next try, so the time they
+// waited in the generator is not counted.
+static inline void stamp_tsc(struct rte_mbuf **bufs, uint16_t n) {
+    uint64_t now = rte_rdtsc();
+    for (uint16_t i = 0; i < n; i++)
+        pkt_probe(bufs[i], gconf.l3_off)->tsc = now;
+}
 
-    if (getifaddrs(&ifaddr) == -1) {
-        return -1;
+static inline unsigned lat_bucket(uint64_t ns) {
+    if (ns < 2 * LAT_SUB)
+        return ns;
+    unsigned shift = 63 - __builtin_clzll(ns) - LAT_SUB_BITS;
+    if (shift > LAT_MAX_SHIFT)
+        return LAT_BUCKETS - 1;
+    return shift * LAT_SUB + (ns >> shift);
+}
+
+// Lowest value that falls in a bucket
+static uint64_t lat_bucket_value(unsigned idx) {
+    if (idx < 2 * LAT_SUB)
+        return idx;
+    unsigned shift = idx / LAT_SUB - 1;
+    return (uint64_t)(idx - shift * LAT_SUB) << shift;
+}
+
+static inline void lat_record(struct lat_hist *h, uint64_t ns) {
+    h->buckets[lat_bucket(ns)]++;
+    h->count++;
+    h->sum += ns;
+    if (ns < h->min || h->count == 1)
+        h->min = ns;
+    if (ns > h->max)
+        h->max = ns;
+}
+
+// Value below which a fraction q of the samples fall
+static uint64_t lat_percentile(const struct lat_hist *h, double q) {
+    uint64_t target = (uint64_t)(q * h->count);
+    uint64_t seen = 0;
+
+    for (unsigned i = 0; i < LAT_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen > target)
+            return lat_bucket_value(i);
     }
-    // Iterate through all interfaces
-    for (ifa = ifaddr; ifa != NULL; ifa = ifa->ifa_next) {
-        if (ifa->ifa_addr == NULL)
-            continue;
+    return h->max;
+}
+
+// Receive probes on one rx queue of the rx port and record their latency,
+// per stream loss and reordering. Non-probe packets are only counted.
+static void latency_receiver(struct rx_thread_args *args) {
+    struct rte_mbuf *bufs[BFDEV_MAX_PKT_BURST];
+    struct lat_stats *stats = &rx_lat_stats[args->queue];
+    const uint16_t port = gconf.rx_port;
+    const uint16_t queue = args->queue;
+    const uint16_t l3_off = gconf.l3_off;
+    const uint16_t min_len = l3_off + sizeof(struct rte_ipv4_hdr) +
+                             sizeof(struct rte_udp_hdr) + sizeof(struct probe_hdr);
+    const double ns_per_cycle = 1e9 / rte_get_tsc_hz();
 
-        // Check if this is a packet socket (has MAC address)
-        if (ifa->ifa_addr->sa_family == AF_PACKET) {
-            struct sockaddr_ll *s = (struct sockaddr_ll*)ifa->ifa_addr;
+    printf("Starting latency receiver on lcore %u: port %u queue %u\n",
+           rte_lcore_id(), port, queue);
 
-            // Compare MAC addresses
-            if (s->sll_halen == RTE_ETHER_ADDR_LEN &&
-                memcmp(s->sll_addr, mac->addr_bytes, RTE_ETHER_ADDR_LEN) == 0) {
-                snprintf(ifname, ifname_len, "%s", ifa->ifa_name);
-                found = 1;
-                break;
+    while (1) {
+        uint16_t nb_rx = rte_eth_rx_burst(port, queue, bufs, BFDEV_MAX_PKT_BURST);
+        if (nb_rx == 0)
+            continue;
+        uint64_t now = rte_rdtsc();
+        stats->rx += nb_rx;
+        for (uint16_t i = 0; i < nb_rx; i++) {
+            if (unlikely(rte_pktmbuf_data_len(bufs[i]) < min_len))
+                continue;
+            const struct probe_hdr *probe = pkt_probe(bufs[i], l3_off);
+            if (probe->magic != PROBE_MAGIC || probe->stream >= gconf.nb_queues)
+                continue;
+            uint16_t s = probe->stream;
+            stats->stream_rx[s]++;
+            if (stats->stream_seen[s] && (int32_t)(probe->seq - stats->stream_max_seq[s]) < 0) {
+                stats->reordered++;
+            } else {
+                stats->stream_max_seq[s] = probe->seq;
+                stats->stream_seen[s] = 1;
             }
+            lat_record(&stats->hist, (uint64_t)((now - probe->tsc) * ns_per_cycle));
         }
+        rte_pktmbuf_free_bulk(bufs, nb_rx);
     }
-    freeifaddrs(ifaddr);
-    return found ? 0 : -1;
 }
 
-void list_ports(void) {
-    uint16_t port_id;
-    uint16_t nb_ports;
-    struct rte_eth_dev_info dev_info;
-    struct rte_ether_addr addr;
-    char name[RTE_ETH_NAME_MAX_LEN];
-    char linux_ifname[IFNAMSIZ];
-    int retval;
+static int receiver_lcore(void *arg) {
+    latency_receiver((struct rx_thread_args *)arg);
+    return 0;
+}
 
-    nb_ports = rte_eth_dev_count_avail();
-    printf("\n=== Available DPDK Ports ===\n");
-    printf("Total ports available: %u\n\n", nb_ports);
+// Probe counters of all rx queues since start
+struct lat_totals {
+    uint64_t rx;           // all packets received
+    uint64_t reordered;
+    uint64_t sent;         // probes sent
+    uint64_t received;     // probes received
+};
 
-    if (nb_ports == 0) {
-        printf("No DPDK ports found!\n");
-        return;
+// Merge the latency histograms of the rx queues into hist and sum their
+// counters. rx counters are read before tx counters, so packets in flight
+// show up as loss.
+static void lat_collect(const struct gen_thread_args *args, struct lat_hist *hist,
+                        struct lat_totals *t) {
+    uint64_t stream_rx[BFDEV_MAX_QUEUES] = {0};
+
+    memset(hist, 0, sizeof(*hist));
+    memset(t, 0, sizeof(*t));
+    for (uint16_t q = 0; q < gconf.nb_queues; q++) {
+        const struct lat_stats *ls = &rx_lat_stats[q];
+        t->rx += ls->rx;
+        t->reordered += ls->reordered;
+        for (uint16_t s = 0; s < gconf.nb_queues; s++)
+            stream_rx[s] += ls->stream_rx[s];
+        if (ls->hist.count == 0)
+            continue;
+        if (hist->count == 0 || ls->hist.min < hist->min)
+            hist->min = ls->hist.min;
+        hist->max = RTE_MAX(hist->max, ls->hist.max);
+        hist->count += ls->hist.count;
+        hist->sum += ls->hist.sum;
+        for (unsigned i = 0; i < LAT_BUCKETS; i++)
+            hist->buckets[i] += ls->hist.buckets[i];
     }
+    for (uint16_t s = 0; s < gconf.nb_queues; s++) {
+        t->sent += lcore_stats[args[s].lcore_id].tx;
+        t->received += stream_rx[s];
+    }
+}
 
-    RTE_ETH_FOREACH_DEV(port_id) {
-        // Get MAC address first
-        retval = rte_eth_macaddr_get(port_id, &addr);
-        if (retval != 0) {
-            continue; // Skip if we can't get MAC
-        }
+// Print latency percentiles, loss and reordering since start
+static void report_latency(struct gen_thread_args *args) {
+    static struct lat_hist hist;
+    struct lat_totals t;
 
-        // Try to find Linux interface by MAC address
-        if (get_linux_ifname_by_mac(&addr, linux_ifname, sizeof(linux_ifname)) != 0) {
-            continue; // Skip ports without Linux interfaces
-        }
+    lat_collect(args, &hist, &t);
+    const uint64_t lost = t.sent > t.received ? t.sent - t.received : 0;
+    printf("Latency (us): min %.2f avg %.2f p50 %.2f p99 %.2f p99.9 %.2f max %.2f\n",
+           hist.min / 1e3, hist.count ? (double)hist.sum / hist.count / 1e3 : 0.0,
+           lat_percentile(&hist, 0.5) / 1e3, lat_percentile(&hist, 0.99) / 1e3,
+           lat_percentile(&hist, 0.999) / 1e3, hist.max / 1e3);
+    printf("Probes: sent %" PRIu64 " received %" PRIu64 " lost %" PRIu64 " (%.4f%%)"
+           " reordered %" PRIu64 ", other rx %" PRIu64 "\n",
+           t.sent, t.received, lost, t.sent ? 100.0 * lost / t.sent : 0.0,
+           t.reordered, t.rx - t.received);
+}
 
-        printf("Port %u:\n", port_id);
+// Mempool iterator: build the template packet into every mbuf of the pool.
+// Allocation only resets the mbuf metadata, not the data, so a packet
+// taken from the pool is ready to send once its lengths are set.
+static void template_init(struct rte_mempool *mp, void *opaque, void *obj, unsigned idx) {
+    (void)mp;
+    (void)opaque;
+    (void)idx;
+    create_udp_packet((struct rte_mbuf *)obj, gconf.pkt_size);
+}
 
-        // Get device name
-        retval = rte_eth_dev_get_name_by_port(port_id, name);
-        if (retval == 0) {
-            printf("  DPDK Name: %s\n", name);
+// Create the template pool of a tx queue. Mbufs wait in the tx ring until
+// the NIC has sent them, so the pool covers the ring, the cache and the
+// bursts in flight.
+static struct rte_mempool *template_pool_create(uint16_t queue, int socket) {
+    const struct bfdev_port *p = bfdev_port_get(gconf.port);
+    unsigned n = p->nb_txd + RTE_MEMPOOL_CACHE_MAX_SIZE + 4 * MAX_TX_BURST;
+    char name[RTE_MEMPOOL_NAMESIZE];
+    struct rte_mempool *pool;
 
-            // Check if this is a representor port
-            if (strstr(name, "_representor_")) {
-                printf("  Type: Representor Port\n");
+    snprintf(name, sizeof(name), "GEN_POOL_%u", queue);
+    pool = bfdev_pool_create(name, rte_align32pow2(n + 1) - 1, 0, socket);
+    if (pool == NULL)
+        return NULL;
+    rte_mempool_obj_iter(pool, template_init, NULL);
+    return pool;
+}
+
+// Fraction of the peak rate that the profile asks for t seconds after start
+static double profile_scale(double t) {
+    double phase = fmod(t, gconf.profile_period) / gconf.profile_period;
+
+    switch (gconf.profile) {
+    case PROFILE_STEP:
+        return (floor(phase * gconf.profile_steps) + 1) / gconf.profile_steps;
+    case PROFILE_SWEEP:
+        return phase;
+    case PROFILE_SINE:
+        return (1 + sin(2 * M_PI * phase)) / 2;
+    default:
+        return 1;
+    }
+}
+
+// Send template packets on one tx queue, as fast as the queue takes them
+// or paced to gconf.rate_pps / nb_queues. Pacing is a token bucket filled
+// from the TSC: a burst is only built from the tokens that have accumulated,
+// and at most tb_depth tokens are kept, which bounds the burst size on the
+// wire after an idle period.
+// Packets that the queue does not take are kept and sent first on the
+// next call, so tx backpressure slows the loop down instead of dropping.
+static void packet_generator(struct gen_thread_args *args) {
+    struct rte_mbuf *bufs[MAX_TX_BURST];
+    struct gen_stats *stats = &lcore_stats[rte_lcore_id()];
+    const uint16_t port = gconf.port;
+    const uint16_t queue = args->queue;
+    const uint16_t burst = gconf.burst;
+    const uint16_t size = gconf.pkt_size;
+    const int rewrite = gconf.rewrite;
+    const int latency = gconf.latency;
+    uint16_t sizes[MAX_TX_BURST];
+    uint16_t head = 0, nb_pending = 0;
+    struct flow_state flows;
+    const int paced = gconf.rate_pps > 0;
+    const double hz = rte_get_tsc_hz();
+    const double peak_pps = gconf.rate_pps / gconf.nb_queues;
+    const uint64_t profile_cycles = rte_get_tsc_hz() / PROFILE_UPDATE_HZ;
+    const uint64_t start_tsc = rte_rdtsc();
+    uint64_t last_tsc = start_tsc, next_profile_tsc = start_tsc;
+    double pkts_per_cycle = 0, tokens = 0;
+
+    // queues start at different points of the counting fields, so that
+    // they do not all send the same flows at the same time
+    for (int k = 0; k < NB_FIELDS; k++) {
+        const struct field_spec *f = &gconf.fields[k];
+        flows.cur[k] = f->min + queue % (f->max - f->min + 1);
+    }
+    flows.imix_idx = queue % RTE_DIM(imix_sizes);
+    flows.seq = 0;
+
+    printf("Starting packet generator on lcore %u: port %u queue %u, burst %u",
+           rte_lcore_id(), port, queue, burst);
+    if (paced)
+        printf(", %.3f Mpps %s\n", peak_pps / 1e6, profile_names[gconf.profile]);
+    else
+        printf("\n");
+
+    while (1) {
+        if (nb_pending == 0) {
+            uint16_t n = burst;
+            if (paced) {
+                uint64_t now = rte_rdtsc();
+                if (unlikely(now >= next_profile_tsc)) {
+                    pkts_per_cycle = peak_pps * profile_scale((now - start_tsc) / hz) / hz;
+                    next_profile_tsc = now + profile_cycles;
+                }
+                tokens += (now - last_tsc) * pkts_per_cycle;
+                last_tsc = now;
+                if (tokens > gconf.tb_depth)
+                    tokens = gconf.tb_depth;
+                if (tokens < 1)
+                    continue;
+                if (tokens < n)
+                    n = (uint16_t)tokens;
+            }
+            if (unlikely(rte_pktmbuf_alloc_bulk(args->pool, bufs, n) != 0)) {
+                stats->alloc_fail++;
+                continue;
+            }
+            tokens -= n;
+            if (latency)
+                stamp_seq(bufs, n, queue, &flows);
+            if (rewrite) {
+                rewrite_burst(bufs, n, &flows, sizes);
+            } else {
+                for (uint16_t i = 0; i < n; i++) {
+                    bufs[i]->data_len = size;
+                    bufs[i]->pkt_len = size;
+                    sizes[i] = size;
+                }
             }
+            head = 0;
+            nb_pending = n;
         }
 
-        printf("  Linux Interface: %s\n", linux_ifname);
+        if (latency)
+            stamp_tsc(bufs + head, nb_pending);
+        uint16_t nb_tx = rte_eth_tx_burst(port, queue, bufs + head, nb_pending);
+        stats->tx += nb_tx;
+        for (uint16_t i = head; i < head + nb_tx; i++)
+            stats->tx_bytes += sizes[i];
+        if (unlikely(nb_tx < nb_pending))
+            stats->tx_full++;
+        head += nb_tx;
+        nb_pending -= nb_tx;
+    }
+}
 
-        printf("  MAC Address: %02X:%02X:%02X:%02X:%02X:%02X\n",
-               addr.addr_bytes[0], addr.addr_bytes[1],
-               addr.addr_bytes[2], addr.addr_bytes[3],
-               addr.addr_bytes[4], addr.addr_bytes[5]);
+// Lcore function wrapper (must return int and take void*)
+static int generator_lcore(void *arg) {
+    packet_generator((struct gen_thread_args *)arg);
+    return 0;
+}
 
-        // Get device info
-        retval = rte_eth_dev_info_get(port_id, &dev_info);
-        if (retval != 0) {
-            printf("  Error getting device info: %s\n", strerror(-retval));
-            continue;
-        }
+// Metrics (-M and the /bfdev/metrics telemetry command), read from the
+// stats slots on the main lcore like the report
+struct gen_metrics {
+    struct gen_thread_args *args;
+    unsigned nb_args;
+};
 
-        // Print driver name
-        if (dev_info.driver_name) {
-            printf("  Driver: %s\n", dev_info.driver_name);
-        }
+static const struct {
+    const char *name;
+    const char *help;
+    size_t offset;
+} tx_metrics[] = {
+    {"generator_tx_packets_total", "Packets sent", offsetof(struct gen_stats, tx)},
+    {"generator_tx_bytes_total", "Bytes sent, without CRC", offsetof(struct gen_stats, tx_bytes)},
+    {"generator_tx_full_total", "tx_burst calls that did not take the whole burst",
+     offsetof(struct gen_stats, tx_full)},
+    {"generator_alloc_fail_total", "Failed mbuf allocations", offsetof(struct gen_stats, alloc_fail)},
+};
+
+static void gen_metrics(struct bfdev_metrics *m, void *arg) {
+    static struct lat_hist hist;
+    static const double quantiles[] = {0.5, 0.99, 0.999};
+    const struct gen_metrics *g = arg;
+    struct gen_stats cur[BFDEV_MAX_QUEUES];
+    struct lat_totals t;
+
+    for (unsigned i = 0; i < g->nb_args; i++)
+        cur[i] = lcore_stats[g->args[i].lcore_id];
+    for (unsigned k = 0; k < RTE_DIM(tx_metrics); k++) {
+        bfdev_metrics_family(m, tx_metrics[k].name, BFDEV_METRIC_COUNTER, tx_metrics[k].help);
+        for (unsigned i = 0; i < g->nb_args; i++)
+            bfdev_metrics_add(m, *(const uint64_t *)((const char *)&cur[i] + tx_metrics[k].offset),
+                              "lcore=\"%u\",queue=\"%u\"", g->args[i].lcore_id, g->args[i].queue);
+    }
+    if (!gconf.latency)
+        return;
+
+    // the histogram as quantiles since start, 0 and 1 are min and max
+    lat_collect(g->args, &hist, &t);
+    bfdev_metrics_family(m, "generator_latency_ns", BFDEV_METRIC_GAUGE,
+                         "Probe latency since start, by quantile");
+    if (hist.count > 0) {
+        bfdev_metrics_add(m, hist.min, "quantile=\"0\"");
+        for (unsigned i = 0; i < RTE_DIM(quantiles); i++)
+            bfdev_metrics_add(m, lat_percentile(&hist, quantiles[i]), "quantile=\"%g\"",
+                              quantiles[i]);
+        bfdev_metrics_add(m, hist.max, "quantile=\"1\"");
+    }
+    bfdev_metrics_family(m, "generator_latency_ns_sum", BFDEV_METRIC_COUNTER,
+                         "Sum of the probe latencies");
+    bfdev_metrics_add(m, hist.sum, NULL);
+    bfdev_metrics_family(m, "generator_probes_sent_total", BFDEV_METRIC_COUNTER, "Probes sent");
+    bfdev_metrics_add(m, t.sent, NULL);
+    bfdev_metrics_family(m, "generator_probes_received_total", BFDEV_METRIC_COUNTER,
+                         "Probes received");
+    bfdev_metrics_add(m, t.received, NULL);
+    bfdev_metrics_family(m, "generator_probes_reordered_total", BFDEV_METRIC_COUNTER,
+                         "Probes older than one already received");
+    bfdev_metrics_add(m, t.reordered, NULL);
+    bfdev_metrics_family(m, "generator_rx_other_total", BFDEV_METRIC_COUNTER,
+                         "Received packets that are not probes");
+    bfdev_metrics_add(m, t.rx - t.received, NULL);
+}
+
+// Sleep until the tsc deadline, collecting the metrics meanwhile
+static void main_wait(uint64_t deadline) {
+    while (rte_rdtsc() < deadline) {
+        bfdev_metrics_update(0);
+        usleep(100000);
+    }
+}
+
+// Print per-thread and total tx rates every interval_s seconds.
+// Runs on the main lcore and never returns.
+static void report_stats(struct gen_thread_args *args, unsigned nb_args,
+                         unsigned interval_s) {
+    const uint64_t hz = rte_get_tsc_hz();
+    struct gen_stats prev[BFDEV_MAX_QUEUES];
+    uint64_t prev_tsc = rte_rdtsc();
 
-        // Print device name if available
-        if (dev_info.device && rte_dev_name(dev_info.device)) {
-            printf("  Device: %s\n", rte_dev_name(dev_info.device));
+    memset(prev, 0, sizeof(prev));
+    while (1) {
+        main_wait(prev_tsc + interval_s * hz);
+        uint64_t now = rte_rdtsc();
+        double secs = (double)(now - prev_tsc) / hz;
+        uint64_t total_tx = 0, d_tx = 0, d_bytes = 0, d_full = 0;
+
+        printf("\n=== Generator stats (%.2f s) ===\n", secs);
+        if (gconf.rate_pps > 0)
+            printf("Target: %.3f Mpps peak, profile %s\n", gconf.rate_pps / 1e6,
+                   profile_names[gconf.profile]);
+        printf("%5s %5s %9s %9s %9s %14s %12s %10s\n",
+               "lcore", "queue", "tx Mpps", "L2 Gbps", "L1 Gbps", "tx total",
+               "tx full", "no mbuf");
+        for (unsigned i = 0; i < nb_args; i++) {
+            // snapshot the slot once, it keeps changing under us
+            struct gen_stats cur = lcore_stats[args[i].lcore_id];
+            uint64_t tx = cur.tx - prev[i].tx;
+            uint64_t bytes = cur.tx_bytes - prev[i].tx_bytes;
+            uint64_t full = cur.tx_full - prev[i].tx_full;
+            prev[i] = cur;
+
+            printf("%5u %5u %9.3f %9.3f %9.3f %14" PRIu64 " %12" PRIu64 " %10" PRIu64 "\n",
+                   args[i].lcore_id, args[i].queue, tx / secs / 1e6,
+                   (bytes + tx * RTE_ETHER_CRC_LEN) * 8 / secs / 1e9,
+                   (bytes + tx * WIRE_OVERHEAD) * 8 / secs / 1e9,
+                   cur.tx, cur.tx_full, cur.alloc_fail);
+            total_tx += cur.tx;
+            d_tx += tx;
+            d_bytes += bytes;
+            d_full += full;
         }
+        printf("%5s %5s %9.3f %9.3f %9.3f %14" PRIu64 " %12" PRIu64 "\n",
+               "total", "", d_tx / secs / 1e6,
+               (d_bytes + d_tx * RTE_ETHER_CRC_LEN) * 8 / secs / 1e9,
+               (d_bytes + d_tx * WIRE_OVERHEAD) * 8 / secs / 1e9,
+               total_tx, d_full);
+        if (gconf.latency)
+            report_latency(args);
 
-        // Print capabilities
-        printf("  Max RX queues: %u\n", dev_info.max_rx_queues);
-        printf("  Max TX queues: %u\n", dev_info.max_tx_queues);
-
-        // Print link status
-        struct rte_eth_link link;
-        retval = rte_eth_link_get_nowait(port_id, &link);
-        if (retval == 0) {
-            printf("  Link Status: %s\n", 
-                   link.link_status ? "UP" : "DOWN");
-            if (link.link_status) {
-                printf("  Link Speed: %u Mbps\n", link.link_speed);
-                printf("  Link Duplex: %s\n",
-                       link.link_duplex == RTE_ETH_LINK_FULL_DUPLEX ? "Full" : "Half");
-            }
+        prev_tsc = now;
+    }
+}
+
+// Parse a rate such as 500kpps, 2.5mpps or 10gbps. Bit rates are L1 rates
+// (with preamble and inter-frame gap) and set *is_bps.
+static int parse_rate(const char *str, double *rate, int *is_bps) {
+    static const struct {
+        const char *suffix;
+        double mult;
+        int bps;
+    } units[] = {
+        {"pps", 1, 0}, {"kpps", 1e3, 0}, {"mpps", 1e6, 0},
+        {"bps", 1, 1}, {"kbps", 1e3, 1}, {"mbps", 1e6, 1}, {"gbps", 1e9, 1},
+    };
+    char *end;
+
+    *rate = strtod(str, &end);
+    if (end == str || *rate < 0)
+        return -1;
+    if (*end == '\0') {
+        *is_bps = 0;
+        return 0;
+    }
+    for (unsigned i = 0; i < RTE_DIM(units); i++) {
+        if (strcasecmp(end, units[i].suffix) == 0) {
+            *rate *= units[i].mult;
+            *is_bps = units[i].bps;
+            return 0;
         }
+    }
+    return -1;
+}
 
-        printf("\n");
+// Parse one value of a field: a MAC, an IPv4 address or a number
+static int parse_field_value(int field, const char *str, uint64_t *v) {
+    char *end;
+
+    switch (field) {
+    case FIELD_SMAC:
+    case FIELD_DMAC: {
+        struct rte_ether_addr addr;
+        if (rte_ether_unformat_addr(str, &addr) != 0)
+            return -1;
+        *v = 0;
+        for (int i = 0; i < RTE_ETHER_ADDR_LEN; i++)
+            *v = (*v << 8) | addr.addr_bytes[i];
+        return 0;
+    }
+    case FIELD_SIP:
+    case FIELD_DIP: {
+        struct in_addr addr;
+        if (inet_pton(AF_INET, str, &addr) != 1)
+            return -1;
+        *v = ntohl(addr.s_addr);
+        return 0;
+    }
+    default:
+        *v = strtoull(str, &end, 0);
+        if (end == str || *end != '\0')
+            return -1;
+        if (*v > (field == FIELD_VLAN ? RTE_VLAN_ID_MASK : UINT16_MAX))
+            return -1;
+        return 0;
+    }
+}
+
+// Parse a field spec: <field>=<value>, <field>=<min>-<max> to count up
+// from min to max, or <field>=<min>-<max>,rand for uniform random values
+static int parse_field(const char *str) {
+    char buf[128];
+    char *val, *dash, *comma;
+    int field;
+
+    snprintf(buf, sizeof(buf), "%s", str);
+    val = strchr(buf, '=');
+    if (val == NULL)
+        return -1;
+    *val++ = '\0';
+    for (field = 0; field < NB_FIELDS; field++) {
+        if (strcmp(buf, field_names[field]) == 0)
+            break;
+    }
+    if (field == NB_FIELDS)
+        return -1;
+
+    struct field_spec *f = &gconf.fields[field];
+    f->random = 0;
+    comma = strchr(val, ',');
+    if (comma != NULL) {
+        *comma++ = '\0';
+        if (strcmp(comma, "rand") != 0)
+            return -1;
+        f->random = 1;
+    }
+    dash = strchr(val, '-');
+    if (dash != NULL)
+        *dash++ = '\0';
+    if (parse_field_value(field, val, &f->min) != 0)
+        return -1;
+    f->max = f->min;
+    if (dash != NULL && parse_field_value(field, dash, &f->max) != 0)
+        return -1;
+    if (f->max < f->min)
+        return -1;
+    if (field == FIELD_VLAN)
+        gconf.vlan = 1;
+    return 0;
+}
+
+// Parse a packet size: <size>, <min>-<max> (uniform random) or imix
+static int parse_size(const char *str) {
+    char *end;
+
+    if (strcmp(str, "imix") == 0) {
+        gconf.size_mode = SIZE_IMIX;
+        gconf.pkt_size = imix_sizes[0];
+        return 0;
+    }
+    unsigned long min = strtoul(str, &end, 0);
+    unsigned long max = min;
+    if (end == str)
+        return -1;
+    if (*end == '-') {
+        const char *max_str = end + 1;
+        max = strtoul(max_str, &end, 0);
+        if (end == max_str)
+            return -1;
+    }
+    if (*end != '\0' || min < MIN_PKT_SIZE || max > MAX_PKT_SIZE || max < min)
+        return -1;
+    gconf.size_mode = min == max ? SIZE_FIXED : SIZE_RANGE;
+    gconf.pkt_size = min;
+    gconf.pkt_size_max = max;
+    return 0;
+}
+
+// Average frame size without CRC, to turn a bit rate into a packet rate
+static double avg_pkt_size(void) {
+    switch (gconf.size_mode) {
+    case SIZE_RANGE:
+        return (gconf.pkt_size + gconf.pkt_size_max) / 2.0;
+    case SIZE_IMIX: {
+        double sum = 0;
+        for (unsigned i = 0; i < RTE_DIM(imix_sizes); i++)
+            sum += imix_sizes[i];
+        return sum / RTE_DIM(imix_sizes);
+    }
+    default:
+        return gconf.pkt_size;
     }
-    printf("============================\n\n");
 }
 
+// Parse a profile: const, step[:steps[:period]], sweep[:period] or sine[:period]
+static int parse_profile(const char *str) {
+    char buf[64];
+    char *save;
+    char *name;
+    char *arg;
 
+    snprintf(buf, sizeof(buf), "%s", str);
+    name = strtok_r(buf, ":", &save);
+    if (name == NULL)
+        return -1;
+    unsigned i;
+    for (i = 0; i < RTE_DIM(profile_names); i++) {
+        if (strcmp(name, profile_names[i]) == 0)
+            break;
+    }
+    if (i == RTE_DIM(profile_names))
+        return -1;
+    gconf.profile = i;
+
+    if (gconf.profile == PROFILE_STEP && (arg = strtok_r(NULL, ":", &save)) != NULL) {
+        gconf.profile_steps = atoi(arg);
+        if (gconf.profile_steps < 1)
+            return -1;
+    }
+    if ((arg = strtok_r(NULL, ":", &save)) != NULL) {
+        gconf.profile_period = atof(arg);
+        if (gconf.profile_period <= 0)
+            return -1;
+    }
+    return 0;
+}
+
+static void usage(const char *prgname) {
+    printf("Usage: %s [EAL options] -- [-q nb_queues] [-s pkt_size] [-f field=spec]... [-b burst] [-r rate] [-t depth] [-p profile] [-L rx_port] [-T interval] [-M [addr:]port] <port>\n", prgname);
+    printf("  -q nb_queues: tx queues, one lcore per queue (default 1)\n");
+    printf("  -s pkt_size: frame size in bytes without CRC, %u..%u (default %u),\n",
+           MIN_PKT_SIZE, MAX_PKT_SIZE, DEFAULT_PKT_SIZE);
+    printf("     min-max for uniform random sizes, or imix\n");
+    printf("  -f field=spec: vary a header field, field is one of smac, dmac, vlan, sip, dip,\n");
+    printf("     sport, dport and spec is value, min-max (count up) or min-max,rand\n");
+    printf("  -b burst: packets per tx burst, 1..%u (default %u)\n",
+           MAX_TX_BURST, BFDEV_MAX_PKT_BURST);
+    printf("  -r rate: total target rate, e.g. 1000pps, 500kpps, 2.5mpps, 10gbps (L1), default: unlimited\n");
+    printf("  -t depth: token bucket depth in packets per queue, the largest burst sent\n");
+    printf("     after an idle period (default: the burst size)\n");
+    printf("  -p profile: how the rate changes over time, the -r rate is the peak:\n");
+    printf("     const, step[:steps[:period]], sweep[:period], sine[:period] (default const,\n");
+    printf("     10 steps, period 10 s)\n");
+    printf("  -L rx_port: send latency probes and receive them on rx_port (can be <port>),\n");
+    printf("     one more lcore per queue receives\n");
+    printf("  -T interval: stats report interval in seconds, 0 to disable (default 1)\n");
+    printf("  -M [addr:]port: serve the metrics to Prometheus on http://addr:port/metrics\n");
+    printf("     (default address 127.0.0.1); they are also in DPDK telemetry, /bfdev/metrics\n");
+    printf("Example: sudo %s -l 0-4 -- -q 4 2\n", prgname);
+    printf("Example: sudo %s -l 0-2 -- -q 2 -r 10gbps -p step:10:5 2\n", prgname);
+    printf("Example: sudo %s -l 0-2 -- -q 2 -s imix -f sip=10.0.0.1-10.0.0.254 -f sport=1024-65535,rand 2\n", prgname);
+}
 
 int main(int argc, char **argv)
 {
-    // main DPDK init
-	rte_eal_init(argc, argv); 
-    int log_level = rte_log_get_global_level();
+    // main DPDK init - this consumes EAL arguments and returns new argc
+    int ret = rte_eal_init(argc, argv);
+    if (ret < 0)
+        rte_exit(EXIT_FAILURE, "Error with EAL initialization\n");
+    argc -= ret;
+    argv += ret;
 
-    list_ports();
+    unsigned stats_interval = 1;
+    double rate = 0;
+    int rate_bps = 0;
+    const char *metrics_listen = NULL;
+    int opt;
+    optind = 1;
+    while ((opt = getopt(argc, argv, "q:s:f:b:r:t:p:L:T:M:")) != -1) {
+        switch (opt) {
+        case 'q':
+            gconf.nb_queues = atoi(optarg);
+            if (gconf.nb_queues < 1 || gconf.nb_queues > BFDEV_MAX_QUEUES) {
+                usage(argv[0]);
+                rte_exit(EXIT_FAILURE, "Error: nb_queues must be in 1..%d\n", BFDEV_MAX_QUEUES);
+            }
+            break;
+        case 's':
+            if (parse_size(optarg) != 0) {
+                usage(argv[0]);
+                rte_exit(EXIT_FAILURE, "Error: pkt_size must be imix or in %u..%u\n",
+                         MIN_PKT_SIZE, MAX_PKT_SIZE);
+            }
+            break;
+        case 'f':
+            if (parse_field(optarg) != 0) {
+                usage(argv[0]);
+                rte_exit(EXIT_FAILURE, "Error: invalid field spec '%s'\n", optarg);
+            }
+            break;
+        case 'b':
+            gconf.burst = atoi(optarg);
+            if (gconf.burst < 1 || gconf.burst > MAX_TX_BURST) {
+                usage(argv[0]);
+                rte_exit(EXIT_FAILURE, "Error: burst must be in 1..%u\n", MAX_TX_BURST);
+            }
+            break;
+        case 'r':
+            if (parse_rate(optarg, &rate, &rate_bps) != 0) {
+                usage(argv[0]);
+                rte_exit(EXIT_FAILURE, "Error: invalid rate '%s'\n", optarg);
+            }
+            break;
+        case 't':
+            gconf.tb_depth = atoi(optarg);
+            break;
+        case 'p':
+            if (parse_profile(optarg) != 0) {
+                usage(argv[0]);
+                rte_exit(EXIT_FAILURE, "Error: invalid profile '%s'\n", optarg);
+            }
+            break;
+        case 'L':
+            gconf.latency = 1;
+            gconf.rx_port = atoi(optarg);
+            break;
+        case 'T':
+            stats_interval = atoi(optarg);
+            break;
+        case 'M':
+            metrics_listen = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            rte_exit(EXIT_FAILURE, "Error: invalid option\n");
+        }
+    }
+    if (argc - optind != 1) {
+        bfdev_list_ports();
+        usage(argv[0]);
+        rte_exit(EXIT_FAILURE, "Error: exactly 1 port argument required\n");
+    }
+    gconf.port = atoi(argv[optind]);
+
+    if (gconf.vlan)
+        gconf.l3_off = sizeof(struct rte_ether_hdr) + sizeof(struct rte_vlan_hdr);
+    gconf.ip_base_sum = ip_base_sum();
+    gconf.rewrite = gconf.size_mode != SIZE_FIXED;
+    for (int k = 0; k < NB_FIELDS; k++)
+        gconf.rewrite |= gconf.fields[k].max > gconf.fields[k].min;
 
-    // Initialize the port
-    uint16_t selected_port_id = 0;
-    port_init(selected_port_id);
+    gconf.rate_pps = rate_bps ? rate / ((avg_pkt_size() + WIRE_OVERHEAD) * 8) : rate;
+    if (gconf.tb_depth == 0)
+        gconf.tb_depth = gconf.burst;
+    if (gconf.profile != PROFILE_CONST && gconf.rate_pps == 0)
+        rte_exit(EXIT_FAILURE, "Error: a rate profile needs a rate (-r)\n");
+
+    if (gconf.latency) {
+        uint16_t min_size = gconf.l3_off + sizeof(struct rte_ipv4_hdr) +
+                            sizeof(struct rte_udp_hdr) + sizeof(struct probe_hdr);
+        if (gconf.pkt_size < min_size)
+            rte_exit(EXIT_FAILURE, "Error: latency probes need packets of at least %u bytes\n",
+                     min_size);
+        if (gconf.rx_port >= RTE_MAX_ETHPORTS)
+            rte_exit(EXIT_FAILURE, "Error: invalid rx port\n");
+    }
+
+    unsigned nb_threads = gconf.latency ? 2 * gconf.nb_queues : gconf.nb_queues;
+    if (rte_lcore_count() - 1 < nb_threads)
+        rte_exit(EXIT_FAILURE, "Need at least %u worker lcores for %u queues. Run with -l 0-%u\n",
+                 nb_threads, gconf.nb_queues, nb_threads);
+
+    // Initialize the port. Every packet comes from one template pool per
+    // queue with refcnt 1, so fast-free is safe. The tx checksum offload is
+    // only used by the rewrite path: fixed templates keep the checksum
+    // written at startup. In latency mode the probes are received on as many
+    // rx queues as there are tx queues.
+    struct bfdev_port_conf conf;
+    bfdev_port_conf_init(&conf);
+    conf.nb_txq = gconf.nb_queues;
+    if (gconf.latency && gconf.rx_port == gconf.port)
+        conf.nb_rxq = gconf.nb_queues;
+    conf.offloads = BFDEV_OFFLOAD_FAST_FREE;
+    if (gconf.rewrite)
+        conf.offloads |= BFDEV_OFFLOAD_TX_CKSUM;
+    if (bfdev_port_init(gconf.port, &conf) != 0)
+        rte_exit(EXIT_FAILURE, "Cannot init port %u\n", gconf.port);
+    gconf.tx_ip_cksum = gconf.rewrite &&
+        (bfdev_port_get(gconf.port)->tx_offloads & RTE_ETH_TX_OFFLOAD_IPV4_CKSUM);
+    if (gconf.latency && gconf.rx_port != gconf.port) {
+        bfdev_port_conf_init(&conf);
+        conf.nb_rxq = gconf.nb_queues;
+        if (bfdev_port_init(gconf.rx_port, &conf) != 0)
+            rte_exit(EXIT_FAILURE, "Cannot init port %u\n", gconf.rx_port);
+    }
+
+    struct gen_thread_args args[BFDEV_MAX_QUEUES];
+    memset(args, 0, sizeof(args));
+    for (uint16_t q = 0; q < gconf.nb_queues; q++) {
+        args[q].queue = q;
+        args[q].pool = template_pool_create(q, bfdev_port_get(gconf.port)->socket);
+        if (args[q].pool == NULL)
+            rte_exit(EXIT_FAILURE, "Cannot create template pool for queue %u\n", q);
+    }
+
+    // Run each tx thread, then each latency receiver, on its own worker
+    // lcore. The main lcore reports stats.
+    struct rx_thread_args rx_args[BFDEV_MAX_QUEUES];
+    unsigned launched = 0;
+    unsigned lcore_id;
+    RTE_LCORE_FOREACH_WORKER(lcore_id) {
+        if (launched == nb_threads)
+            break;
+        if (launched < gconf.nb_queues) {
+            args[launched].lcore_id = lcore_id;
+            rte_eal_remote_launch(generator_lcore, &args[launched], lcore_id);
+        } else {
+            struct rx_thread_args *ra = &rx_args[launched - gconf.nb_queues];
+            ra->queue = launched - gconf.nb_queues;
+            ra->lcore_id = lcore_id;
+            rte_eal_remote_launch(receiver_lcore, ra, lcore_id);
+        }
+        launched++;
+    }
+    struct gen_metrics metrics = { .args = args, .nb_args = gconf.nb_queues };
+    if (bfdev_metrics_init(metrics_listen) != 0)
+        rte_exit(EXIT_FAILURE, "Cannot serve the metrics on %s\n", metrics_listen);
+    bfdev_metrics_register(bfdev_metrics_ports, NULL);
+    bfdev_metrics_register(gen_metrics, &metrics);
+    printf("Press Ctrl+C to stop\n\n");
 
-	
-	internal_mbuf_init();
-	packet_generator(selected_port_id);
+    if (stats_interval > 0)
+        report_stats(args, gconf.nb_queues, stats_interval);
+    else
+        main_wait(UINT64_MAX);
+    rte_eal_mp_wait_lcore();
 
-	return 0;
+    return 0;
 }
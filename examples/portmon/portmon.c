@@ -0,0 +1,113 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <signal.h>
+
+#include <rte_eal.h>
+#include <rte_ethdev.h>
+#include <rte_cycles.h>
+
+#include "bfdev_port.h"
+#include "bfdev_xmon.h"
+
+// Watches the drops of the ports of another DPDK process (wire, generator,
+// testpmd...) as a secondary process: reading stats and xstats does not
+// touch the queues, so the primary keeps forwarding undisturbed.
+
+static volatile sig_atomic_t force_quit;
+
+static void signal_handler(int signum) {
+    if (signum == SIGINT || signum == SIGTERM)
+        force_quit = 1;
+}
+
+static void usage(const char *prgname) {
+    printf("Usage: %s [EAL options] -- [-T interval] [-n top] [-c count] [port]...\n", prgname);
+    printf("  -T interval: seconds between two samples (default 1)\n");
+    printf("  -n top: drop xstats listed per port (default %u)\n", BFDEV_XMON_TOP);
+    printf("  -c count: stop after that many reports (default: until Ctrl+C)\n");
+    printf("  port: ports to watch (default: all)\n");
+    printf("Example: sudo %s -l 7 --proc-type=secondary -- -T 5 0 1\n", prgname);
+}
+
+int main(int argc, char **argv)
+{
+    int ret = rte_eal_init(argc, argv);
+    if (ret < 0)
+        rte_exit(EXIT_FAILURE, "Error with EAL initialization\n");
+    argc -= ret;
+    argv += ret;
+
+    unsigned interval_s = 1;
+    unsigned top = BFDEV_XMON_TOP;
+    unsigned count = 0;
+    int opt;
+    optind = 1;
+    while ((opt = getopt(argc, argv, "T:n:c:h")) != -1) {
+        switch (opt) {
+        case 'T':
+            interval_s = atoi(optarg);
+            if (interval_s < 1)
+                rte_exit(EXIT_FAILURE, "Error: the interval must be at least 1 s\n");
+            break;
+        case 'n':
+            top = atoi(optarg);
+            break;
+        case 'c':
+            count = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            rte_exit(EXIT_FAILURE, "Error: invalid option\n");
+        }
+    }
+
+    uint16_t ports[RTE_MAX_ETHPORTS];
+    unsigned nb_ports = 0;
+    if (optind < argc) {
+        for (int i = optind; i < argc && nb_ports < RTE_MAX_ETHPORTS; i++)
+            ports[nb_ports++] = atoi(argv[i]);
+    } else {
+        uint16_t port;
+        RTE_ETH_FOREACH_DEV(port)
+            ports[nb_ports++] = port;
+    }
+    if (nb_ports == 0) {
+        bfdev_list_ports();
+        rte_exit(EXIT_FAILURE, "Error: no port to watch\n");
+    }
+    if (rte_eal_process_type() == RTE_PROC_PRIMARY)
+        printf("Note: no process forwards on these ports; to watch one, run with "
+               "--proc-type=secondary and its --file-prefix\n");
+
+    struct bfdev_xmon *mon = bfdev_xmon_create(ports, nb_ports);
+    if (mon == NULL)
+        rte_exit(EXIT_FAILURE, "Cannot read the stats of the ports\n");
+
+    signal(SIGINT, signal_handler);
+    signal(SIGTERM, signal_handler);
+    const uint64_t hz = rte_get_tsc_hz();
+    uint64_t next = rte_rdtsc() + interval_s * hz;
+    for (unsigned n = 0; !force_quit && (count == 0 || n < count); n++) {
+        while (rte_rdtsc() < next && !force_quit)
+            usleep(100000);
+        if (force_quit)
+            break;
+        next += interval_s * hz;
+        if (bfdev_xmon_sample(mon) != 0)
+            printf("Some ports could not be read, did the primary process exit?\n");
+
+        char now[32];
+        time_t t = time(NULL);
+        strftime(now, sizeof(now), "%H:%M:%S", localtime(&t));
+        printf("\n=== Port drops at %s (%u s) ===\n", now, interval_s);
+        bfdev_xmon_report(mon, stdout, top, NULL);
+        fflush(stdout);
+    }
+
+    bfdev_xmon_free(mon);
+    rte_eal_cleanup();
+    return 0;
+}
@@ -2,302 +2,279 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
-#include <ifaddrs.h>
-#include <sys/socket.h>
-#include <linux/if_packet.h>
-#include <net/if.h>
-#include <rte_bus_pci.h>  // for RTE_DEV_TO_PCI
+#include <getopt.h>
+#include <signal.h>
+#include <netinet/in.h>
 #include <rte_eal.h>
 #include <rte_ethdev.h>
 #include <rte_dev.h>
 #include <rte_flow.h>
 #include <rte_mbuf.h>
 
+#include "bfdev_port.h"
+#include "bfdev_flow.h"
+#include "bfdev_rule_table.h"
+#include "bfdev_metrics.h"
 
-// DPDK port init
-// To configure the steering engine, we need to open a DPDK port. 
-// To open a DPDK port, we need to set up some queues and buffers, 
-// (even if we aren't going to use them)
-#define RING_SIZE 1024
-#define NUM_MBUFS 1024
-#define MBUF_CACHE_SIZE 250
-
-
-// Open a DPDK port, allocate it with a mbuf ring of the given size
-int port_init(uint16_t port) {
-	struct rte_mempool *mbuf_pool;
-	struct rte_eth_conf port_conf;
-	const uint16_t rx_rings = 1, tx_rings = 1;
-	uint16_t nb_rxd = RING_SIZE;
-	uint16_t nb_txd = RING_SIZE;
-	int retval;
-	uint16_t q;
-	struct rte_eth_dev_info dev_info;
-	struct rte_eth_txconf txconf;
-
-	if (!rte_eth_dev_is_valid_port(port))
-		return -1;
-
-	// allocate the mbuf pool
-	mbuf_pool = rte_pktmbuf_pool_create("MBUF_POOL", NUM_MBUFS,
-		MBUF_CACHE_SIZE, 0, RTE_MBUF_DEFAULT_BUF_SIZE, rte_socket_id());
-	if (mbuf_pool == NULL) {
-		int required_mem = (NUM_MBUFS * (2048 + sizeof(struct rte_mbuf))) * 1 + (MBUF_CACHE_SIZE * sizeof(struct rte_mbuf) * 1);
-		rte_exit(EXIT_FAILURE, "Cannot create mbuf pool. the memory required was: %i\n", required_mem);
-	}
-
-	// set up the port configuration
-	memset(&port_conf, 0, sizeof(struct rte_eth_conf));
-
-	// get device info
-	retval = rte_eth_dev_info_get(port, &dev_info);
-	if (retval != 0) {
-		printf("Error during getting device (port %u) info: %s\n",
-				port, strerror(-retval));
-		return retval;
-	}
-
-	// if (dev_info.tx_offload_capa & RTE_ETH_TX_OFFLOAD_MBUF_FAST_FREE)
-	// 	port_conf.txmode.offloads |=
-	// 		RTE_ETH_TX_OFFLOAD_MBUF_FAST_FREE;
-
-	/* Configure the Ethernet device. */
-	retval = rte_eth_dev_configure(port, rx_rings, tx_rings, &port_conf);
-	if (retval != 0)
-		return retval;
-
-	retval = rte_eth_dev_adjust_nb_rx_tx_desc(port, &nb_rxd, &nb_txd);
-	if (retval != 0)
-		return retval;
-
-	/* Allocate and set up 1 RX queue per Ethernet port. */
-	for (q = 0; q < rx_rings; q++) {
-		retval = rte_eth_rx_queue_setup(port, q, nb_rxd,
-				rte_eth_dev_socket_id(port), NULL, mbuf_pool);
-		if (retval < 0)
-			return retval;
-	}
-
-	txconf = dev_info.default_txconf;
-	txconf.offloads = port_conf.txmode.offloads;
-	/* Allocate and set up 1 TX queue per Ethernet port. */
-	for (q = 0; q < tx_rings; q++) {
-		retval = rte_eth_tx_queue_setup(port, q, nb_txd,
-				rte_eth_dev_socket_id(port), &txconf);
-		if (retval < 0)
-			return retval;
-	}
-
-	/* Starting Ethernet port. 8< */
-	retval = rte_eth_dev_start(port);
-	/* >8 End of starting of ethernet port. */
-	if (retval < 0)
-		return retval;
-
-	/* Display the port MAC address. */
-	struct rte_ether_addr addr;
-	retval = rte_eth_macaddr_get(port, &addr);
-	if (retval != 0)
-		return retval;
-
-	printf("Port %u MAC: %02" PRIx8 " %02" PRIx8 " %02" PRIx8
-			   " %02" PRIx8 " %02" PRIx8 " %02" PRIx8 "\n",
-			port, RTE_ETHER_ADDR_BYTES(&addr));
-
-	/* Enable RX in promiscuous mode for the Ethernet device. */
-	retval = rte_eth_promiscuous_enable(port);
-	/* End of setting RX port in promiscuous mode. */
-	if (retval != 0)
-		return retval;
-
-	return 0;
-}
-
+// Rule installed when no rule file is given.
 // target mac: A0:88:C2:AB:7E:A2 -- p0, should be port # 2 on blue2
-struct rte_ether_addr target_mac = { .addr_bytes = {0xA0, 0x88, 0xC2, 0xAB, 0x7E, 0xA2} }; 
+#define DEFAULT_RULE "1 dst_mac=A0:88:C2:AB:7E:A2 drop"
+#define DEFAULT_PORT 2
+#define DEFAULT_MAX_RULES 65536
+#define DEFAULT_QUERY_RATE 4096   // counter queries per second
+#define POLL_HZ 10
+
+static volatile sig_atomic_t force_quit;
+static volatile sig_atomic_t reload;
+static volatile sig_atomic_t dump;
+
+static void signal_handler(int signum) {
+    if (signum == SIGHUP)
+        reload = 1;
+    else if (signum == SIGUSR1)
+        dump = 1;
+    else
+        force_quit = 1;
+}
 
-// Add a rule to port dpdk_port_id to drop packets with dst mac == target_mac
-int add_test_flow_rule(uint16_t dpdk_port_id) {
-    // Define the flow rule attributes
-    struct rte_flow_attr attr = {
-        .ingress = 1,
-    };
+static void usage(const char *prog) {
+    printf("Usage: %s [EAL options] -- [options] [port]\n"
+           "  -f FILE  install the rules of FILE (default: \"%s\")\n"
+           "  -G N     install N generated rules (dst_ip=10.0.0.0 + i, udp, drop)\n"
+           "  -g N     flow group of the rules (default 0)\n"
+           "  -P N     priority of the rules (default 0)\n"
+           "  -x       install transfer (eswitch) rules\n"
+           "  -s       create rules one by one with rte_flow_create\n"
+           "  -m N     most rules the rule table holds (default %u)\n"
+           "  -c       count the packets and bytes of every rule\n"
+           "  -Q N     counter queries per second (default %u)\n"
+           "  -M [ADDR:]PORT  serve the metrics to Prometheus on http://ADDR:PORT/metrics\n"
+           "           (default address 127.0.0.1), also in DPDK telemetry /bfdev/metrics\n"
+           "  port     DPDK port to install on (default %u)\n"
+           "Signals: SIGHUP reloads the rule file and applies the changes,\n"
+           "SIGUSR1 lists the installed rules (with their counters with -c),\n"
+           "SIGINT/SIGTERM remove them and exit.\n",
+           prog, DEFAULT_RULE, DEFAULT_MAX_RULES, DEFAULT_QUERY_RATE, DEFAULT_PORT);
+}
 
-    // Define the pattern to match destination MAC address
-    struct rte_flow_item_eth eth_spec = {
-        .dst = target_mac,
-    };
-    struct rte_flow_item_eth eth_mask = {
-        .dst = {.addr_bytes = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF}},
-    };
-    struct rte_flow_item pattern[] = {
-        {
-            .type = RTE_FLOW_ITEM_TYPE_ETH,
-            .spec = &eth_spec,
-            .mask = &eth_mask,
-        },
-        {
-            .type = RTE_FLOW_ITEM_TYPE_END,
-        },
-    };
-    // Define the action to drop the packet
-    struct rte_flow_action action_drop = {
-        .type = RTE_FLOW_ACTION_TYPE_DROP,
-    };
-    struct rte_flow_action actions[] = {
-        action_drop,
-        {
-            .type = RTE_FLOW_ACTION_TYPE_END,
-        },
-    };
+// Rules of the same shape with distinct destination addresses, to measure
+// the insertion rate
+static struct bfdev_rule *generate_rules(unsigned n) {
+    struct bfdev_rule *rules = calloc(n, sizeof(*rules));
+
+    if (rules == NULL)
+        return NULL;
+    for (unsigned i = 0; i < n; i++) {
+        rules[i].id = i + 1;
+        rules[i].match = BFDEV_MATCH_DST_IP | BFDEV_MATCH_PROTO;
+        rules[i].dst_ip = (10u << 24) + i;
+        rules[i].dst_ip_len = 32;
+        rules[i].proto = IPPROTO_UDP;
+        rules[i].action = BFDEV_ACTION_DROP;
+    }
+    return rules;
+}
 
-    // Validate and create the flow rule
-    struct rte_flow_error error;
-    struct rte_flow *flow = rte_flow_create(dpdk_port_id, &attr, pattern, actions, &error);
-    if (!flow) {
-        printf("Flow creation failed: %s\n", error.message);
+// The ruleset to apply: the rule file, generated rules or the default rule.
+// Returns 0 or -1 (error logged).
+static int load_rules(const char *rule_file, unsigned nb_generated,
+                      struct bfdev_rule **rules, unsigned *nb_rules) {
+    if (rule_file != NULL)
+        return bfdev_rules_load(rule_file, rules, nb_rules);
+    if (nb_generated > 0) {
+        *nb_rules = nb_generated;
+        *rules = generate_rules(nb_generated);
+    } else {
+        *nb_rules = 1;
+        *rules = malloc(sizeof(**rules));
+        if (*rules != NULL && bfdev_rule_parse(DEFAULT_RULE, *rules) != 0) {
+            free(*rules);
+            *rules = NULL;
+        }
+    }
+    if (*rules == NULL) {
+        printf("Cannot allocate %u rules\n", *nb_rules);
         return -1;
     }
-
-    printf("Flow rule created successfully\n");
-	return 0;
+    return 0;
 }
 
+static void print_diff(const struct bfdev_rule_table *table,
+                       const struct bfdev_rule_diff *diff) {
+    unsigned touched = diff->added + diff->changed + diff->removed;
 
+    printf("Applied in %.3f s: %u added, %u changed, %u removed, %u unchanged, %u failed"
+           " (%.0f rule changes/s), %u rules installed\n",
+           diff->seconds, diff->added, diff->changed, diff->removed, diff->unchanged,
+           diff->failed, diff->seconds > 0 ? touched / diff->seconds : 0.0,
+           bfdev_rule_table_count(table));
+}
 
-// Helper function to get Linux interface name by MAC address
-int get_linux_ifname_by_mac(struct rte_ether_addr *mac, char *ifname, size_t ifname_len) {
-    struct ifaddrs *ifaddr, *ifa;
-    int found = 0;
-
-    if (getifaddrs(&ifaddr) == -1) {
-        return -1;
-    }
-    // Iterate through all interfaces
-    for (ifa = ifaddr; ifa != NULL; ifa = ifa->ifa_next) {
-        if (ifa->ifa_addr == NULL)
-            continue;
-
-        // Check if this is a packet socket (has MAC address)
-        if (ifa->ifa_addr->sa_family == AF_PACKET) {
-            struct sockaddr_ll *s = (struct sockaddr_ll*)ifa->ifa_addr;
+// Metrics (-M and the /bfdev/metrics telemetry command): the installed
+// rules and, with -c, the counters of each rule as of their last query
+struct rule_metrics {
+    const struct bfdev_rule_table *table;
+    int count;
+};
 
-            // Compare MAC addresses
-            if (s->sll_halen == RTE_ETHER_ADDR_LEN &&
-                memcmp(s->sll_addr, mac->addr_bytes, RTE_ETHER_ADDR_LEN) == 0) {
-                snprintf(ifname, ifname_len, "%s", ifa->ifa_name);
-                found = 1;
-                break;
-            }
-        }
-    }
-    freeifaddrs(ifaddr);
-    return found ? 0 : -1;
+static void rule_hits(const struct bfdev_rule *rule, const struct bfdev_rule_counters *c,
+                      void *arg) {
+    bfdev_metrics_add(arg, c->hits, "id=\"%u\"", rule->id);
 }
 
-void list_ports(void) {
-    uint16_t port_id;
-    uint16_t nb_ports;
-    struct rte_eth_dev_info dev_info;
-    struct rte_ether_addr addr;
-    char name[RTE_ETH_NAME_MAX_LEN];
-    char linux_ifname[IFNAMSIZ];
-    int retval;
+static void rule_bytes(const struct bfdev_rule *rule, const struct bfdev_rule_counters *c,
+                       void *arg) {
+    bfdev_metrics_add(arg, c->bytes, "id=\"%u\"", rule->id);
+}
 
-    nb_ports = rte_eth_dev_count_avail();
-    printf("\n=== Available DPDK Ports ===\n");
-    printf("Total ports available: %u\n\n", nb_ports);
+static void rule_metrics(struct bfdev_metrics *m, void *arg) {
+    const struct rule_metrics *r = arg;
 
-    if (nb_ports == 0) {
-        printf("No DPDK ports found!\n");
+    bfdev_metrics_family(m, "rte_rule_installed_rules", BFDEV_METRIC_GAUGE,
+                         "Rules installed on the port");
+    bfdev_metrics_add(m, bfdev_rule_table_count(r->table), NULL);
+    if (!r->count)
         return;
-    }
-
-    RTE_ETH_FOREACH_DEV(port_id) {
-        // Get MAC address first
-        retval = rte_eth_macaddr_get(port_id, &addr);
-        if (retval != 0) {
-            continue; // Skip if we can't get MAC
-        }
+    bfdev_metrics_family(m, "rte_rule_hits_total", BFDEV_METRIC_COUNTER,
+                         "Packets that hit the rule");
+    bfdev_rule_table_foreach(r->table, rule_hits, m);
+    bfdev_metrics_family(m, "rte_rule_bytes_total", BFDEV_METRIC_COUNTER,
+                         "Bytes of the packets that hit the rule");
+    bfdev_rule_table_foreach(r->table, rule_bytes, m);
+}
 
-        // Try to find Linux interface by MAC address
-        if (get_linux_ifname_by_mac(&addr, linux_ifname, sizeof(linux_ifname)) != 0) {
-            continue; // Skip ports without Linux interfaces
+int main(int argc, char **argv)
+{
+    const char *rule_file = NULL;
+    unsigned nb_generated = 0;
+    unsigned max_rules = DEFAULT_MAX_RULES;
+    unsigned query_rate = DEFAULT_QUERY_RATE;
+    int force_sync = 0;
+    const char *metrics_listen = NULL;
+    struct bfdev_flow_attr attr = {0};
+    int opt;
+
+    int ret = rte_eal_init(argc, argv);
+    if (ret < 0)
+        rte_exit(EXIT_FAILURE, "Error with EAL initialization\n");
+    argc -= ret;
+    argv += ret;
+
+    while ((opt = getopt(argc, argv, "f:G:g:P:m:cQ:xsM:h")) != -1) {
+        switch (opt) {
+        case 'f':
+            rule_file = optarg;
+            break;
+        case 'G':
+            nb_generated = strtoul(optarg, NULL, 0);
+            break;
+        case 'g':
+            attr.group = strtoul(optarg, NULL, 0);
+            break;
+        case 'P':
+            attr.priority = strtoul(optarg, NULL, 0);
+            break;
+        case 'm':
+            max_rules = strtoul(optarg, NULL, 0);
+            break;
+        case 'c':
+            attr.count = 1;
+            break;
+        case 'Q':
+            query_rate = strtoul(optarg, NULL, 0);
+            break;
+        case 'x':
+            attr.transfer = 1;
+            break;
+        case 's':
+            force_sync = 1;
+            break;
+        case 'M':
+            metrics_listen = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            rte_exit(EXIT_FAILURE, "Invalid options\n");
         }
-
-        printf("Port %u:\n", port_id);
-
-        // Get device name
-        retval = rte_eth_dev_get_name_by_port(port_id, name);
-        if (retval == 0) {
-            printf("  DPDK Name: %s\n", name);
-
-            // Check if this is a representor port
-            if (strstr(name, "_representor_")) {
-                printf("  Type: Representor Port\n");
+    }
+    uint16_t selected_port_id = DEFAULT_PORT;
+    if (optind < argc)
+        selected_port_id = strtoul(argv[optind], NULL, 0);
+
+    bfdev_list_ports();
+
+    // To configure the steering engine, we need to open a DPDK port.
+    // To open a DPDK port, we need to set up some queues and buffers,
+    // (even if we aren't going to use them). No packets are sent or
+    // received, so no offloads are needed and small rings will do.
+    // One async flow queue lets the rules be installed in batches.
+    struct bfdev_port_conf conf;
+    bfdev_port_conf_init(&conf);
+    conf.offloads = 0;
+    conf.nb_rxd = 64;
+    conf.nb_txd = 64;
+    conf.flow_queues = force_sync ? 0 : 1;
+    conf.flow_counters = attr.count ? max_rules : 0;
+    if (bfdev_port_init(selected_port_id, &conf) != 0)
+        rte_exit(EXIT_FAILURE, "Cannot init port %u\n", selected_port_id);
+
+    struct bfdev_rule_table *table = bfdev_rule_table_create(selected_port_id, &attr,
+                                                             max_rules);
+    if (table == NULL)
+        rte_exit(EXIT_FAILURE, "Cannot create the rule table\n");
+
+    struct rule_metrics metrics = { .table = table, .count = attr.count };
+    if (bfdev_metrics_init(metrics_listen) != 0)
+        rte_exit(EXIT_FAILURE, "Cannot serve the metrics on %s\n", metrics_listen);
+    bfdev_metrics_register(bfdev_metrics_ports, NULL);
+    bfdev_metrics_register(rule_metrics, &metrics);
+
+    signal(SIGINT, signal_handler);
+    signal(SIGTERM, signal_handler);
+    signal(SIGHUP, signal_handler);
+    signal(SIGUSR1, signal_handler);
+
+    // the first apply installs everything, later ones only the changes
+    unsigned tick = 0;
+    reload = 1;
+    while (!force_quit) {
+        if (reload) {
+            struct bfdev_rule *rules;
+            unsigned nb_rules;
+            struct bfdev_rule_diff diff;
+            reload = 0;
+            if (load_rules(rule_file, nb_generated, &rules, &nb_rules) == 0) {
+                bfdev_rule_table_apply(table, rules, nb_rules, &diff);
+                print_diff(table, &diff);
+                free(rules);
             }
+            printf("Flow rules are active. SIGHUP to reload, Ctrl+C to exit.\n");
         }
-
-        printf("  Linux Interface: %s\n", linux_ifname);
-
-        printf("  MAC Address: %02X:%02X:%02X:%02X:%02X:%02X\n",
-               addr.addr_bytes[0], addr.addr_bytes[1],
-               addr.addr_bytes[2], addr.addr_bytes[3],
-               addr.addr_bytes[4], addr.addr_bytes[5]);
-
-        // Get device info
-        retval = rte_eth_dev_info_get(port_id, &dev_info);
-        if (retval != 0) {
-            printf("  Error getting device info: %s\n", strerror(-retval));
-            continue;
-        }
-
-        // Print driver name
-        if (dev_info.driver_name) {
-            printf("  Driver: %s\n", dev_info.driver_name);
+        if (dump) {
+            dump = 0;
+            if (attr.count)
+                bfdev_rule_table_dump_counters(table, stdout, 0);
+            else
+                bfdev_rule_table_dump(table, stdout);
         }
-
-        // Print device name if available
-        if (dev_info.device && rte_dev_name(dev_info.device)) {
-            printf("  Device: %s\n", rte_dev_name(dev_info.device));
+        // a slice of the counters every tick, a report of the rules that
+        // see traffic every second
+        if (attr.count) {
+            bfdev_rule_table_poll(table, RTE_MAX(query_rate / POLL_HZ, 1u));
+            if (++tick % POLL_HZ == 0 &&
+                bfdev_rule_table_dump_counters(table, stdout, 1) > 0)
+                printf("\n");
         }
-
-        // Print capabilities
-        printf("  Max RX queues: %u\n", dev_info.max_rx_queues);
-        printf("  Max TX queues: %u\n", dev_info.max_tx_queues);
-
-        // Print link status
-        struct rte_eth_link link;
-        retval = rte_eth_link_get_nowait(port_id, &link);
-        if (retval == 0) {
-            printf("  Link Status: %s\n", 
-                   link.link_status ? "UP" : "DOWN");
-            if (link.link_status) {
-                printf("  Link Speed: %u Mbps\n", link.link_speed);
-                printf("  Link Duplex: %s\n",
-                       link.link_duplex == RTE_ETH_LINK_FULL_DUPLEX ? "Full" : "Half");
-            }
-        }
-
-        printf("\n");
+        bfdev_metrics_update(0);
+        usleep(1000000 / POLL_HZ);
     }
-    printf("============================\n\n");
-}
-
-
-int main(int argc, char **argv)
-{
-	rte_eal_init(argc, argv);
-    int log_level = rte_log_get_global_level();
-    printf("Current log level: %d\n", log_level);
 
-	list_ports();    
-	uint16_t selected_port_id = 2;
-    port_init(selected_port_id);
-	add_test_flow_rule(selected_port_id);
-    printf("Flow rule is active. Press Ctrl+C to exit.\n");
-    while (1) {
-        sleep(1);
-    }	
-	return 0;
+    bfdev_metrics_stop();
+    printf("Removing %u rules\n", bfdev_rule_table_count(table));
+    bfdev_rule_table_flush(table);
+    bfdev_rule_table_free(table);
+    rte_eth_dev_stop(selected_port_id);
+    rte_eth_dev_close(selected_port_id);
+    rte_eal_cleanup();
+    return 0;
 }
@@ -0,0 +1,52 @@
+#!/bin/bash
+# Measure the cost of the software classifier (-A): run the wire on a pcap
+# replayed in a loop, once forwarding blindly and once classifying every
+# packet against a generated ruleset, and compare the rx rates.
+#
+#   ./bench_classifier.sh [nb_rules] [nb_flows] [seconds] [min_percent]
+#
+# Needs scapy and root (or a user that can run DPDK with --no-huge).
+set -e
+
+NB_RULES=${1:-1024}
+NB_FLOWS=${2:-4096}
+SECONDS_PER_RUN=${3:-10}
+MIN_PERCENT=${4:-90}
+WIRE=${WIRE:-$(dirname "$0")/wire}
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+# NB_FLOWS udp flows of 64 byte frames
+python3 - "$WORK/flows.pcap" "$NB_FLOWS" <<'PY'
+import sys
+from scapy.all import Ether, IP, UDP, Raw, wrpcap
+n = int(sys.argv[2])
+wrpcap(sys.argv[1], [Ether() / IP(src="10.1.%d.%d" % (i >> 8 & 255, i & 255), dst="10.2.0.1") /
+                     UDP(sport=1024 + i % 60000, dport=4789) / Raw(b"x" * 18)
+                     for i in range(n)])
+PY
+
+# rules that miss the traffic, so both runs forward the same packets and
+# the difference is the lookup, plus one that marks everything at the end
+for ((i = 0; i < NB_RULES - 1; i++)); do
+    echo "$((i + 1)) src_ip=192.168.$((i >> 8 & 255)).$((i & 255))/32 proto=udp dst_port=$((i % 1000 + 1)) drop"
+done > "$WORK/rules.txt"
+echo "$NB_RULES dst_ip=10.2.0.0/16 proto=udp mark=1" >> "$WORK/rules.txt"
+
+# average total rx Mpps of a run, skipping the first two reports
+run() {
+    timeout -s INT "$SECONDS_PER_RUN" "$WIRE" -l 0-2 --no-huge \
+        --vdev=net_pcap0,rx_pcap="$WORK/flows.pcap",infinite_rx=1 \
+        --vdev=net_null0,no-rx=1 -- "$@" 0 1 2>/dev/null |
+        awk '/Final wire stats/ { exit } $1 == "total" && ++n > 2 { sum += $2; m++ } END { printf "%.3f\n", m ? sum / m : 0 }'
+}
+
+blind=$(run)
+classified=$(run -A "$WORK/rules.txt")
+echo "rules $NB_RULES flows $NB_FLOWS: blind $blind Mpps, classified $classified Mpps"
+awk -v b="$blind" -v c="$classified" -v min="$MIN_PERCENT" 'BEGIN {
+    pct = b > 0 ? 100 * c / b : 0
+    printf "classifier keeps %.1f%% of the blind rate (minimum %d%%): %s\n",
+           pct, min, pct >= min ? "PASS" : "FAIL"
+    exit pct >= min ? 0 : 1
+}'
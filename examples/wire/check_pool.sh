@@ -0,0 +1,54 @@
+#!/bin/bash
+# Check the mbuf pool sizing: a net_pcap port with infinite_rx copies every
+# packet of its pcap into an mbuf of the port's pool when its rx queue is set
+# up, and keeps them for the whole run. Replay a pcap of more packets than
+# the old fixed pool of 1024 mbufs held, and fail if the port ran out of
+# mbufs (rx_nombuf) or did not forward the burst at least once.
+#
+#   ./check_pool.sh [nb_packets] [seconds]
+#
+# The default of 2048 packets is twice the old pool, and fits the pool that
+# the sizing gives a port with one queue of 1024 descriptors on 3 lcores
+# (4095 mbufs). With the old pool the preload takes every mbuf, so nothing
+# is forwarded. Needs scapy and root (or a user that can run DPDK with
+# --no-huge).
+set -e
+
+NB_PACKETS=${1:-2048}
+SECONDS_PER_RUN=${2:-5}
+WIRE=${WIRE:-$(dirname "$0")/wire}
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+# NB_PACKETS udp frames of 106 bytes
+python3 - "$WORK/burst.pcap" "$NB_PACKETS" <<'PY'
+import sys
+from scapy.all import Ether, IP, UDP, Raw, wrpcap
+n = int(sys.argv[2])
+wrpcap(sys.argv[1], [Ether() / IP(dst="10.0.0.%d" % (i % 250)) / UDP(sport=1024 + i % 60000) /
+                     Raw(b"x" * 64) for i in range(n)])
+PY
+
+# -X adds the drops of each port by cause to every report. net_null frees
+# what it sends, so only the rx side holds mbufs.
+timeout -s INT "$SECONDS_PER_RUN" "$WIRE" -l 0-2 --no-huge \
+    --vdev=net_pcap0,rx_pcap="$WORK/burst.pcap",infinite_rx=1 \
+    --vdev=net_null0,no-rx=1 -- -T 1 -X 0 1 > "$WORK/wire.log" 2>&1 || true
+
+# the last report has the totals of the run
+read -r sent dropped <<< "$(awk '$1 == "total" { sent = $7; dropped = $8 }
+    END { printf "%d %d\n", sent, dropped }' "$WORK/wire.log")"
+nombuf=$(awk -F'[ ,]+' '/drops\/s:/ {
+    for (i = 2; i < NF; i++)
+        if ($i == "mbuf" && $(i - 1) == "no") nombuf += $(i + 1)
+} END { printf "%d\n", nombuf }' "$WORK/wire.log")
+grep -m1 "mbuf pool" "$WORK/wire.log" || true
+
+echo "burst of $NB_PACKETS packets: $sent forwarded, $dropped dropped, rx_nombuf $nombuf"
+if [ "$sent" -ge "$NB_PACKETS" ] && [ "$dropped" -eq 0 ] && [ "$nombuf" -eq 0 ]; then
+    echo "PASS"
+else
+    echo "FAIL (log below)"
+    cat "$WORK/wire.log"
+    exit 1
+fi
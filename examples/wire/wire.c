@@ -1,303 +1,2324 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <pcap/pcap.h>
 #include <rte_ethdev.h>
 #include <rte_dev.h>
 #include <rte_mbuf.h>
 #include <rte_ether.h>
 #include <rte_ip.h>
 #include <rte_udp.h>
+#include <rte_hash.h>
+#include <rte_hash_crc.h>
+#include <rte_ring.h>
+#include <rte_malloc.h>
+#include <rte_pause.h>
+#include <rte_power_intrinsics.h>
+#include <rte_interrupts.h>
+#include <rte_errno.h>
+#include <rte_bpf.h>
 
 #include <rte_launch.h>
 #include <rte_lcore.h>
+#include <rte_cycles.h>
 
-#include <ifaddrs.h>
-#include <sys/socket.h>
-#include <linux/if_packet.h>
-#include <net/if.h>
 #include <signal.h>
 
+#include "bfdev_port.h"
+#include "bfdev_flow.h"
+#include "bfdev_rule_table.h"
+#include "bfdev_acl.h"
+#include "bfdev_pcapng.h"
+#include "bfdev_metrics.h"
+#include "bfdev_xmon.h"
 
-/***  Helper functions to get info about available DPDK ports ***/
-int get_linux_ifname_by_mac(struct rte_ether_addr *mac, char *ifname, size_t ifname_len) {
-    struct ifaddrs *ifaddr, *ifa;
-    int found = 0;
+// Burst size histogram buckets: 1, 2-3, 4-7, 8-15, 16-31, 32
+#define BURST_HIST_BUCKETS 6
+static const char *burst_hist_names[BURST_HIST_BUCKETS] = {
+    "1", "2-3", "4-7", "8-15", "16-31", "32"
+};
+
+// Per-lcore forwarding counters. Each slot is written only by its own lcore
+// and sits in its own cache lines, so the forwarding loop never shares a
+// line with another core. The stats reporter only reads them.
+struct wire_stats {
+    uint64_t rx;
+    uint64_t tx;
+    uint64_t dropped;
+    uint64_t empty_polls;
+    uint64_t polls;
+    uint64_t burst_hist[BURST_HIST_BUCKETS];
+    uint64_t ct_new;          // flows added to the thread's flow table
+    uint64_t ct_evicted;      // software flows dropped from it after going idle
+    uint64_t ct_untracked;    // packets of new flows that did not fit
+    uint64_t reorder_gaps;    // sequence numbers the tx stage gave up on
+    uint64_t reorder_late;    // packets that came after their turn, sent out of order
+    uint64_t sleeps;          // times the thread went to sleep on an idle link
+    uint64_t sleep_tsc;       // cycles spent asleep
+    uint64_t wakes;           // sleeps that ended with traffic
+    uint64_t wake_tsc;        // sum of their wake latencies
+    uint64_t wake_max_tsc;
+    uint64_t tx_retries;      // extra tx_burst calls of the retry policy
+    uint64_t tx_recovered;    // packets they sent
+    uint64_t tx_flushes;      // tx buffer flushes on timeout or idle
+    uint64_t tx_dropped;      // packets the tx queue did not take, after the policy
+    uint64_t cap_mirrored;    // packets handed to the capture writer
+    uint64_t cap_dropped;     // mirror copies lost: capture ring full, or write errors
+    uint64_t cap_bytes;       // capture writer: bytes of the file
+#ifdef WIRE_PROFILE
+    uint64_t prof_rx_tsc;     // in rx_burst calls that returned packets
+    uint64_t prof_empty_tsc;  // in rx_burst calls that returned none
+    uint64_t prof_work_tsc;   // classification, tracking, VLAN restore, capture
+    uint64_t prof_tx_tsc;     // sending and tx buffer flushes
+#endif
+    struct bfdev_acl_stats acl;
+} __rte_cache_aligned;
+
+static struct wire_stats lcore_stats[RTE_MAX_LCORE];
+
+// Cycle profile of wire_ports() (make WIRE_PROFILE=1): each poll is cut in
+// laps timed with rte_rdtsc_precise(), whose counts go to the prof_*
+// counters of the thread. Without WIRE_PROFILE the laps compile to nothing.
+#ifdef WIRE_PROFILE
+#define PROF_START(lap) uint64_t lap = rte_rdtsc_precise()
+#define PROF_LAP(lap, acc) do {                 \
+        uint64_t prof_now_ = rte_rdtsc_precise(); \
+        (acc) += prof_now_ - (lap);             \
+        (lap) = prof_now_;                      \
+    } while (0)
+#else
+#define PROF_START(lap) do { } while (0)
+#define PROF_LAP(lap, acc) do { } while (0)
+#endif
+
+// Drop monitor of the ports (-X), sampled with each stats report
+static struct bfdev_xmon *xmon;
+
+// Packets asked of each rx_burst call (-b), at most BFDEV_MAX_PKT_BURST
+static uint16_t rx_burst = BFDEV_MAX_PKT_BURST;
+
+// Set by SIGINT/SIGTERM. The threads stop receiving, pass on what they
+// hold and return; the main lcore then stops the ports.
+static volatile sig_atomic_t force_quit;
+#define WIRE_DRAIN_US 100000      // longest a send is retried while stopping
+
+// Hardware offload (-H): transfer rules in the eswitch forward each port to
+// the other, so packets never reach the ARM cores. Punt rules (-P) have a
+// higher priority and send selected flows to the DPDK ports instead, where
+// wire_ports() forwards them in software.
+#define FWD_RULE_NET_TO_HOST 1
+#define FWD_RULE_HOST_TO_NET 2
+#define PUNT_RULE_ID_BASE 16      // punt rule i gets ids 16 + 2i and 16 + 2i + 1
+#define PUNT_PRIO 0
+#define FWD_PRIO 1
+#define MAX_HW_RULES 4096
+
+static struct bfdev_rule_table *hw_rules;
+static uint16_t hw_proxy;                    // port the transfer rules are created on
+static struct bfdev_rule *hw_punt;           // the punt rules, per direction
+static unsigned hw_nb_punt;
+
+// Connection tracking (-C N): each wire thread keeps the flows it forwards
+// in its own 5-tuple table, so the table has a single writer and needs no
+// lock. When a flow reaches N packets the thread hands it to the main lcore,
+// which installs an eswitch rule with an AGE action for it, so the rest of
+// the flow bypasses the ARM cores. When the rule ages out, the main lcore
+// removes it and hands the flow back to its thread, which forgets it. A flow
+// that a punt rule (-P) may match is never offloaded, its rule would be
+// shadowed by the punt rule. The main lcore changes the state of a flow it
+// was handed, so the state is read and written with atomics.
+#define CT_MAX_FLOWS (1 << 16)              // per thread
+#define CT_MAX_OFFLOADED (1 << 16)          // eswitch rules of offloaded flows
+#define CT_AGE 10                           // seconds, for offloaded flows
+#define CT_IDLE_SECONDS 30                  // software flows idle this long are evicted
+#define CT_SWEEP_PER_POLL 8                 // flow table entries checked per maintenance
+#define CT_MAINTAIN_POLLS 64                // maintenance at least every N polls
+#define CT_SERVICE_US 1000                  // main lcore offload service period
+#define CT_RULE_ID_BASE (1u << 24)
+
+struct ct_key {
+    uint32_t src_ip;
+    uint32_t dst_ip;
+    uint16_t src_port;
+    uint16_t dst_port;
+    uint8_t proto;
+    uint8_t pad[3];
+};
+
+enum ct_state {
+    CT_SOFTWARE = 0,    // forwarded by its thread, which owns the entry
+    CT_PENDING,         // handed to the main lcore for offload
+    CT_OFFLOADED,       // forwarded by the eswitch
+    CT_PUNTED,          // matches a punt rule, forwarded here until it goes idle
+};
+
+struct ct_flow {
+    struct ct_key key;
+    uint64_t packets;
+    uint64_t last_tsc;
+    enum ct_state state;
+    uint16_t thread;    // index of the owning thread
+    uint32_t rule_id;
+};
+
+// Flow table of one wire thread
+struct ct_table {
+    struct rte_hash *hash;
+    struct ct_flow *flows;       // indexed by hash position
+    struct rte_ring *done;       // flows handed back by the main lcore
+    uint32_t sweep_iter;
+} __rte_cache_aligned;
+
+static unsigned ct_threshold;                // packets before offload, 0 = off
+static struct ct_table ct_tables[2 * BFDEV_MAX_QUEUES];
+static struct rte_ring *ct_offload_ring;     // threads -> main lcore
+static struct ct_flow *ct_rules[CT_MAX_OFFLOADED];  // rule id - base -> flow
+static uint32_t ct_free_ids[CT_MAX_OFFLOADED];
+static unsigned ct_nb_free_ids;
+static uint64_t ct_installed, ct_aged, ct_failed, ct_punted;  // main lcore only
+
+// Pipeline mode (-W N): instead of one thread doing everything per
+// (direction, queue), each direction gets an rx stage, N worker stages and
+// a tx stage, each on its own lcore. The rx stage polls every rx queue of
+// the in_port and deals the packets to the workers in blocks of
+// WIRE_SEQ_BLOCK, the workers do the per-packet work (classification, VLAN
+// restore) and the tx stage sends on queue 0 of the out_port. Every pair of
+// stages is connected by a single-producer/single-consumer ring.
+//
+// With -R the rx stage numbers the packets and the tx stage puts them back
+// in order. Sequence number s belongs to worker (s / WIRE_SEQ_BLOCK) % N,
+// and each worker publishes how far it got, so the tx stage can tell a
+// packet that is still on its way from one a worker dropped.
+#define WIRE_MAX_WORKERS 16                 // per direction
+#define WIRE_RING_SIZE 1024
+#define WIRE_SEQ_BLOCK BFDEV_MAX_PKT_BURST
+#define WIRE_MAX_THREADS RTE_MAX_LCORE       // one per worker lcore
+
+enum wire_stage {
+    STAGE_INLINE = 0,   // rx, work and tx of one queue
+    STAGE_RX,
+    STAGE_WORKER,
+    STAGE_TX,
+    STAGE_CAPTURE,      // capture writer
+};
+
+// A ring between two stages, with the stats of its producer
+struct wire_ring {
+    struct rte_ring *ring;
+    uint32_t hwm;       // most entries the producer saw after an enqueue
+} __rte_cache_aligned;
+
+// 1 + the last sequence number a worker is done with
+struct wire_progress {
+    uint32_t seq;
+} __rte_cache_aligned;
+
+// The stages of one direction
+struct wire_pipeline {
+    uint16_t in_port;
+    uint16_t out_port;
+    uint16_t nb_queues;
+    unsigned nb_workers;
+    struct wire_ring to_worker[WIRE_MAX_WORKERS];
+    struct wire_ring to_tx[WIRE_MAX_WORKERS];
+    struct wire_progress done[WIRE_MAX_WORKERS];
+    int rx_stopped;                 // the rx stage returned
+    unsigned workers_stopped;       // the workers that returned
+};
+
+// Reorder window of a tx stage
+struct wire_reorder {
+    uint32_t next;      // next sequence number to send
+    uint32_t mask;      // window size - 1
+    unsigned buffered;
+    uint16_t nb_out;
+    struct rte_mbuf *out[BFDEV_MAX_PKT_BURST];
+    struct rte_mbuf *slots[];
+};
+
+static unsigned nb_workers;                  // per direction, 0 = no pipeline
+static int reorder;
+static int seqn_offset = -1;
+static struct wire_pipeline pipelines[2];
 
-    if (getifaddrs(&ifaddr) == -1) {
+static inline uint32_t *wire_seqn(struct rte_mbuf *m) {
+    return RTE_MBUF_DYNFIELD(m, seqn_offset, uint32_t *);
+}
+
+// Idle policy (-I): what a thread does when its polls come back empty.
+// After IDLE_PAUSE_POLLS empty polls in a row it pauses between polls, after
+// IDLE_SLEEP_POLLS it sleeps: until the NIC writes a descriptor (monitor),
+// until an rx interrupt (intr), or for a time that doubles up to
+// IDLE_MAX_SLEEP_US (sleep). The first packets end the streak and the
+// thread busy polls again. Threads that poll rings rather than a single
+// NIC queue fall back from monitor/intr to sleep.
+#define IDLE_PAUSE_POLLS 64
+#define IDLE_SLEEP_POLLS 1024
+#define IDLE_PAUSES 32                      // pause instructions between polls
+#define IDLE_MIN_SLEEP_US 8
+#define IDLE_MAX_SLEEP_US 512
+#define IDLE_INTR_TIMEOUT_MS 10             // bounds a missed interrupt
+
+enum idle_mode {
+    IDLE_POLL = 0,
+    IDLE_PAUSE,
+    IDLE_SLEEP,
+    IDLE_MONITOR,
+    IDLE_INTR,
+    IDLE_NB_MODES
+};
+static const char *idle_names[IDLE_NB_MODES] = {"poll", "pause", "sleep", "monitor", "intr"};
+
+// Idle state of one thread
+struct wire_idle {
+    enum idle_mode mode;     // of this thread, after fallbacks
+    uint16_t port;           // rx queues that wake the thread up
+    uint16_t queue;
+    uint16_t nb_queues;
+    uint32_t streak;         // empty polls in a row
+    uint32_t sleep_us;       // length of the next timed sleep
+    uint64_t mark_tsc;       // where the wake latency of the last sleep counts from, 0 = awake
+};
+
+// Thread argument structure: one wire thread per (direction, queue) pair,
+// or per stage in pipeline mode
+struct wire_thread_args {
+    uint16_t in_port;
+    uint16_t out_port;
+    uint16_t queue;
+    unsigned lcore_id;  // lcore the thread runs on, indexes lcore_stats
+    unsigned index;     // index of the thread, indexes ct_tables
+    const struct bfdev_acl *acl;  // classifier of in_port, or NULL
+    enum wire_stage stage;
+    struct wire_pipeline *pipe;   // pipeline stages only
+    unsigned worker;              // index of a worker stage
+    struct rte_ring *cap_ring;    // mirrored packets to the capture writer, or NULL
+    const struct wire_pair *pair; // the ports the thread forwards between, and their policies
+};
+
+// 5-tuple of an IPv4 TCP/UDP packet. Returns -1 for other packets, which
+// are forwarded without tracking.
+static inline int ct_parse(const struct rte_mbuf *m, struct ct_key *key) {
+    const struct rte_ether_hdr *eth = rte_pktmbuf_mtod(m, const struct rte_ether_hdr *);
+    uint16_t type = eth->ether_type;
+    uint32_t off = sizeof(*eth);
+
+    if (type == rte_cpu_to_be_16(RTE_ETHER_TYPE_VLAN)) {
+        const struct rte_vlan_hdr *vh = (const struct rte_vlan_hdr *)(eth + 1);
+        type = vh->eth_proto;
+        off += sizeof(*vh);
+    }
+    if (type != rte_cpu_to_be_16(RTE_ETHER_TYPE_IPV4) ||
+        m->data_len < off + sizeof(struct rte_ipv4_hdr))
+        return -1;
+    const struct rte_ipv4_hdr *ip = rte_pktmbuf_mtod_offset(m, const struct rte_ipv4_hdr *, off);
+    if ((ip->next_proto_id != IPPROTO_TCP && ip->next_proto_id != IPPROTO_UDP) ||
+        (ip->fragment_offset & rte_cpu_to_be_16(RTE_IPV4_HDR_MF_FLAG | RTE_IPV4_HDR_OFFSET_MASK)))
         return -1;
+    off += rte_ipv4_hdr_len(ip);
+    if (m->data_len < off + 2 * sizeof(rte_be16_t))
+        return -1;
+    const rte_be16_t *ports = rte_pktmbuf_mtod_offset(m, const rte_be16_t *, off);
+
+    key->src_ip = rte_be_to_cpu_32(ip->src_addr);
+    key->dst_ip = rte_be_to_cpu_32(ip->dst_addr);
+    key->src_port = rte_be_to_cpu_16(ports[0]);
+    key->dst_port = rte_be_to_cpu_16(ports[1]);
+    key->proto = ip->next_proto_id;
+    memset(key->pad, 0, sizeof(key->pad));
+    return 0;
+}
+
+// Count the packets of a burst per flow, and hand the flows that reach the
+// threshold to the main lcore
+static void ct_track(struct ct_table *ct, unsigned thread, struct rte_mbuf **bufs,
+                     uint16_t nb_rx, struct wire_stats *stats, uint64_t now) {
+    struct ct_key keys[BFDEV_MAX_PKT_BURST];
+    const void *key_ptrs[BFDEV_MAX_PKT_BURST];
+    int32_t pos[BFDEV_MAX_PKT_BURST];
+    unsigned nb = 0;
+
+    for (uint16_t i = 0; i < nb_rx; i++) {
+        if (ct_parse(bufs[i], &keys[nb]) == 0) {
+            key_ptrs[nb] = &keys[nb];
+            nb++;
+        }
     }
-    // Iterate through all interfaces
-    for (ifa = ifaddr; ifa != NULL; ifa = ifa->ifa_next) {
-        if (ifa->ifa_addr == NULL)
+    if (nb == 0)
+        return;
+    rte_hash_lookup_bulk(ct->hash, key_ptrs, nb, pos);
+
+    for (unsigned i = 0; i < nb; i++) {
+        int32_t p = pos[i];
+        if (p < 0) {
+            // a new flow, or one that an earlier packet of the burst added
+            p = rte_hash_add_key(ct->hash, &keys[i]);
+            if (p < 0) {
+                stats->ct_untracked++;
+                continue;
+            }
+            struct ct_flow *f = &ct->flows[p];
+            if (f->packets == 0) {
+                f->key = keys[i];
+                f->state = CT_SOFTWARE;
+                f->thread = thread;
+                stats->ct_new++;
+            }
+        }
+        struct ct_flow *f = &ct->flows[p];
+        const enum ct_state state = __atomic_load_n(&f->state, __ATOMIC_ACQUIRE);
+        // packets that race the rule installation are still forwarded here
+        if (state == CT_PUNTED)
+            f->last_tsc = now;
+        if (state != CT_SOFTWARE)
             continue;
+        f->packets++;
+        f->last_tsc = now;
+        if (f->packets >= ct_threshold) {
+            void *obj = f;
+            f->state = CT_PENDING;
+            if (rte_ring_enqueue_burst(ct_offload_ring, &obj, 1, NULL) != 1)
+                f->state = CT_SOFTWARE;  // retried on the next packet
+        }
+    }
+}
 
-        // Check if this is a packet socket (has MAC address)
-        if (ifa->ifa_addr->sa_family == AF_PACKET) {
-            struct sockaddr_ll *s = (struct sockaddr_ll*)ifa->ifa_addr;
+static void ct_forget(struct ct_table *ct, struct ct_flow *f) {
+    rte_hash_del_key(ct->hash, &f->key);
+    f->packets = 0;
+}
 
-            // Compare MAC addresses
-            if (s->sll_halen == RTE_ETHER_ADDR_LEN &&
-                memcmp(s->sll_addr, mac->addr_bytes, RTE_ETHER_ADDR_LEN) == 0) {
-                snprintf(ifname, ifname_len, "%s", ifa->ifa_name);
-                found = 1;
-                break;
-            }
+// Forget the flows handed back by the main lcore, and a few software flows
+// that went idle
+static void ct_maintain(struct ct_table *ct, struct wire_stats *stats, uint64_t now) {
+    const uint64_t idle_tsc = CT_IDLE_SECONDS * rte_get_tsc_hz();
+    void *done[BFDEV_MAX_PKT_BURST];
+    const void *key;
+    void *data;
+
+    unsigned n = rte_ring_sc_dequeue_burst(ct->done, done, BFDEV_MAX_PKT_BURST, NULL);
+    for (unsigned i = 0; i < n; i++)
+        ct_forget(ct, done[i]);
+
+    for (int k = 0; k < CT_SWEEP_PER_POLL; k++) {
+        int32_t p = rte_hash_iterate(ct->hash, &key, &data, &ct->sweep_iter);
+        if (p < 0) {
+            ct->sweep_iter = 0;
+            break;
         }
+        struct ct_flow *f = &ct->flows[p];
+        const enum ct_state state = __atomic_load_n(&f->state, __ATOMIC_ACQUIRE);
+        // a punted flow is counted again after it went idle, in case the
+        // punt rules changed
+        if ((state == CT_SOFTWARE || state == CT_PUNTED) && now - f->last_tsc > idle_tsc) {
+            ct_forget(ct, f);
+            stats->ct_evicted++;
+        }
+    }
+}
+
+// Tx policy (-t): what to do with the packets a tx queue did not take.
+// drop frees them at once. retry calls tx_burst up to N more times,
+// which rides out short hiccups at the price of stalling the thread. buffer
+// puts packets in an rte_eth_tx_buffer, sent when it holds TX_BUFFER_SIZE
+// packets, when the thread's polls come back empty, or N us after the last
+// flush; what the queue does not take then is dropped.
+enum tx_policy {
+    TX_DROP = 0,
+    TX_RETRY,
+    TX_BUFFER,
+    TX_NB_POLICIES
+};
+static const char *tx_policy_names[TX_NB_POLICIES] = {"drop", "retry", "buffer"};
+#define TX_DEFAULT_SPINS 32
+#define TX_DEFAULT_FLUSH_US 100
+#define TX_BUFFER_SIZE (4 * BFDEV_MAX_PKT_BURST)
+
+// Topology (-c): the pairs of ports the wire forwards between in one
+// process, each with its own queues, lcores and policies. Without -c the two
+// port arguments make a topology of one pair, with the policies of -t, -I
+// and -A that are also the defaults of the topology lines.
+#define WIRE_MAX_PAIRS (RTE_MAX_ETHPORTS / 2)
+
+struct wire_pair {
+    uint16_t ports[2];           // network side, host side
+    uint16_t nb_queues;          // 0 until the lcores are shared out
+    double pps;                  // expected rate of both directions, 0 = unknown
+    unsigned lcores[2 * BFDEV_MAX_QUEUES];  // pinned lcores, in thread order
+    unsigned nb_lcores;          // 0: picked by the wire
+    enum tx_policy tx_policy;
+    unsigned tx_spins;
+    unsigned tx_flush_us;
+    enum idle_mode idle_mode;
+    const char *acl_file;
+    struct bfdev_acl *acl[2];    // classifier of each receiving port
+};
+
+static struct wire_pair pairs[WIRE_MAX_PAIRS];
+static unsigned nb_pairs;
+static struct wire_pair pair_defaults = {
+    .tx_spins = TX_DEFAULT_SPINS,
+    .tx_flush_us = TX_DEFAULT_FLUSH_US,
+};
+
+// The tx queue of a thread
+struct wire_tx {
+    uint16_t port;
+    uint16_t queue;
+    enum tx_policy policy;
+    unsigned spins;                          // TX_RETRY only
+    struct wire_stats *stats;
+    struct rte_eth_dev_tx_buffer *buffer;   // TX_BUFFER only
+    uint64_t flush_tsc;                      // last flush
+    uint64_t flush_period;
+};
+
+// Send packets the tx queue did not take: up to tx->spins more tries, or
+// for up to WIRE_DRAIN_US while stopping. Returns the packets sent.
+static uint16_t tx_retry(struct wire_tx *tx, struct rte_mbuf **bufs, uint16_t n) {
+    uint16_t sent = 0;
+
+    if (force_quit) {
+        const uint64_t deadline = rte_rdtsc() + WIRE_DRAIN_US * rte_get_tsc_hz() / US_PER_S;
+        while (sent < n && rte_rdtsc() < deadline)
+            sent += rte_eth_tx_burst(tx->port, tx->queue, &bufs[sent], n - sent);
+        return sent;
+    }
+    for (unsigned i = 0; i < tx->spins && sent < n; i++) {
+        rte_pause();
+        sent += rte_eth_tx_burst(tx->port, tx->queue, &bufs[sent], n - sent);
+        tx->stats->tx_retries++;
+    }
+    tx->stats->tx_recovered += sent;
+    return sent;
+}
+
+// Error callback of the tx buffer
+static void tx_buffer_unsent(struct rte_mbuf **unsent, uint16_t count, void *userdata) {
+    struct wire_tx *tx = userdata;
+    uint16_t sent = force_quit ? tx_retry(tx, unsent, count) : 0;
+
+    tx->stats->tx += sent;
+    tx->stats->tx_dropped += count - sent;
+    tx->stats->dropped += count - sent;
+    rte_pktmbuf_free_bulk(&unsent[sent], count - sent);
+}
+
+static void tx_init(struct wire_tx *tx, const struct wire_pair *pair, uint16_t port,
+                    uint16_t queue, struct wire_stats *stats) {
+    memset(tx, 0, sizeof(*tx));
+    tx->port = port;
+    tx->queue = queue;
+    tx->policy = pair->tx_policy;
+    tx->spins = pair->tx_spins;
+    tx->stats = stats;
+    if (tx->policy != TX_BUFFER)
+        return;
+    tx->buffer = rte_zmalloc_socket("wire_tx_buffer", RTE_ETH_TX_BUFFER_SIZE(TX_BUFFER_SIZE),
+                                    0, rte_socket_id());
+    if (tx->buffer == NULL)
+        rte_exit(EXIT_FAILURE, "Cannot allocate the tx buffer of port %u\n", port);
+    rte_eth_tx_buffer_init(tx->buffer, TX_BUFFER_SIZE);
+    rte_eth_tx_buffer_set_err_callback(tx->buffer, tx_buffer_unsent, tx);
+    tx->flush_period = pair->tx_flush_us * rte_get_tsc_hz() / US_PER_S;
+    tx->flush_tsc = rte_rdtsc();
+}
+
+// Send a burst according to the tx policy. Packets that cannot be sent are
+// freed; while stopping they are retried for up to WIRE_DRAIN_US first.
+static inline void wire_send(struct wire_tx *tx, struct rte_mbuf **bufs, uint16_t n) {
+    struct wire_stats *stats = tx->stats;
+
+    if (tx->buffer != NULL) {
+        for (uint16_t i = 0; i < n; i++)
+            stats->tx += rte_eth_tx_buffer(tx->port, tx->queue, tx->buffer, bufs[i]);
+        return;
+    }
+    uint16_t nb_tx = rte_eth_tx_burst(tx->port, tx->queue, bufs, n);
+    if (unlikely(nb_tx < n) && (tx->policy == TX_RETRY || force_quit))
+        nb_tx += tx_retry(tx, &bufs[nb_tx], n - nb_tx);
+    stats->tx += nb_tx;
+    if (unlikely(nb_tx < n)) {
+        stats->dropped += n - nb_tx;
+        stats->tx_dropped += n - nb_tx;
+        rte_pktmbuf_free_bulk(&bufs[nb_tx], n - nb_tx);
+    }
+}
+
+// Flush the tx buffer when the thread goes idle (now), or when the flush
+// period is over
+static inline void wire_tx_flush(struct wire_tx *tx, int now) {
+    if (tx->buffer == NULL || tx->buffer->length == 0)
+        return;
+    uint64_t tsc = rte_rdtsc();
+    if (now || tsc - tx->flush_tsc >= tx->flush_period) {
+        tx->stats->tx += rte_eth_tx_buffer_flush(tx->port, tx->queue, tx->buffer);
+        tx->stats->tx_flushes++;
+        tx->flush_tsc = tsc;
+    }
+}
+
+// Enqueue on the ring to the next stage. Returns the packets enqueued.
+static inline unsigned wire_ring_put(struct wire_ring *r, struct rte_mbuf **bufs, unsigned n) {
+    unsigned free_space;
+    unsigned sent = rte_ring_enqueue_burst(r->ring, (void **)bufs, n, &free_space);
+    uint32_t used = rte_ring_get_capacity(r->ring) - free_space;
+
+    if (used > r->hwm)
+        r->hwm = used;
+    return sent;
+}
+
+// Set up idle mode mode for a thread polling nb_queues rx queues of port
+// from queue (nb_queues 0 for a thread polling rings)
+static void idle_init(struct wire_idle *st, enum idle_mode mode, uint16_t port, uint16_t queue,
+                      uint16_t nb_queues) {
+    memset(st, 0, sizeof(*st));
+    st->mode = mode;
+    st->port = port;
+    st->queue = queue;
+    st->nb_queues = nb_queues;
+    st->sleep_us = IDLE_MIN_SLEEP_US;
+
+    if (st->mode == IDLE_MONITOR) {
+        struct rte_cpu_intrinsics intr;
+        struct rte_power_monitor_cond pmc;
+        rte_cpu_get_intrinsics_support(&intr);
+        if (nb_queues != 1 || !intr.power_monitor ||
+            rte_eth_get_monitor_addr(port, queue, &pmc) != 0)
+            st->mode = IDLE_SLEEP;
+    } else if (st->mode == IDLE_INTR) {
+        if (nb_queues == 0 || !bfdev_port_get(port)->rx_intr)
+            st->mode = IDLE_SLEEP;
+        for (uint16_t q = 0; q < nb_queues && st->mode == IDLE_INTR; q++) {
+            if (rte_eth_dev_rx_intr_ctl_q(port, queue + q, RTE_EPOLL_PER_THREAD,
+                                          RTE_INTR_EVENT_ADD, NULL) != 0)
+                st->mode = IDLE_SLEEP;
+        }
+    }
+    if (st->mode != mode)
+        printf("lcore %u: %s not available, idle mode sleep\n", rte_lcore_id(),
+               idle_names[mode]);
+}
+
+// Wait for rx interrupts on the thread's queues, unless packets came in
+// before they were armed
+static void idle_intr_wait(struct wire_idle *st) {
+    struct rte_epoll_event ev[BFDEV_MAX_QUEUES];
+    int pending = 0;
+
+    for (uint16_t q = 0; q < st->nb_queues; q++) {
+        rte_eth_dev_rx_intr_enable(st->port, st->queue + q);
+        if (rte_eth_rx_queue_count(st->port, st->queue + q) > 0)
+            pending = 1;
+    }
+    if (!pending)
+        rte_epoll_wait(RTE_EPOLL_PER_THREAD, ev, st->nb_queues, IDLE_INTR_TIMEOUT_MS);
+    for (uint16_t q = 0; q < st->nb_queues; q++)
+        rte_eth_dev_rx_intr_disable(st->port, st->queue + q);
+}
+
+// An empty poll: back off according to the idle mode
+static void wire_idle(struct wire_idle *st, struct wire_stats *stats) {
+    if (st->mode == IDLE_POLL || ++st->streak < IDLE_PAUSE_POLLS)
+        return;
+    if (st->mode == IDLE_PAUSE || st->streak < IDLE_SLEEP_POLLS) {
+        for (int i = 0; i < IDLE_PAUSES; i++)
+            rte_pause();
+        return;
+    }
+
+    uint64_t start = rte_rdtsc();
+    switch (st->mode) {
+    case IDLE_MONITOR: {
+        struct rte_power_monitor_cond pmc;
+        if (rte_eth_get_monitor_addr(st->port, st->queue, &pmc) == 0)
+            rte_power_monitor(&pmc, start + IDLE_MAX_SLEEP_US * rte_get_tsc_hz() / US_PER_S);
+        break;
+    }
+    case IDLE_INTR:
+        idle_intr_wait(st);
+        break;
+    default:
+        rte_delay_us_sleep(st->sleep_us);
+        st->sleep_us = RTE_MIN(st->sleep_us * 2, IDLE_MAX_SLEEP_US);
+        break;
+    }
+    uint64_t end = rte_rdtsc();
+    stats->sleeps++;
+    stats->sleep_tsc += end - start;
+    // a timed sleep delays a packet that came in when it started, a wait
+    // on an event only by the time it takes to get back to polling
+    st->mark_tsc = st->mode == IDLE_SLEEP ? start : end;
+}
+
+// A poll with packets: count the wake latency if the thread slept
+static inline void wire_busy(struct wire_idle *st, struct wire_stats *stats) {
+    if (unlikely(st->mark_tsc != 0)) {
+        uint64_t lat = rte_rdtsc() - st->mark_tsc;
+        stats->wakes++;
+        stats->wake_tsc += lat;
+        if (lat > stats->wake_max_tsc)
+            stats->wake_max_tsc = lat;
+        st->mark_tsc = 0;
+        st->sleep_us = IDLE_MIN_SLEEP_US;
     }
-    freeifaddrs(ifaddr);
-    return found ? 0 : -1;
+    st->streak = 0;
+}
+
+// Capture (-w): the forwarding threads mirror the packets they forward to
+// a writer lcore, which writes them to a pcapng file. A mirrored packet is
+// the forwarded mbuf with one more reference, so nothing is copied on the
+// forwarding cores: the writer copies the data into its file buffer and
+// drops the reference once the NIC may long have sent the packet. -F keeps
+// only the packets a BPF filter accepts and -S one in N of those. When the
+// writer falls behind and a thread's capture ring is full, the mirror
+// copies are dropped, never the traffic.
+#define CAP_RING_SIZE 1024                  // per forwarding thread
+#define CAP_FLUSH_MS 100                    // file buffer written at least this often
+
+static const char *cap_file;
+static unsigned cap_sample = 1;
+static struct rte_bpf *cap_bpf;
+static struct bfdev_pcapng *cap_writer;
+static uint32_t cap_iface[RTE_MAX_ETHPORTS];        // pcapng interface of each port
+static struct rte_ring *cap_rings[WIRE_MAX_THREADS];
+static unsigned cap_nb_rings;
+static unsigned cap_stopped;                // forwarding threads that returned
+static int cap_tsc_offset = -1;
+static uint64_t cap_epoch_ns, cap_epoch_tsc;
+
+// When the packet was mirrored
+static inline uint64_t *cap_tsc(struct rte_mbuf *m) {
+    return RTE_MBUF_DYNFIELD(m, cap_tsc_offset, uint64_t *);
 }
 
-void list_ports(void) {
-    uint16_t port_id;
-    uint16_t nb_ports;
-    struct rte_eth_dev_info dev_info;
-    struct rte_ether_addr addr;
-    char name[RTE_ETH_NAME_MAX_LEN];
-    char linux_ifname[IFNAMSIZ];
-    int retval;
+// Mirror state of a forwarding thread
+struct wire_cap {
+    struct rte_ring *ring;
+    uint32_t countdown;      // packets until the next sampled one
+};
 
-    nb_ports = rte_eth_dev_count_avail();
-    printf("\n=== Available DPDK Ports ===\n");
-    printf("Total ports available: %u\n\n", nb_ports);
+// Mirror the packets of a burst that pass the filter and the sampling
+static void cap_mirror(struct wire_cap *cap, struct rte_mbuf **bufs, uint16_t n,
+                       struct wire_stats *stats) {
+    struct rte_mbuf *sel[BFDEV_MAX_PKT_BURST];
+    uint64_t rc[BFDEV_MAX_PKT_BURST];
+    const uint64_t now = rte_rdtsc();
+    unsigned nb = 0;
 
-    if (nb_ports == 0) {
-        printf("No DPDK ports found!\n");
+    if (cap_bpf != NULL)
+        rte_bpf_exec_burst(cap_bpf, (void **)bufs, rc, n);
+    for (uint16_t i = 0; i < n; i++) {
+        if ((cap_bpf != NULL && rc[i] == 0) || --cap->countdown > 0)
+            continue;
+        cap->countdown = cap_sample;
+        // the writer's reference, on every segment as the free walks them
+        for (struct rte_mbuf *seg = bufs[i]; seg != NULL; seg = seg->next)
+            rte_mbuf_refcnt_update(seg, 1);
+        *cap_tsc(bufs[i]) = now;
+        sel[nb++] = bufs[i];
+    }
+    if (nb == 0)
         return;
+    unsigned q = rte_ring_sp_enqueue_burst(cap->ring, (void **)sel, nb, NULL);
+    stats->cap_mirrored += q;
+    if (unlikely(q < nb)) {
+        // only drops the references taken above
+        stats->cap_dropped += nb - q;
+        rte_pktmbuf_free_bulk(&sel[q], nb - q);
+    }
+}
+
+static void cap_thread_init(struct wire_cap *cap, const struct wire_thread_args *args) {
+    cap->ring = args->cap_ring;
+    cap->countdown = 1;
+}
+
+// A forwarding thread is done mirroring
+static void cap_thread_stop(const struct wire_cap *cap) {
+    if (cap->ring != NULL)
+        __atomic_fetch_add(&cap_stopped, 1, __ATOMIC_RELEASE);
+}
+
+static inline uint64_t cap_ts_ns(uint64_t tsc) {
+    const uint64_t hz = rte_get_tsc_hz();
+    const uint64_t d = tsc - cap_epoch_tsc;
+    return cap_epoch_ns + d / hz * NS_PER_S + d % hz * NS_PER_S / hz;
+}
+
+static int cap_done(void) {
+    if (__atomic_load_n(&cap_stopped, __ATOMIC_ACQUIRE) < cap_nb_rings)
+        return 0;
+    for (unsigned r = 0; r < cap_nb_rings; r++) {
+        if (!rte_ring_empty(cap_rings[r]))
+            return 0;
     }
+    return 1;
+}
+
+// Capture writer: drain the capture rings into the pcapng file, writing
+// the file buffer when it is full or every CAP_FLUSH_MS. It returns once
+// every forwarding thread did and the rings are empty.
+static void wire_capture_stage(struct wire_thread_args *args) {
+    struct rte_mbuf *bufs[BFDEV_MAX_PKT_BURST];
+    struct wire_stats *stats = &lcore_stats[rte_lcore_id()];
+    const uint64_t flush_period = CAP_FLUSH_MS * rte_get_tsc_hz() / MS_PER_S;
+    uint64_t flush_tsc = rte_rdtsc();
+    struct wire_idle idle;
+    int err = 0;
 
-    RTE_ETH_FOREACH_DEV(port_id) {
-        // Get MAC address first
-        retval = rte_eth_macaddr_get(port_id, &addr);
-        if (retval != 0) {
-            continue; // Skip if we can't get MAC
+    printf("Capture writer on lcore %u: %s from %u thread(s)\n", rte_lcore_id(),
+           cap_file, cap_nb_rings);
+    idle_init(&idle, args->pair->idle_mode, args->in_port, 0, 0);
+    while (1) {
+        unsigned nb = 0;
+        stats->polls++;
+        for (unsigned r = 0; r < cap_nb_rings; r++) {
+            uint16_t n = rte_ring_sc_dequeue_burst(cap_rings[r], (void **)bufs,
+                                                   BFDEV_MAX_PKT_BURST, NULL);
+            for (uint16_t i = 0; i < n; i++) {
+                int ret = bfdev_pcapng_write(cap_writer, cap_iface[bufs[i]->port],
+                                             cap_ts_ns(*cap_tsc(bufs[i])), bufs[i]);
+                if (ret == 0) {
+                    stats->tx++;
+                    continue;
+                }
+                if (err == 0)
+                    printf("Capture: cannot write %s: %s\n", cap_file, strerror(-ret));
+                err = ret;
+                stats->cap_dropped++;
+            }
+            rte_pktmbuf_free_bulk(bufs, n);
+            nb += n;
+        }
+        const uint64_t now = rte_rdtsc();
+        if (now - flush_tsc >= flush_period) {
+            bfdev_pcapng_flush(cap_writer);
+            flush_tsc = now;
         }
+        stats->cap_bytes = bfdev_pcapng_bytes(cap_writer);
+        if (nb == 0) {
+            if (force_quit && cap_done())
+                break;
+            stats->empty_polls++;
+            wire_idle(&idle, stats);
+            continue;
+        }
+        wire_busy(&idle, stats);
+        stats->rx += nb;
+    }
+    int ret = bfdev_pcapng_close(cap_writer);
+    if (ret != 0 && err == 0)
+        printf("Capture: cannot write %s: %s\n", cap_file, strerror(-ret));
+    cap_writer = NULL;
+}
+
+// Wire packets from in_port to out_port on one queue, pulling up to
+// BFDEV_MAX_PKT_BURST at a time from rx queue args->queue of the in_port and
+// sending them to tx queue args->queue of the out_port.
+// Only counters are updated here, printing is left to the stats reporter.
+static void wire_ports(struct wire_thread_args *args) {
+    struct rte_mbuf *bufs[BFDEV_MAX_PKT_BURST];
+    struct wire_stats *stats = &lcore_stats[rte_lcore_id()];
+    const uint16_t in_port = args->in_port;
+    const uint16_t out_port = args->out_port;
+    const uint16_t queue = args->queue;
+    const int vlan_restore = !!(bfdev_port_get(in_port)->rx_offloads & RTE_ETH_RX_OFFLOAD_VLAN_STRIP);
+    struct ct_table *ct = ct_threshold ? &ct_tables[args->index] : NULL;
+    struct wire_idle idle;
+    struct wire_cap cap;
+    struct wire_tx tx;
+    uint16_t nb_rx;
+    
+    printf("Starting packet forwarding on lcore %u:\n", rte_lcore_id());
+    printf("  IN:  Port %u queue %u\n", in_port, queue);
+    printf("  OUT: Port %u queue %u\n", out_port, queue);
+    idle_init(&idle, args->pair->idle_mode, in_port, queue, 1);
+    tx_init(&tx, args->pair, out_port, queue, stats);
+    cap_thread_init(&cap, args);
+    
+    while (!force_quit) {
+        // Receive burst of packets from in_port
+        PROF_START(lap);
+        nb_rx = rte_eth_rx_burst(in_port, queue, bufs, rx_burst);
+        stats->polls++;
+        if (nb_rx == 0)
+            PROF_LAP(lap, stats->prof_empty_tsc);
+        else
+            PROF_LAP(lap, stats->prof_rx_tsc);
 
-        // Try to find Linux interface by MAC address
-        if (get_linux_ifname_by_mac(&addr, linux_ifname, sizeof(linux_ifname)) != 0) {
-            continue; // Skip ports without Linux interfaces
+        if (ct != NULL && (nb_rx == 0 || stats->polls % CT_MAINTAIN_POLLS == 0))
+            ct_maintain(ct, stats, rte_rdtsc());
+        if (nb_rx == 0) {
+            stats->empty_polls++;
+            wire_tx_flush(&tx, 1);
+            wire_idle(&idle, stats);
+            continue;
         }
+        wire_busy(&idle, stats);
+        stats->rx += nb_rx;
+        stats->burst_hist[rte_fls_u32(nb_rx) - 1]++;
 
-        printf("Port %u:\n", port_id);
+        // drop and mark per the classifier, before anything else looks
+        // at the packets
+        if (args->acl != NULL) {
+            nb_rx = bfdev_acl_apply(args->acl, bufs, nb_rx, &stats->acl);
+            if (nb_rx == 0) {
+                PROF_LAP(lap, stats->prof_work_tsc);
+                wire_tx_flush(&tx, 0);
+                PROF_LAP(lap, stats->prof_tx_tsc);
+                continue;
+            }
+        }
 
-        // Get device name
-        retval = rte_eth_dev_get_name_by_port(port_id, name);
-        if (retval == 0) {
-            printf("  DPDK Name: %s\n", name);
+        if (ct != NULL)
+            ct_track(ct, args->index, bufs, nb_rx, stats, rte_rdtsc());
 
-            // Check if this is a representor port
-            if (strstr(name, "_representor_")) {
-                printf("  Type: Representor Port\n");
+        // put back VLAN tags that the rx port stripped
+        if (vlan_restore) {
+            for (uint16_t i = 0; i < nb_rx; i++) {
+                if (bufs[i]->ol_flags & RTE_MBUF_F_RX_VLAN_STRIPPED)
+                    bufs[i]->ol_flags |= RTE_MBUF_F_TX_VLAN;
             }
         }
 
-        printf("  Linux Interface: %s\n", linux_ifname);
+        if (cap.ring != NULL)
+            cap_mirror(&cap, bufs, nb_rx, stats);
+        PROF_LAP(lap, stats->prof_work_tsc);
+        wire_send(&tx, bufs, nb_rx);
+        wire_tx_flush(&tx, 0);
+        PROF_LAP(lap, stats->prof_tx_tsc);
+    }
+    wire_tx_flush(&tx, 1);
+    rte_free(tx.buffer);
+    cap_thread_stop(&cap);
+}
+
+// Rx stage: poll the rx queues of the in_port in turn and deal the packets
+// to the workers. Packets that do not fit in their worker's ring are
+// dropped here, before they get a sequence number.
+static void wire_rx_stage(struct wire_thread_args *args) {
+    struct rte_mbuf *bufs[BFDEV_MAX_PKT_BURST];
+    struct wire_stats *stats = &lcore_stats[rte_lcore_id()];
+    struct wire_pipeline *p = args->pipe;
+    struct wire_idle idle;
+    uint32_t seq = 0;
+    uint16_t q = 0;
+
+    printf("Rx stage on lcore %u: port %u, %u queue(s), %u workers\n",
+           rte_lcore_id(), p->in_port, p->nb_queues, p->nb_workers);
+    idle_init(&idle, args->pair->idle_mode, p->in_port, 0, p->nb_queues);
+    while (!force_quit) {
+        uint16_t nb_rx = rte_eth_rx_burst(p->in_port, q, bufs, rx_burst);
+        if (++q == p->nb_queues)
+            q = 0;
+        stats->polls++;
+        if (nb_rx == 0) {
+            // idle once every queue came back empty
+            stats->empty_polls++;
+            if (q == 0)
+                wire_idle(&idle, stats);
+            continue;
+        }
+        wire_busy(&idle, stats);
+        stats->rx += nb_rx;
+        stats->burst_hist[rte_fls_u32(nb_rx) - 1]++;
+
+        // split the burst where a block ends, each block goes to one worker
+        for (uint16_t i = 0; i < nb_rx; ) {
+            struct wire_ring *r = &p->to_worker[(seq / WIRE_SEQ_BLOCK) % p->nb_workers];
+            uint16_t n = RTE_MIN(nb_rx - i, WIRE_SEQ_BLOCK - seq % WIRE_SEQ_BLOCK);
+            if (reorder) {
+                for (uint16_t k = 0; k < n; k++)
+                    *wire_seqn(bufs[i + k]) = seq + k;
+            }
+            unsigned sent = wire_ring_put(r, &bufs[i], n);
+            seq += sent;
+            stats->tx += sent;
+            if (unlikely(sent < n)) {
+                stats->dropped += n - sent;
+                rte_pktmbuf_free_bulk(&bufs[i + sent], n - sent);
+            }
+            i += n;
+        }
+    }
+    __atomic_store_n(&p->rx_stopped, 1, __ATOMIC_RELEASE);
+}
 
-        printf("  MAC Address: %02X:%02X:%02X:%02X:%02X:%02X\n",
-               addr.addr_bytes[0], addr.addr_bytes[1],
-               addr.addr_bytes[2], addr.addr_bytes[3],
-               addr.addr_bytes[4], addr.addr_bytes[5]);
+// Worker stage: the per-packet work of the inline wire. With reordering,
+// the tx stage waits for every packet a worker does not drop, so the
+// worker waits for room in its ring rather than dropping, as it does while
+// stopping. It returns once the rx stage did and its ring is empty.
+static void wire_worker_stage(struct wire_thread_args *args) {
+    struct rte_mbuf *bufs[BFDEV_MAX_PKT_BURST];
+    struct wire_stats *stats = &lcore_stats[rte_lcore_id()];
+    struct wire_pipeline *p = args->pipe;
+    struct rte_ring *in = p->to_worker[args->worker].ring;
+    struct wire_ring *out = &p->to_tx[args->worker];
+    struct wire_progress *done = &p->done[args->worker];
+    const int vlan_restore = !!(bfdev_port_get(p->in_port)->rx_offloads & RTE_ETH_RX_OFFLOAD_VLAN_STRIP);
+    struct wire_idle idle;
 
-        // Get device info
-        retval = rte_eth_dev_info_get(port_id, &dev_info);
-        if (retval != 0) {
-            printf("  Error getting device info: %s\n", strerror(-retval));
+    printf("Worker %u of port %u on lcore %u\n", args->worker, p->in_port, rte_lcore_id());
+    idle_init(&idle, args->pair->idle_mode, p->in_port, 0, 0);
+    while (1) {
+        uint16_t nb = rte_ring_dequeue_burst(in, (void **)bufs, BFDEV_MAX_PKT_BURST, NULL);
+        stats->polls++;
+        if (nb == 0) {
+            if (force_quit && __atomic_load_n(&p->rx_stopped, __ATOMIC_ACQUIRE) &&
+                rte_ring_empty(in))
+                break;
+            stats->empty_polls++;
+            wire_idle(&idle, stats);
             continue;
         }
+        wire_busy(&idle, stats);
+        stats->rx += nb;
+        stats->burst_hist[rte_fls_u32(nb) - 1]++;
+        uint32_t last = reorder ? *wire_seqn(bufs[nb - 1]) : 0;
 
-        // Print driver name
-        if (dev_info.driver_name) {
-            printf("  Driver: %s\n", dev_info.driver_name);
+        if (args->acl != NULL)
+            nb = bfdev_acl_apply(args->acl, bufs, nb, &stats->acl);
+        if (vlan_restore) {
+            for (uint16_t i = 0; i < nb; i++) {
+                if (bufs[i]->ol_flags & RTE_MBUF_F_RX_VLAN_STRIPPED)
+                    bufs[i]->ol_flags |= RTE_MBUF_F_TX_VLAN;
+            }
         }
 
-        // Print device name if available
-        if (dev_info.device && rte_dev_name(dev_info.device)) {
-            printf("  Device: %s\n", rte_dev_name(dev_info.device));
+        unsigned sent = wire_ring_put(out, bufs, nb);
+        while ((reorder || force_quit) && sent < nb)
+            sent += wire_ring_put(out, &bufs[sent], nb - sent);
+        stats->tx += sent;
+        if (unlikely(sent < nb)) {
+            stats->dropped += nb - sent;
+            rte_pktmbuf_free_bulk(&bufs[sent], nb - sent);
         }
+        // the packets are in the ring before the tx stage can see this
+        if (reorder)
+            __atomic_store_n(&done->seq, last + 1, __ATOMIC_RELEASE);
+    }
+    __atomic_fetch_add(&p->workers_stopped, 1, __ATOMIC_RELEASE);
+}
 
-        // Print capabilities
-        printf("  Max RX queues: %u\n", dev_info.max_rx_queues);
-        printf("  Max TX queues: %u\n", dev_info.max_tx_queues);
+static inline void reorder_emit(struct wire_reorder *ro, struct rte_mbuf *m,
+                                struct wire_tx *tx) {
+    ro->out[ro->nb_out++] = m;
+    if (ro->nb_out == BFDEV_MAX_PKT_BURST) {
+        wire_send(tx, ro->out, ro->nb_out);
+        ro->nb_out = 0;
+    }
+}
 
-        // Print link status
-        struct rte_eth_link link;
-        retval = rte_eth_link_get_nowait(port_id, &link);
-        if (retval == 0) {
-            printf("  Link Status: %s\n", 
-                   link.link_status ? "UP" : "DOWN");
-            if (link.link_status) {
-                printf("  Link Speed: %u Mbps\n", link.link_speed);
-                printf("  Link Duplex: %s\n",
-                       link.link_duplex == RTE_ETH_LINK_FULL_DUPLEX ? "Full" : "Half");
+static void reorder_insert(struct wire_reorder *ro, struct rte_mbuf **bufs, uint16_t n,
+                           struct wire_tx *tx) {
+    for (uint16_t i = 0; i < n; i++) {
+        uint32_t seq = *wire_seqn(bufs[i]);
+        if (unlikely((int32_t)(seq - ro->next) < 0)) {
+            // its turn was given up already
+            tx->stats->reorder_late++;
+            reorder_emit(ro, bufs[i], tx);
+            continue;
+        }
+        // beyond the window: move it forward, giving up on the missing packets
+        while (unlikely(seq - ro->next > ro->mask)) {
+            struct rte_mbuf **slot = &ro->slots[ro->next & ro->mask];
+            if (*slot != NULL) {
+                reorder_emit(ro, *slot, tx);
+                *slot = NULL;
+                ro->buffered--;
+            } else {
+                tx->stats->reorder_gaps++;
             }
+            ro->next++;
         }
+        ro->slots[seq & ro->mask] = bufs[i];
+        ro->buffered++;
+    }
+}
 
-        printf("\n");
+// Move everything worker w has finished into the window
+static void reorder_pull(struct wire_reorder *ro, struct wire_pipeline *p, unsigned w,
+                         struct wire_tx *tx) {
+    struct rte_mbuf *bufs[BFDEV_MAX_PKT_BURST];
+    uint16_t n;
+
+    do {
+        n = rte_ring_dequeue_burst(p->to_tx[w].ring, (void **)bufs, BFDEV_MAX_PKT_BURST, NULL);
+        reorder_insert(ro, bufs, n, tx);
+    } while (n > 0);
+}
+
+// Send the packets that are next in order. A missing packet is waited for
+// until the worker it belongs to is past it, then it was dropped.
+static void reorder_drain(struct wire_reorder *ro, struct wire_pipeline *p,
+                          struct wire_tx *tx) {
+    while (ro->buffered > 0) {
+        const uint32_t seq = ro->next;
+        struct rte_mbuf **slot = &ro->slots[seq & ro->mask];
+        if (*slot == NULL) {
+            unsigned w = (seq / WIRE_SEQ_BLOCK) % p->nb_workers;
+            uint32_t done = __atomic_load_n(&p->done[w].seq, __ATOMIC_ACQUIRE);
+            if ((int32_t)(done - seq) <= 0)
+                break;
+            reorder_pull(ro, p, w, tx);
+            if (ro->next == seq && *slot == NULL) {
+                tx->stats->reorder_gaps++;
+                ro->next++;
+            }
+            continue;
+        }
+        reorder_emit(ro, *slot, tx);
+        *slot = NULL;
+        ro->buffered--;
+        ro->next++;
+    }
+    if (ro->nb_out > 0) {
+        wire_send(tx, ro->out, ro->nb_out);
+        ro->nb_out = 0;
+    }
+}
+
+static int tx_stage_done(struct wire_pipeline *p) {
+    if (__atomic_load_n(&p->workers_stopped, __ATOMIC_ACQUIRE) < p->nb_workers)
+        return 0;
+    for (unsigned w = 0; w < p->nb_workers; w++) {
+        if (!rte_ring_empty(p->to_tx[w].ring))
+            return 0;
+    }
+    return 1;
+}
+
+// Tx stage: collect the workers' packets, in order with -R, and send them.
+// It returns once every worker did and their rings are empty.
+static void wire_tx_stage(struct wire_thread_args *args) {
+    struct rte_mbuf *bufs[BFDEV_MAX_PKT_BURST];
+    struct wire_stats *stats = &lcore_stats[rte_lcore_id()];
+    struct wire_pipeline *p = args->pipe;
+    struct wire_reorder *ro = NULL;
+    struct wire_idle idle;
+    struct wire_cap cap;
+    struct wire_tx tx;
+
+    idle_init(&idle, args->pair->idle_mode, p->out_port, 0, 0);
+    tx_init(&tx, args->pair, p->out_port, 0, stats);
+    cap_thread_init(&cap, args);
+    if (reorder) {
+        // room for everything the rings can hold
+        uint32_t size = rte_align32pow2(2 * p->nb_workers * WIRE_RING_SIZE);
+        ro = rte_zmalloc_socket("wire_reorder", sizeof(*ro) + size * sizeof(ro->slots[0]),
+                                RTE_CACHE_LINE_SIZE, rte_socket_id());
+        if (ro == NULL)
+            rte_exit(EXIT_FAILURE, "Cannot allocate the reorder window of port %u\n",
+                     p->out_port);
+        ro->mask = size - 1;
+    }
+    printf("Tx stage on lcore %u: port %u%s\n", rte_lcore_id(), p->out_port,
+           reorder ? ", in order" : "");
+    while (1) {
+        unsigned nb = 0;
+        stats->polls++;
+        for (unsigned w = 0; w < p->nb_workers; w++) {
+            uint16_t n = rte_ring_dequeue_burst(p->to_tx[w].ring, (void **)bufs,
+                                                BFDEV_MAX_PKT_BURST, NULL);
+            if (n == 0)
+                continue;
+            nb += n;
+            stats->rx += n;
+            if (cap.ring != NULL)
+                cap_mirror(&cap, bufs, n, stats);
+            if (ro != NULL)
+                reorder_insert(ro, bufs, n, &tx);
+            else
+                wire_send(&tx, bufs, n);
+        }
+        if (ro != NULL)
+            reorder_drain(ro, p, &tx);
+        if (nb == 0) {
+            if (force_quit && tx_stage_done(p))
+                break;
+            // packets waiting for their turn keep the stage awake
+            stats->empty_polls++;
+            wire_tx_flush(&tx, 1);
+            if (ro == NULL || ro->buffered == 0)
+                wire_idle(&idle, stats);
+            continue;
+        }
+        wire_busy(&idle, stats);
+        stats->burst_hist[rte_fls_u32(RTE_MIN(nb, (unsigned)BFDEV_MAX_PKT_BURST)) - 1]++;
+        wire_tx_flush(&tx, 0);
     }
-    printf("============================\n\n");
+    wire_tx_flush(&tx, 1);
+    rte_free(tx.buffer);
+    rte_free(ro);
+    cap_thread_stop(&cap);
 }
 
+// Create the rings of both directions of a pair
+static void pipeline_init(struct wire_thread_args *args, const struct wire_pair *pair) {
+    char name[RTE_RING_NAMESIZE];
 
-#define RING_SIZE 1024
-#define NUM_MBUFS 1024
-#define MBUF_CACHE_SIZE 250
-// Open a DPDK port and initialized an mbuf pool for rx packets
-int port_init(uint16_t port) {
-    struct rte_mempool *mbuf_pool;
-    struct rte_eth_conf port_conf;
-    const uint16_t rx_rings = 1, tx_rings = 1;
-    uint16_t nb_rxd = RING_SIZE;
-    uint16_t nb_txd = RING_SIZE;
-    int retval;
-    uint16_t q;
-    struct rte_eth_dev_info dev_info;
-    struct rte_eth_txconf txconf;
+    if (reorder) {
+        static const struct rte_mbuf_dynfield desc = {
+            .name = "wire_dynfield_seqn",
+            .size = sizeof(uint32_t),
+            .align = __alignof__(uint32_t),
+        };
+        seqn_offset = rte_mbuf_dynfield_register(&desc);
+        if (seqn_offset < 0)
+            rte_exit(EXIT_FAILURE, "Cannot register the sequence number mbuf field\n");
+    }
+    for (unsigned d = 0; d < 2; d++) {
+        struct wire_pipeline *p = &pipelines[d];
+        p->in_port = pair->ports[d];
+        p->out_port = pair->ports[!d];
+        p->nb_queues = pair->nb_queues;
+        p->nb_workers = nb_workers;
+        const int socket = bfdev_port_get(p->in_port)->socket;
+        for (unsigned w = 0; w < nb_workers; w++) {
+            snprintf(name, sizeof(name), "WIRE_W%u_%u", p->in_port, w);
+            p->to_worker[w].ring = rte_ring_create(name, WIRE_RING_SIZE, socket,
+                                                   RING_F_SP_ENQ | RING_F_SC_DEQ);
+            snprintf(name, sizeof(name), "WIRE_T%u_%u", p->in_port, w);
+            p->to_tx[w].ring = rte_ring_create(name, WIRE_RING_SIZE, socket,
+                                               RING_F_SP_ENQ | RING_F_SC_DEQ);
+            if (p->to_worker[w].ring == NULL || p->to_tx[w].ring == NULL)
+                rte_exit(EXIT_FAILURE, "Cannot create the rings of worker %u\n", w);
+        }
 
-    if (!rte_eth_dev_is_valid_port(port))
+        // rx, workers, tx
+        struct wire_thread_args *a = &args[d * (nb_workers + 2)];
+        for (unsigned i = 0; i < nb_workers + 2; i++) {
+            a[i] = (struct wire_thread_args){
+                .in_port = p->in_port, .out_port = p->out_port,
+                .index = d * (nb_workers + 2) + i,
+                .stage = i == 0 ? STAGE_RX : i == nb_workers + 1 ? STAGE_TX : STAGE_WORKER,
+                .pipe = p, .worker = i - 1,
+                .acl = (i > 0 && i <= nb_workers) ? pair->acl[d] : NULL,
+                .pair = pair,
+            };
+        }
+    }
+}
+
+// Compile a pcap filter expression into an eBPF program run on the mbufs.
+// Returns NULL (and logs why) on failure.
+static struct rte_bpf *cap_filter_load(const char *expr) {
+    struct bpf_program prog;
+    pcap_t *pcap = pcap_open_dead(DLT_EN10MB, BFDEV_PCAPNG_SNAPLEN);
+
+    if (pcap == NULL)
+        return NULL;
+    if (pcap_compile(pcap, &prog, expr, 1, PCAP_NETMASK_UNKNOWN) != 0) {
+        printf("Capture filter '%s': %s\n", expr, pcap_geterr(pcap));
+        pcap_close(pcap);
+        return NULL;
+    }
+    struct rte_bpf_prm *prm = rte_bpf_convert(&prog);
+    pcap_freecode(&prog);
+    pcap_close(pcap);
+    if (prm == NULL) {
+        printf("Capture filter '%s': cannot convert: %s\n", expr, rte_strerror(rte_errno));
+        return NULL;
+    }
+    struct rte_bpf *bpf = rte_bpf_load(prm);
+    rte_free(prm);
+    if (bpf == NULL)
+        printf("Capture filter '%s': cannot load: %s\n", expr, rte_strerror(rte_errno));
+    return bpf;
+}
+
+// Open the capture file, with an interface per port of the topology, and
+// give the forwarding threads among the first nb_args args (inline threads
+// or tx stages) their capture ring
+static void cap_init(struct wire_thread_args *args, unsigned nb_args, const char *filter) {
+    static const struct rte_mbuf_dynfield desc = {
+        .name = "wire_dynfield_cap_tsc",
+        .size = sizeof(uint64_t),
+        .align = __alignof__(uint64_t),
+    };
+    char name[RTE_RING_NAMESIZE];
+    struct timespec ts;
+
+    cap_tsc_offset = rte_mbuf_dynfield_register(&desc);
+    if (cap_tsc_offset < 0)
+        rte_exit(EXIT_FAILURE, "Cannot register the capture timestamp mbuf field\n");
+    if (filter != NULL && (cap_bpf = cap_filter_load(filter)) == NULL)
+        rte_exit(EXIT_FAILURE, "Invalid capture filter\n");
+    cap_writer = bfdev_pcapng_open(cap_file, 0);
+    if (cap_writer == NULL)
+        rte_exit(EXIT_FAILURE, "Cannot create %s\n", cap_file);
+    for (unsigned i = 0; i < 2 * nb_pairs; i++) {
+        uint16_t port = pairs[i / 2].ports[i % 2];
+        int id = bfdev_pcapng_add_interface(cap_writer, port, BFDEV_PCAPNG_SNAPLEN);
+        if (id < 0)
+            rte_exit(EXIT_FAILURE, "Cannot write %s: %s\n", cap_file, strerror(-id));
+        cap_iface[port] = id;
+    }
+    clock_gettime(CLOCK_REALTIME, &ts);
+    cap_epoch_tsc = rte_rdtsc();
+    cap_epoch_ns = (uint64_t)ts.tv_sec * NS_PER_S + ts.tv_nsec;
+
+    for (unsigned i = 0; i < nb_args; i++) {
+        if (args[i].stage != STAGE_INLINE && args[i].stage != STAGE_TX)
+            continue;
+        snprintf(name, sizeof(name), "WIRE_CAP_%u", i);
+        args[i].cap_ring = rte_ring_create(name, CAP_RING_SIZE,
+                                           bfdev_port_get(args[i].in_port)->socket,
+                                           RING_F_SP_ENQ | RING_F_SC_DEQ);
+        if (args[i].cap_ring == NULL)
+            rte_exit(EXIT_FAILURE, "Cannot create the capture ring of thread %u\n", i);
+        cap_rings[cap_nb_rings++] = args[i].cap_ring;
+    }
+    printf("Capture to %s: %s%s, 1 in %u packets\n", cap_file,
+           filter != NULL ? "filter " : "all packets", filter != NULL ? filter : "", cap_sample);
+}
+
+// Remove the hardware rules, the ports then deliver everything to software
+static void wire_offload_remove(void) {
+    free(hw_punt);
+    hw_punt = NULL;
+    hw_nb_punt = 0;
+    if (hw_rules == NULL)
+        return;
+    bfdev_rule_table_flush(hw_rules);
+    bfdev_rule_table_free(hw_rules);
+    hw_rules = NULL;
+}
+
+// Install the hardware forwarding (unless connection tracking offloads the
+// flows one by one) and punt rules between the two ports. Returns 0, or -1
+// when the eswitch cannot do it and everything must be forwarded in software.
+static int wire_offload(uint16_t net, uint16_t host, const char *punt_file, int forward_all) {
+    const struct bfdev_flow_attr attr = { .transfer = 1, .count = 1 };
+    struct bfdev_rule *file_rules = NULL, *rules;
+    unsigned nb_file = 0, nb_rules = 0;
+    struct bfdev_rule_diff diff;
+    struct rte_flow_error err;
+    uint16_t proxy;
+    int ret;
+
+    // transfer rules are created through the eswitch manager port
+    if (rte_flow_pick_transfer_proxy(net, &proxy, &err) != 0 || bfdev_port_get(proxy) == NULL) {
+        printf("Port %u: its eswitch manager is not a wire port, no transfer rules\n", net);
+        return -1;
+    }
+    if (punt_file != NULL && bfdev_rules_load(punt_file, &file_rules, &nb_file) != 0)
+        return -1;
+    rules = calloc(2 * nb_file + 2, sizeof(*rules));
+    if (rules == NULL) {
+        free(file_rules);
         return -1;
+    }
 
-    // allocate the mbuf pool
-    char pool_name[32];
-    snprintf(pool_name, sizeof(pool_name), "MBUF_POOL_%u", port);    
-    mbuf_pool = rte_pktmbuf_pool_create(pool_name, NUM_MBUFS,
-        MBUF_CACHE_SIZE, 0, RTE_MBUF_DEFAULT_BUF_SIZE, rte_socket_id());
-    if (mbuf_pool == NULL) {
-        int required_mem = (NUM_MBUFS * (2048 + sizeof(struct rte_mbuf))) * 1 + (MBUF_CACHE_SIZE * sizeof(struct rte_mbuf) * 1);
-        rte_exit(EXIT_FAILURE, "Cannot create mbuf pool. the memory required was: %i\n", required_mem);
-    }
-
-    // set up the port configuration
-    memset(&port_conf, 0, sizeof(struct rte_eth_conf));
-
-    // get device info
-    retval = rte_eth_dev_info_get(port, &dev_info);
-    if (retval != 0) {
-        printf("Error during getting device (port %u) info: %s\n",
-                port, strerror(-retval));
-        return retval;
-    }
-
-    // if (dev_info.tx_offload_capa & RTE_ETH_TX_OFFLOAD_MBUF_FAST_FREE)
-    //  port_conf.txmode.offloads |=
-    //      RTE_ETH_TX_OFFLOAD_MBUF_FAST_FREE;
-
-    /* Configure the Ethernet device. */
-    retval = rte_eth_dev_configure(port, rx_rings, tx_rings, &port_conf);
-    if (retval != 0)
-        return retval;
-
-    retval = rte_eth_dev_adjust_nb_rx_tx_desc(port, &nb_rxd, &nb_txd);
-    if (retval != 0)
-        return retval;
-
-    /* Allocate and set up 1 RX queue per Ethernet port. */
-    for (q = 0; q < rx_rings; q++) {
-        retval = rte_eth_rx_queue_setup(port, q, nb_rxd,
-                rte_eth_dev_socket_id(port), NULL, mbuf_pool);
-        if (retval < 0)
-            return retval;
-    }
-
-    txconf = dev_info.default_txconf;
-    txconf.offloads = port_conf.txmode.offloads;
-    /* Allocate and set up 1 TX queue per Ethernet port. */
-    for (q = 0; q < tx_rings; q++) {
-        retval = rte_eth_tx_queue_setup(port, q, nb_txd,
-                rte_eth_dev_socket_id(port), &txconf);
-        if (retval < 0)
-            return retval;
-    }
-
-    /* Starting Ethernet port. 8< */
-    retval = rte_eth_dev_start(port);
-    /* >8 End of starting of ethernet port. */
-    if (retval < 0)
-        return retval;
-
-    /* Display the port MAC address. */
-    struct rte_ether_addr addr;
-    retval = rte_eth_macaddr_get(port, &addr);
-    if (retval != 0)
-        return retval;
-
-    printf("Port %u MAC: %02" PRIx8 " %02" PRIx8 " %02" PRIx8
-               " %02" PRIx8 " %02" PRIx8 " %02" PRIx8 "\n",
-            port, RTE_ETHER_ADDR_BYTES(&addr));
-
-    /* Enable RX in promiscuous mode for the Ethernet device. */
-    retval = rte_eth_promiscuous_enable(port);
-    /* End of setting RX port in promiscuous mode. */
-    if (retval != 0)
-        return retval;
+    // a punt rule without in_port applies to both directions
+    for (unsigned i = 0; i < nb_file; i++) {
+        for (int dir = 0; dir < 2; dir++) {
+            struct bfdev_rule r = file_rules[i];
+            uint16_t in = dir ? host : net;
+            if ((r.match & BFDEV_MATCH_IN_PORT) && r.in_port != in)
+                continue;
+            r.id = PUNT_RULE_ID_BASE + 2 * i + dir;
+            r.match |= BFDEV_MATCH_IN_PORT;
+            r.in_port = in;
+            r.priority = PUNT_PRIO;
+            r.action = BFDEV_ACTION_PUNT;
+            rules[nb_rules++] = r;
+        }
+    }
+    const unsigned nb_punt = nb_rules;
+    hw_punt = malloc((nb_punt + 1) * sizeof(*hw_punt));
+    if (hw_punt == NULL) {
+        free(file_rules);
+        free(rules);
+        return -1;
+    }
+    memcpy(hw_punt, rules, nb_punt * sizeof(*hw_punt));
+    hw_nb_punt = nb_punt;
+    if (forward_all) {
+        rules[nb_rules++] = (struct bfdev_rule){
+            .id = FWD_RULE_NET_TO_HOST, .match = BFDEV_MATCH_IN_PORT, .in_port = net,
+            .priority = FWD_PRIO, .action = BFDEV_ACTION_PORT, .action_arg = host};
+        rules[nb_rules++] = (struct bfdev_rule){
+            .id = FWD_RULE_HOST_TO_NET, .match = BFDEV_MATCH_IN_PORT, .in_port = host,
+            .priority = FWD_PRIO, .action = BFDEV_ACTION_PORT, .action_arg = net};
+    }
+    free(file_rules);
 
+    hw_proxy = proxy;
+    // the conntrack rules are added a batch at a time, the template tables
+    // of their TCP and UDP shapes are created for the whole table
+    hw_rules = bfdev_rule_table_create(proxy, &attr, RTE_MAX(nb_rules, MAX_HW_RULES) +
+                                       (forward_all ? 0 : CT_MAX_OFFLOADED));
+    if (hw_rules == NULL) {
+        free(rules);
+        wire_offload_remove();
+        return -1;
+    }
+    ret = bfdev_rule_table_apply(hw_rules, rules, nb_rules, &diff);
+    free(rules);
+    if (ret != 0) {
+        wire_offload_remove();
+        return -1;
+    }
+    printf("Hardware %s between ports %u and %u: %u punt rule(s) to software\n",
+           forward_all ? "wire" : "flow offload", net, host, nb_punt);
     return 0;
 }
 
-#define MAX_PKT_BURST 32
-// Wire packets from in_port to out_port, pulling up to MAX_PKT_BURST at a time
-// from the in_port and sending them to the out_port.
-static void wire_ports(uint16_t in_port, uint16_t out_port) {
-    struct rte_mbuf *bufs[MAX_PKT_BURST];
-    uint64_t total_forwarded = 0;
-    uint64_t total_dropped = 0;
-    uint16_t nb_rx, nb_tx;
-    
-    printf("Starting packet forwarding:\n");
-    printf("  IN:  Port %u\n", in_port);
-    printf("  OUT: Port %u\n", out_port);
-    
-    while (1) {
-        // Receive burst of packets from in_port
-        nb_rx = rte_eth_rx_burst(in_port, 0, bufs, MAX_PKT_BURST);
-        
-        if (nb_rx > 0) {
-            // Send burst to out_port
-            nb_tx = rte_eth_tx_burst(out_port, 0, bufs, nb_rx);
-            
-            total_forwarded += nb_tx;
-            // print total forwarded packets if nb_tx > 0
-            if (nb_tx > 0) {
-                printf("Total forwarded packets: %lu\n", total_forwarded);
-            }
-            // Free any packets that weren't sent
-            if (nb_tx < nb_rx) {
-                total_dropped += (nb_rx - nb_tx);
-                for (uint16_t i = nb_tx; i < nb_rx; i++) {
-                    rte_pktmbuf_free(bufs[i]);
-                }
+// Packets forwarded by the eswitch since the last report
+static void report_offload(double secs) {
+    static uint64_t prev[2];
+    const uint32_t ids[2] = { FWD_RULE_NET_TO_HOST, FWD_RULE_HOST_TO_NET };
+    struct bfdev_rule_counters c;
+
+    if (ct_threshold) {
+        unsigned tracked = 0;
+        for (unsigned i = 0; i < RTE_DIM(ct_tables); i++) {
+            if (ct_tables[i].hash != NULL)
+                tracked += rte_hash_count(ct_tables[i].hash);
+        }
+        printf("Conntrack: %u flows in software tables, %" PRIu64 " offloaded now, %" PRIu64
+               " installed, %" PRIu64 " aged, %" PRIu64 " failed, %" PRIu64 " punted\n",
+               tracked, ct_installed - ct_aged, ct_installed, ct_aged, ct_failed, ct_punted);
+        return;
+    }
+    bfdev_rule_table_poll(hw_rules, bfdev_rule_table_count(hw_rules));
+    printf("Hardware forwarded (Mpps):");
+    for (int i = 0; i < 2; i++) {
+        if (bfdev_rule_table_counters(hw_rules, ids[i], &c) != 0)
+            continue;
+        printf(" %s %.3f", i == 0 ? "net->host" : "host->net",
+               (c.hits - prev[i]) / secs / 1e6);
+        prev[i] = c.hits;
+    }
+    printf("\n");
+}
+
+// Create the flow tables of the wire threads and the offload ring
+static void ct_init(struct wire_thread_args *args, unsigned nb_threads) {
+    char name[RTE_HASH_NAMESIZE];
+
+    ct_offload_ring = rte_ring_create("CT_OFFLOAD", CT_MAX_FLOWS, rte_socket_id(),
+                                      RING_F_SC_DEQ);
+    if (ct_offload_ring == NULL)
+        rte_exit(EXIT_FAILURE, "Cannot create the offload ring\n");
+    for (unsigned i = 0; i < nb_threads; i++) {
+        struct ct_table *ct = &ct_tables[i];
+        const int socket = bfdev_port_get(args[i].in_port)->socket;
+        snprintf(name, sizeof(name), "CT_%u", i);
+        struct rte_hash_parameters params = {
+            .name = name,
+            .entries = CT_MAX_FLOWS,
+            .key_len = sizeof(struct ct_key),
+            .hash_func = rte_hash_crc,
+            .socket_id = socket,
+        };
+        ct->hash = rte_hash_create(&params);
+        ct->flows = rte_zmalloc_socket(name, CT_MAX_FLOWS * sizeof(*ct->flows),
+                                       RTE_CACHE_LINE_SIZE, socket);
+        snprintf(name, sizeof(name), "CT_DONE_%u", i);
+        ct->done = rte_ring_create(name, CT_MAX_FLOWS, socket, RING_F_SP_ENQ | RING_F_SC_DEQ);
+        if (ct->hash == NULL || ct->flows == NULL || ct->done == NULL)
+            rte_exit(EXIT_FAILURE, "Cannot create the flow table of thread %u\n", i);
+    }
+    for (unsigned i = 0; i < CT_MAX_OFFLOADED; i++)
+        ct_free_ids[i] = CT_MAX_OFFLOADED - 1 - i;
+    ct_nb_free_ids = CT_MAX_OFFLOADED;
+}
+
+// Whether a punt rule may match packets of a flow received on in_port. A
+// rule on fields the 5-tuple does not have (MACs, VLAN) is taken to match.
+static int ct_punted_flow(const struct ct_flow *f, uint16_t in_port) {
+    for (unsigned i = 0; i < hw_nb_punt; i++) {
+        const struct bfdev_rule *r = &hw_punt[i];
+        const uint32_t src_mask = r->src_ip_len ? ~0u << (32 - r->src_ip_len) : 0;
+        const uint32_t dst_mask = r->dst_ip_len ? ~0u << (32 - r->dst_ip_len) : 0;
+        if (r->in_port != in_port ||
+            ((r->match & BFDEV_MATCH_SRC_IP) && ((f->key.src_ip ^ r->src_ip) & src_mask)) ||
+            ((r->match & BFDEV_MATCH_DST_IP) && ((f->key.dst_ip ^ r->dst_ip) & dst_mask)) ||
+            ((r->match & BFDEV_MATCH_PROTO) && f->key.proto != r->proto) ||
+            ((r->match & BFDEV_MATCH_SRC_PORT) && f->key.src_port != r->src_port) ||
+            ((r->match & BFDEV_MATCH_DST_PORT) && f->key.dst_port != r->dst_port))
+            continue;
+        return 1;
+    }
+    return 0;
+}
+
+static void ct_hand_back(struct ct_flow *f) {
+    void *obj = f;
+    rte_ring_sp_enqueue_burst(ct_tables[f->thread].done, &obj, 1, NULL);
+}
+
+// Main lcore side: install rules for the flows the threads handed over,
+// and remove the rules that aged out
+static void ct_service(struct wire_thread_args *args) {
+    struct bfdev_rule rules[BFDEV_FLOW_BATCH];
+    struct ct_flow *flows[BFDEV_FLOW_BATCH];
+    uint32_t ids[BFDEV_FLOW_BATCH];
+    void *reqs[BFDEV_FLOW_BATCH];
+    unsigned n;
+    int nb_aged;
+
+    n = rte_ring_sc_dequeue_burst(ct_offload_ring, reqs, BFDEV_FLOW_BATCH, NULL);
+    unsigned nb_rules = 0;
+    for (unsigned i = 0; i < n; i++) {
+        struct ct_flow *f = reqs[i];
+        const struct wire_thread_args *a = &args[f->thread];
+        if (ct_punted_flow(f, a->in_port)) {
+            // the thread keeps it without counting it, until it goes idle
+            ct_punted++;
+            __atomic_store_n(&f->state, CT_PUNTED, __ATOMIC_RELEASE);
+            continue;
+        }
+        if (ct_nb_free_ids == 0) {
+            // no room in the eswitch table, the flow stays in software
+            ct_failed++;
+            ct_hand_back(f);
+            continue;
+        }
+        uint32_t slot = ct_free_ids[--ct_nb_free_ids];
+        f->rule_id = CT_RULE_ID_BASE + slot;
+        ct_rules[slot] = f;
+        flows[nb_rules] = f;
+        rules[nb_rules++] = (struct bfdev_rule){
+            .id = f->rule_id,
+            .match = BFDEV_MATCH_IN_PORT | BFDEV_MATCH_SRC_IP | BFDEV_MATCH_DST_IP |
+                     BFDEV_MATCH_PROTO | BFDEV_MATCH_SRC_PORT | BFDEV_MATCH_DST_PORT,
+            .in_port = a->in_port,
+            .src_ip = f->key.src_ip, .src_ip_len = 32,
+            .dst_ip = f->key.dst_ip, .dst_ip_len = 32,
+            .proto = f->key.proto,
+            .src_port = f->key.src_port, .dst_port = f->key.dst_port,
+            .priority = FWD_PRIO,
+            .age = CT_AGE,
+            .action = BFDEV_ACTION_PORT, .action_arg = a->out_port,
+        };
+    }
+    if (nb_rules > 0) {
+        bfdev_rule_table_add(hw_rules, rules, nb_rules);
+        for (unsigned i = 0; i < nb_rules; i++) {
+            struct ct_flow *f = flows[i];
+            if (bfdev_rule_table_lookup(hw_rules, f->rule_id) != NULL) {
+                __atomic_store_n(&f->state, CT_OFFLOADED, __ATOMIC_RELEASE);
+                ct_installed++;
+                continue;
             }
+            // the thread forgets the flow and counts it again from zero
+            ct_failed++;
+            ct_rules[f->rule_id - CT_RULE_ID_BASE] = NULL;
+            ct_free_ids[ct_nb_free_ids++] = f->rule_id - CT_RULE_ID_BASE;
+            ct_hand_back(f);
         }
     }
+
+    nb_aged = bfdev_flow_aged(hw_proxy, ids, BFDEV_FLOW_BATCH);
+    if (nb_aged <= 0)
+        return;
+    unsigned nb_ids = 0;
+    for (int i = 0; i < nb_aged; i++) {
+        if (ids[i] < CT_RULE_ID_BASE || ids[i] - CT_RULE_ID_BASE >= CT_MAX_OFFLOADED ||
+            ct_rules[ids[i] - CT_RULE_ID_BASE] == NULL)
+            continue;
+        ids[nb_ids++] = ids[i];
+    }
+    bfdev_rule_table_remove(hw_rules, ids, nb_ids);
+    for (unsigned i = 0; i < nb_ids; i++) {
+        uint32_t slot = ids[i] - CT_RULE_ID_BASE;
+        ct_hand_back(ct_rules[slot]);
+        ct_rules[slot] = NULL;
+        ct_free_ids[ct_nb_free_ids++] = slot;
+        ct_aged++;
+    }
 }
 
-// Helpers to launch two wire threads on separate cores
+// Sleep until the tsc deadline or a signal, servicing the flow offloads
+// and collecting the metrics meanwhile
+static void main_wait(struct wire_thread_args *args, uint64_t deadline) {
+    while (rte_rdtsc() < deadline && !force_quit) {
+        bfdev_metrics_update(0);
+        if (ct_threshold && hw_rules != NULL) {
+            ct_service(args);
+            usleep(CT_SERVICE_US);
+        } else {
+            usleep(100000);
+        }
+    }
+}
 
-// Thread argument structure
-struct wire_thread_args {
-    uint16_t in_port;
-    uint16_t out_port;
-};
+// Helpers to launch the wire threads on separate cores
 
 // Lcore function wrapper (must return int and take void*)
 static int wire_lcore(void *arg) {
     struct wire_thread_args *args = (struct wire_thread_args *)arg;
-    wire_ports(args->in_port, args->out_port);
+    switch (args->stage) {
+    case STAGE_RX:
+        wire_rx_stage(args);
+        break;
+    case STAGE_WORKER:
+        wire_worker_stage(args);
+        break;
+    case STAGE_TX:
+        wire_tx_stage(args);
+        break;
+    case STAGE_CAPTURE:
+        wire_capture_stage(args);
+        break;
+    default:
+        wire_ports(args);
+        break;
+    }
     return 0;
 }
 
 
-uint16_t PORT_A = 0;
-uint16_t PORT_B = 0;
-
-// Signal handler
+// Signal handler: only flags the threads to stop, main() does the rest
 static void signal_handler(int signum) {
-    if (signum == SIGINT || signum == SIGTERM) {
-        printf("\n\nSignal %d received, preparing to exit...\n", signum);
-        exit(0);
+    if (signum == SIGINT || signum == SIGTERM)
+        force_quit = 1;
+}
+
+
+// Name of a thread in the stats report
+static void thread_label(const struct wire_thread_args *a, char *buf, size_t len) {
+    switch (a->stage) {
+    case STAGE_RX:
+        snprintf(buf, len, "rx %u", a->in_port);
+        break;
+    case STAGE_WORKER:
+        snprintf(buf, len, "w%u %u->%u", a->worker, a->in_port, a->out_port);
+        break;
+    case STAGE_TX:
+        snprintf(buf, len, "tx %u", a->out_port);
+        break;
+    case STAGE_CAPTURE:
+        snprintf(buf, len, "capture");
+        break;
+    default:
+        snprintf(buf, len, "%u->%u:%u", a->in_port, a->out_port, a->queue);
+        break;
+    }
+}
+
+static int classifier_enabled(const struct wire_thread_args *args, unsigned nb_args) {
+    for (unsigned i = 0; i < nb_args; i++) {
+        if (args[i].acl != NULL)
+            return 1;
+    }
+    return 0;
+}
+
+// Occupancy of the pipeline rings: entries now / high-water mark
+static void report_rings(const struct wire_stats *total) {
+    for (unsigned d = 0; d < 2; d++) {
+        const struct wire_pipeline *p = &pipelines[d];
+        printf("Rings %u->%u (now/max of %u):", p->in_port, p->out_port, WIRE_RING_SIZE);
+        for (unsigned w = 0; w < p->nb_workers; w++)
+            printf(" w%u in %u/%u out %u/%u", w,
+                   rte_ring_count(p->to_worker[w].ring), p->to_worker[w].hwm,
+                   rte_ring_count(p->to_tx[w].ring), p->to_tx[w].hwm);
+        printf("\n");
     }
+    if (reorder)
+        printf("Reorder: %" PRIu64 " gaps given up, %" PRIu64 " packets late\n",
+               total->reorder_gaps, total->reorder_late);
 }
 
+// What the idle mode and the tx policy of a pair did in an interval
+struct pair_delta {
+    unsigned nb_threads;
+    uint64_t sleep_tsc, wakes, wake_tsc, wake_max_tsc;
+    uint64_t tx_retries, tx_recovered, tx_flushes, tx_dropped;
+};
+
+static void report_policy(const struct wire_pair *pair, const struct pair_delta *d, double secs) {
+    const uint64_t hz = rte_get_tsc_hz();
+    char name[32] = "";
+
+    if (nb_pairs > 1)
+        snprintf(name, sizeof(name), "Pair %u<->%u ", pair->ports[0], pair->ports[1]);
+    // the price of the idle mode: how long threads slept and how late
+    // they were back to polling when traffic came
+    if (pair->idle_mode != IDLE_POLL)
+        printf("%sIdle (%s): asleep %.1f%%, %.0f wakes/s, wake latency avg %.1f us"
+               " max %.1f us\n", name, idle_names[pair->idle_mode],
+               100.0 * d->sleep_tsc / ((double)secs * hz * d->nb_threads), d->wakes / secs,
+               d->wakes ? 1e6 * d->wake_tsc / d->wakes / hz : 0.0, 1e6 * d->wake_max_tsc / hz);
+    // what the tx policy did: packets it saved, and those it still lost
+    switch (pair->tx_policy) {
+    case TX_RETRY:
+        printf("%sTx (retry, %u spins): %.0f retries/s, recovered %.3f Mpps, dropped %.3f Mpps\n",
+               name, pair->tx_spins, d->tx_retries / secs, d->tx_recovered / secs / 1e6,
+               d->tx_dropped / secs / 1e6);
+        break;
+    case TX_BUFFER:
+        printf("%sTx (buffer, %u us): %.0f idle/timeout flushes/s, dropped %.3f Mpps\n",
+               name, pair->tx_flush_us, d->tx_flushes / secs, d->tx_dropped / secs / 1e6);
+        break;
+    default:
+        printf("%sTx (drop): dropped %.3f Mpps\n", name, d->tx_dropped / secs / 1e6);
+        break;
+    }
+}
+
+#ifdef WIRE_PROFILE
+// Where the cycles of the inline threads went between two snapshots: per
+// packet in each lap, per burst, and in polls that came back empty
+static void report_profile(const struct wire_thread_args *args, unsigned nb_args,
+                           const struct wire_stats *cur, const struct wire_stats *old) {
+    const double ns_per_tsc = 1e9 / rte_get_tsc_hz();
+
+    printf("Profile (TSC cycles at %.0f MHz):\n", rte_get_tsc_hz() / 1e6);
+    printf("%5s %11s %8s %8s %8s %9s %8s %9s %10s %7s\n", "lcore", "in->out:q",
+           "rx/pkt", "work/pkt", "tx/pkt", "total/pkt", "ns/pkt", "per burst",
+           "empty/poll", "empty%");
+    for (unsigned i = 0; i < nb_args; i++) {
+        if (args[i].stage != STAGE_INLINE)
+            continue;
+        const struct wire_stats *c = &cur[i], *o = &old[i];
+        const uint64_t pkts = c->rx - o->rx;
+        const uint64_t empty = c->empty_polls - o->empty_polls;
+        const uint64_t bursts = c->polls - o->polls - empty;
+        const uint64_t rx = c->prof_rx_tsc - o->prof_rx_tsc;
+        const uint64_t work = c->prof_work_tsc - o->prof_work_tsc;
+        const uint64_t tx = c->prof_tx_tsc - o->prof_tx_tsc;
+        const uint64_t empty_tsc = c->prof_empty_tsc - o->prof_empty_tsc;
+        const double per_pkt = pkts ? 1.0 / pkts : 0.0;
+        const uint64_t busy = rx + work + tx;
+        char label[16];
+
+        thread_label(&args[i], label, sizeof(label));
+        printf("%5u %11s %8.1f %8.1f %8.1f %9.1f %8.1f %9.1f %10.1f %6.1f%%\n",
+               args[i].lcore_id, label, rx * per_pkt, work * per_pkt, tx * per_pkt,
+               busy * per_pkt, busy * per_pkt * ns_per_tsc,
+               bursts ? (double)busy / bursts : 0.0,
+               empty ? (double)empty_tsc / empty : 0.0,
+               busy + empty_tsc ? 100.0 * empty_tsc / (busy + empty_tsc) : 0.0);
+    }
+}
+#endif
+
+// Print per-thread and aggregate rates of all wire threads over the last
+// secs seconds, since the counters in prev (updated), or since the start
+// if prev is NULL.
+static void report_interval(struct wire_thread_args *args, unsigned nb_args,
+                            struct wire_stats *prev, double secs, const char *title) {
+    static const struct wire_stats zero;
+    struct wire_stats total, delta_total;
+    struct bfdev_acl_stats acl_delta = {0};
+    struct pair_delta pair_d[WIRE_MAX_PAIRS];
+    uint64_t cap_written = 0;
+    uint64_t tx_full[RTE_MAX_ETHPORTS] = {0};
+#ifdef WIRE_PROFILE
+    struct wire_stats prof_cur[WIRE_MAX_THREADS], prof_old[WIRE_MAX_THREADS];
+#endif
+    memset(&total, 0, sizeof(total));
+    memset(&delta_total, 0, sizeof(delta_total));
+    memset(pair_d, 0, nb_pairs * sizeof(pair_d[0]));
+
+    printf("\n=== %s (%.2f s) ===\n", title, secs);
+    printf("%5s %11s %9s %9s %9s %7s %14s %14s %12s\n",
+           "lcore", nb_workers ? "stage" : "in->out:q", "rx Mpps", "tx Mpps", "drop Mpps",
+           "empty%", "rx total", "tx total", "dropped");
+    for (unsigned i = 0; i < nb_args; i++) {
+        // snapshot the slot once, it keeps changing under us
+        struct wire_stats cur = lcore_stats[args[i].lcore_id];
+        const struct wire_stats *old = prev != NULL ? &prev[i] : &zero;
+        struct wire_stats d;
+        d.rx = cur.rx - old->rx;
+        d.tx = cur.tx - old->tx;
+        d.dropped = cur.dropped - old->dropped;
+        d.polls = cur.polls - old->polls;
+        d.empty_polls = cur.empty_polls - old->empty_polls;
+        for (int b = 0; b < BURST_HIST_BUCKETS; b++)
+            d.burst_hist[b] = cur.burst_hist[b] - old->burst_hist[b];
+        acl_delta.classified += cur.acl.classified - old->acl.classified;
+        acl_delta.matched += cur.acl.matched - old->acl.matched;
+        acl_delta.dropped += cur.acl.dropped - old->acl.dropped;
+        acl_delta.marked += cur.acl.marked - old->acl.marked;
+        struct pair_delta *pd = &pair_d[args[i].pair - pairs];
+        pd->nb_threads++;
+        pd->sleep_tsc += cur.sleep_tsc - old->sleep_tsc;
+        pd->wakes += cur.wakes - old->wakes;
+        pd->wake_tsc += cur.wake_tsc - old->wake_tsc;
+        pd->wake_max_tsc = RTE_MAX(pd->wake_max_tsc, cur.wake_max_tsc);
+        pd->tx_retries += cur.tx_retries - old->tx_retries;
+        pd->tx_recovered += cur.tx_recovered - old->tx_recovered;
+        pd->tx_flushes += cur.tx_flushes - old->tx_flushes;
+        pd->tx_dropped += cur.tx_dropped - old->tx_dropped;
+#ifdef WIRE_PROFILE
+        prof_cur[i] = cur;
+        prof_old[i] = *old;
+#endif
+        if (prev != NULL)
+            prev[i] = cur;
+
+        char label[16];
+        thread_label(&args[i], label, sizeof(label));
+        printf("%5u %11s %9.3f %9.3f %9.3f %6.1f%% %14" PRIu64
+               " %14" PRIu64 " %12" PRIu64 "\n",
+               args[i].lcore_id, label, d.rx / secs / 1e6, d.tx / secs / 1e6,
+               d.dropped / secs / 1e6,
+               d.polls ? 100.0 * d.empty_polls / d.polls : 0.0,
+               cur.rx, cur.tx, cur.dropped);
+
+        // in a pipeline, packets come in at the rx stages and go out
+        // at the tx stages, but can be dropped anywhere
+        if (args[i].stage == STAGE_INLINE || args[i].stage == STAGE_RX) {
+            total.rx += cur.rx;
+            delta_total.rx += d.rx;
+        }
+        if (args[i].stage == STAGE_INLINE || args[i].stage == STAGE_TX) {
+            total.tx += cur.tx;
+            delta_total.tx += d.tx;
+        }
+        total.dropped += cur.dropped;
+        total.reorder_gaps += cur.reorder_gaps;
+        total.reorder_late += cur.reorder_late;
+        delta_total.dropped += d.dropped;
+        tx_full[args[i].out_port] += cur.tx_dropped - old->tx_dropped;
+        delta_total.cap_mirrored += cur.cap_mirrored - old->cap_mirrored;
+        delta_total.cap_dropped += cur.cap_dropped - old->cap_dropped;
+        if (args[i].stage == STAGE_CAPTURE) {
+            cap_written += d.tx;
+            delta_total.cap_bytes += cur.cap_bytes - old->cap_bytes;
+        }
+        delta_total.polls += d.polls;
+        delta_total.empty_polls += d.empty_polls;
+        for (int b = 0; b < BURST_HIST_BUCKETS; b++)
+            delta_total.burst_hist[b] += d.burst_hist[b];
+    }
+    printf("%5s %11s %9.3f %9.3f %9.3f %6.1f%% %14" PRIu64 " %14" PRIu64
+           " %12" PRIu64 "\n",
+           "total", "", delta_total.rx / secs / 1e6,
+           delta_total.tx / secs / 1e6, delta_total.dropped / secs / 1e6,
+           delta_total.polls ?
+               100.0 * delta_total.empty_polls / delta_total.polls : 0.0,
+           total.rx, total.tx, total.dropped);
+
+    uint64_t bursts = 0;
+    for (int b = 0; b < BURST_HIST_BUCKETS; b++)
+        bursts += delta_total.burst_hist[b];
+    printf("Burst sizes:");
+    for (int b = 0; b < BURST_HIST_BUCKETS; b++)
+        printf(" %s:%.1f%%", burst_hist_names[b],
+               bursts ? 100.0 * delta_total.burst_hist[b] / bursts : 0.0);
+    printf("  (avg %.1f pkts/burst)\n",
+           bursts ? (double)delta_total.rx / bursts : 0.0);
+    if (nb_workers)
+        report_rings(&total);
+    for (unsigned p = 0; p < nb_pairs; p++)
+        report_policy(&pairs[p], &pair_d[p], secs);
+    if (classifier_enabled(args, nb_args))
+        printf("Classifier (Mpps): classified %.3f matched %.3f dropped %.3f marked %.3f\n",
+               acl_delta.classified / secs / 1e6, acl_delta.matched / secs / 1e6,
+               acl_delta.dropped / secs / 1e6, acl_delta.marked / secs / 1e6);
+    if (cap_file != NULL)
+        printf("Capture: mirrored %.3f Mpps, written %.3f Mpps (%.1f MB/s), dropped %.3f Mpps\n",
+               delta_total.cap_mirrored / secs / 1e6, cap_written / secs / 1e6,
+               delta_total.cap_bytes / secs / 1e6, delta_total.cap_dropped / secs / 1e6);
+#ifdef WIRE_PROFILE
+    report_profile(args, nb_args, prof_cur, prof_old);
+#endif
+    // where the ports lose packets, with the tx drops only the wire sees
+    if (xmon != NULL && prev != NULL) {
+        bfdev_xmon_sample(xmon);
+        bfdev_xmon_report(xmon, stdout, BFDEV_XMON_TOP, tx_full);
+    }
+    if (hw_rules != NULL && prev != NULL)
+        report_offload(secs);
+}
+
+// Metrics (-M and the /bfdev/metrics telemetry command): the counters of
+// each thread, read from the stats slots like the report does, so
+// collecting them costs the forwarding lcores nothing
+struct wire_metrics {
+    const struct wire_thread_args *args;
+    unsigned nb_args;
+};
+
+static const struct {
+    const char *name;
+    const char *help;
+    size_t offset;
+} thread_metrics[] = {
+    {"wire_rx_packets_total", "Packets received by the thread", offsetof(struct wire_stats, rx)},
+    {"wire_tx_packets_total", "Packets sent by the thread", offsetof(struct wire_stats, tx)},
+    {"wire_dropped_packets_total", "Packets the thread dropped", offsetof(struct wire_stats, dropped)},
+    {"wire_polls_total", "Polls of the thread", offsetof(struct wire_stats, polls)},
+    {"wire_empty_polls_total", "Polls that found no packets", offsetof(struct wire_stats, empty_polls)},
+    {"wire_tx_retries_total", "Extra tx_burst calls of the retry policy", offsetof(struct wire_stats, tx_retries)},
+    {"wire_tx_recovered_total", "Packets sent by tx retries", offsetof(struct wire_stats, tx_recovered)},
+    {"wire_tx_flushes_total", "Tx buffer flushes on timeout or idle", offsetof(struct wire_stats, tx_flushes)},
+    {"wire_tx_full_dropped_total", "Packets the tx queue did not take", offsetof(struct wire_stats, tx_dropped)},
+    {"wire_sleeps_total", "Times the thread went to sleep on an idle link", offsetof(struct wire_stats, sleeps)},
+    {"wire_wakes_total", "Sleeps that ended with traffic", offsetof(struct wire_stats, wakes)},
+    {"wire_ct_new_total", "Flows added to the flow table", offsetof(struct wire_stats, ct_new)},
+    {"wire_ct_evicted_total", "Idle software flows evicted", offsetof(struct wire_stats, ct_evicted)},
+    {"wire_acl_classified_total", "Packets looked up by the classifier", offsetof(struct wire_stats, acl.classified)},
+    {"wire_acl_matched_total", "Packets that matched a rule", offsetof(struct wire_stats, acl.matched)},
+    {"wire_acl_dropped_total", "Packets dropped by a rule", offsetof(struct wire_stats, acl.dropped)},
+    {"wire_capture_mirrored_total", "Packets handed to the capture writer", offsetof(struct wire_stats, cap_mirrored)},
+    {"wire_capture_dropped_total", "Capture copies lost", offsetof(struct wire_stats, cap_dropped)},
+};
+
+static void wire_metrics(struct bfdev_metrics *m, void *arg) {
+    const struct wire_metrics *w = arg;
+    struct wire_stats cur[WIRE_MAX_THREADS];
+    char labels[WIRE_MAX_THREADS][16];
+    uint64_t bursts[BURST_HIST_BUCKETS] = {0};
+
+    for (unsigned i = 0; i < w->nb_args; i++) {
+        cur[i] = lcore_stats[w->args[i].lcore_id];
+        thread_label(&w->args[i], labels[i], sizeof(labels[i]));
+        for (int b = 0; b < BURST_HIST_BUCKETS; b++)
+            bursts[b] += cur[i].burst_hist[b];
+    }
+    for (unsigned k = 0; k < RTE_DIM(thread_metrics); k++) {
+        bfdev_metrics_family(m, thread_metrics[k].name, BFDEV_METRIC_COUNTER, thread_metrics[k].help);
+        for (unsigned i = 0; i < w->nb_args; i++)
+            bfdev_metrics_add(m, *(const uint64_t *)((const char *)&cur[i] + thread_metrics[k].offset),
+                              "lcore=\"%u\",thread=\"%s\"", w->args[i].lcore_id, labels[i]);
+    }
+    bfdev_metrics_family(m, "wire_rx_bursts_total", BFDEV_METRIC_COUNTER,
+                         "Non-empty rx bursts by number of packets");
+    for (int b = 0; b < BURST_HIST_BUCKETS; b++)
+        bfdev_metrics_add(m, bursts[b], "size=\"%s\"", burst_hist_names[b]);
+
+    if (ct_threshold) {
+        bfdev_metrics_family(m, "wire_ct_offloaded_total", BFDEV_METRIC_COUNTER,
+                             "Flows offloaded to the eswitch");
+        bfdev_metrics_add(m, ct_installed, NULL);
+        bfdev_metrics_family(m, "wire_ct_aged_total", BFDEV_METRIC_COUNTER,
+                             "Offloaded flows that aged out");
+        bfdev_metrics_add(m, ct_aged, NULL);
+        bfdev_metrics_family(m, "wire_ct_failed_total", BFDEV_METRIC_COUNTER,
+                             "Flows that could not be offloaded");
+        bfdev_metrics_add(m, ct_failed, NULL);
+        bfdev_metrics_family(m, "wire_ct_punted_total", BFDEV_METRIC_COUNTER,
+                             "Flows kept in software because a punt rule matches them");
+        bfdev_metrics_add(m, ct_punted, NULL);
+    } else if (hw_rules != NULL) {
+        const uint32_t ids[2] = { FWD_RULE_NET_TO_HOST, FWD_RULE_HOST_TO_NET };
+        struct bfdev_rule_counters c[2];
+        int found[2];
+        bfdev_rule_table_poll(hw_rules, bfdev_rule_table_count(hw_rules));
+        for (int i = 0; i < 2; i++)
+            found[i] = bfdev_rule_table_counters(hw_rules, ids[i], &c[i]) == 0;
+        bfdev_metrics_family(m, "wire_hw_forwarded_packets_total", BFDEV_METRIC_COUNTER,
+                             "Packets forwarded by the eswitch rules");
+        for (int i = 0; i < 2; i++) {
+            if (found[i])
+                bfdev_metrics_add(m, c[i].hits, "direction=\"%s\"", i == 0 ? "net->host" : "host->net");
+        }
+        bfdev_metrics_family(m, "wire_hw_forwarded_bytes_total", BFDEV_METRIC_COUNTER,
+                             "Bytes forwarded by the eswitch rules");
+        for (int i = 0; i < 2; i++) {
+            if (found[i])
+                bfdev_metrics_add(m, c[i].bytes, "direction=\"%s\"", i == 0 ? "net->host" : "host->net");
+        }
+    }
+}
+
+// Print the rates every interval_s seconds, servicing flow offloads in
+// between. Runs on the main lcore until the wire is stopped.
+static void report_stats(struct wire_thread_args *args, unsigned nb_args,
+                         unsigned interval_s) {
+    const uint64_t hz = rte_get_tsc_hz();
+    struct wire_stats prev[WIRE_MAX_THREADS];
+    uint64_t prev_tsc = rte_rdtsc();
+
+    memset(prev, 0, sizeof(prev));
+    while (!force_quit) {
+        main_wait(args, prev_tsc + interval_s * hz);
+        uint64_t now = rte_rdtsc();
+        report_interval(args, nb_args, prev, (double)(now - prev_tsc) / hz, "Wire stats");
+        prev_tsc = now;
+    }
+}
+
+// Parse a list of lcores like "1-4,6" into at most max distinct worker
+// lcores. Returns their number or -1.
+static int parse_lcores(const char *list, unsigned *lcores, unsigned max) {
+    unsigned count = 0;
+    const char *p = list;
+
+    while (*p != '\0') {
+        char *end;
+        unsigned first = strtoul(p, &end, 10), last = first;
+        if (end == p)
+            return -1;
+        if (*end == '-') {
+            p = end + 1;
+            last = strtoul(p, &end, 10);
+            if (end == p || last < first)
+                return -1;
+        }
+        for (unsigned l = first; l <= last; l++) {
+            if (count == max || l >= RTE_MAX_LCORE || !rte_lcore_is_enabled(l) ||
+                l == rte_get_main_lcore())
+                return -1;
+            for (unsigned i = 0; i < count; i++) {
+                if (lcores[i] == l)
+                    return -1;
+            }
+            lcores[count++] = l;
+        }
+        if (*end == ',')
+            end++;
+        else if (*end != '\0')
+            return -1;
+        p = end;
+    }
+    return count;
+}
+
+// Parse -t or tx= of a topology line into the policy of a pair: drop,
+// retry[:spins] or buffer[:flush_us]. Returns 0 or -1.
+static int parse_tx_policy(const char *arg, struct wire_pair *pair) {
+    const char *colon = strchr(arg, ':');
+    size_t len = colon ? (size_t)(colon - arg) : strlen(arg);
+    int p = 0;
+
+    while (p < TX_NB_POLICIES && (strlen(tx_policy_names[p]) != len ||
+                                  strncmp(arg, tx_policy_names[p], len) != 0))
+        p++;
+    if (p == TX_NB_POLICIES || (colon != NULL && p == TX_DROP))
+        return -1;
+    pair->tx_policy = p;
+    if (colon != NULL) {
+        char *end;
+        unsigned long v = strtoul(colon + 1, &end, 0);
+        if (*end != '\0' || v == 0 || v > UINT32_MAX)
+            return -1;
+        if (p == TX_RETRY)
+            pair->tx_spins = v;
+        else
+            pair->tx_flush_us = v;
+    }
+    return 0;
+}
+
+// Parse an idle mode name. Returns the mode or -1.
+static int parse_idle_mode(const char *str) {
+    for (int m = 0; m < IDLE_NB_MODES; m++) {
+        if (strcmp(str, idle_names[m]) == 0)
+            return m;
+    }
+    return -1;
+}
+
+// Parse an expected rate such as 2000000, 500kpps or 2.5mpps. Returns 0 or -1.
+static int parse_pps(const char *str, double *pps) {
+    static const struct {
+        const char *suffix;
+        double mult;
+    } units[] = {
+        {"pps", 1}, {"kpps", 1e3}, {"mpps", 1e6}, {"gpps", 1e9},
+    };
+    char *end;
+
+    *pps = strtod(str, &end);
+    if (end == str || *pps <= 0)
+        return -1;
+    if (*end == '\0')
+        return 0;
+    for (unsigned i = 0; i < RTE_DIM(units); i++) {
+        if (strcasecmp(end, units[i].suffix) == 0) {
+            *pps *= units[i].mult;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Parse a port of the topology: a port id, or the name of a DPDK device as
+// probed by the EAL, e.g. 0000:03:00.0_representor_vf0. Returns 0 or -1.
+static int parse_port(const char *str, uint16_t *port) {
+    char *end;
+    unsigned long id = strtoul(str, &end, 0);
+
+    if (end != str && *end == '\0') {
+        if (id >= RTE_MAX_ETHPORTS)
+            return -1;
+        *port = id;
+        return 0;
+    }
+    return rte_eth_dev_get_port_by_name(str, port) == 0 ? 0 : -1;
+}
+
+// Add a pair with the default policies. Returns NULL if a port is already
+// in a pair, as a port has a single set of queues.
+static struct wire_pair *topo_add(uint16_t net, uint16_t host) {
+    if (net == host || nb_pairs == WIRE_MAX_PAIRS)
+        return NULL;
+    for (unsigned i = 0; i < nb_pairs; i++) {
+        if (pairs[i].ports[0] == net || pairs[i].ports[1] == net ||
+            pairs[i].ports[0] == host || pairs[i].ports[1] == host)
+            return NULL;
+    }
+    struct wire_pair *pair = &pairs[nb_pairs++];
+    *pair = pair_defaults;
+    pair->ports[0] = net;
+    pair->ports[1] = host;
+    return pair;
+}
+
+// Load a topology file (-c): one pair per line, "<port> <port> [key=value]...",
+// network side first, with # comments. Keys: queues=N, pps=RATE,
+// lcores=LIST (two per queue, in thread order), tx=POLICY, idle=MODE and
+// acl=FILE. Returns 0 or -1 (and logs why).
+static int topo_load(const char *path) {
+    FILE *f = fopen(path, "r");
+    char line[512];
+    unsigned lineno = 0;
+
+    if (f == NULL) {
+        printf("Cannot open topology file %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f) != NULL) {
+        char *save, *tok, *val;
+        uint16_t net, host;
+        lineno++;
+        if ((tok = strchr(line, '#')) != NULL)
+            *tok = '\0';
+        const char *a = strtok_r(line, " \t\r\n", &save);
+        if (a == NULL)
+            continue;
+        const char *b = strtok_r(NULL, " \t\r\n", &save);
+        if (b == NULL || parse_port(a, &net) != 0 || parse_port(b, &host) != 0) {
+            printf("%s:%u: needs two ports, ids or device names\n", path, lineno);
+            goto fail;
+        }
+        struct wire_pair *pair = topo_add(net, host);
+        if (pair == NULL) {
+            printf("%s:%u: ports %u and %u must differ and be in no other pair\n",
+                   path, lineno, net, host);
+            goto fail;
+        }
+
+        while ((tok = strtok_r(NULL, " \t\r\n", &save)) != NULL) {
+            int ret = -1;
+            val = strchr(tok, '=');
+            if (val != NULL)
+                *val++ = '\0';
+            if (val == NULL) {
+                ret = -1;
+            } else if (strcmp(tok, "queues") == 0) {
+                unsigned long q = strtoul(val, &val, 0);
+                if (*val == '\0' && q >= 1 && q <= BFDEV_MAX_QUEUES) {
+                    pair->nb_queues = q;
+                    ret = 0;
+                }
+            } else if (strcmp(tok, "pps") == 0) {
+                ret = parse_pps(val, &pair->pps);
+            } else if (strcmp(tok, "lcores") == 0) {
+                int n = parse_lcores(val, pair->lcores, RTE_DIM(pair->lcores));
+                if (n > 0 && n % 2 == 0) {
+                    pair->nb_lcores = n;
+                    ret = 0;
+                }
+            } else if (strcmp(tok, "tx") == 0) {
+                ret = parse_tx_policy(val, pair);
+            } else if (strcmp(tok, "idle") == 0) {
+                int m = parse_idle_mode(val);
+                if (m >= 0) {
+                    pair->idle_mode = m;
+                    ret = 0;
+                }
+            } else if (strcmp(tok, "acl") == 0) {
+                pair->acl_file = strdup(val);
+                ret = pair->acl_file != NULL ? 0 : -1;
+            }
+            if (ret != 0) {
+                printf("%s:%u: invalid '%s'\n", path, lineno, tok);
+                goto fail;
+            }
+        }
+        // pinned lcores give the queue count
+        if (pair->nb_lcores) {
+            if (pair->nb_queues && pair->nb_lcores != 2u * pair->nb_queues) {
+                printf("%s:%u: lcores= needs two lcores per queue\n", path, lineno);
+                goto fail;
+            }
+            pair->nb_queues = pair->nb_lcores / 2;
+        }
+    }
+    fclose(f);
+    if (nb_pairs == 0) {
+        printf("%s: no port pair\n", path);
+        return -1;
+    }
+    return 0;
+
+fail:
+    fclose(f);
+    return -1;
+}
+
+// Give every pair its lcores, one per thread: pairs with lcores= keep them,
+// then the capture writer (cap_lcore, RTE_MAX_LCORE to pick one) and the
+// pairs with a queue count take free lcores in EAL order, and the other
+// pairs share what is left in proportion of their expected rate, at least
+// a queue each. A pair without pps= weighs as much as the average of those
+// with one. Returns 0 or -1 (and logs why).
+static int topo_lcores(unsigned *cap_lcore) {
+    uint8_t used[RTE_MAX_LCORE] = {0};
+    unsigned free_lcores[RTE_MAX_LCORE];
+    unsigned nb_free = 0, next = 0, need = 0, nb_auto = 0, nb_pps = 0, lcore_id;
+    double sum_pps = 0;
+
+    for (unsigned p = 0; p < nb_pairs; p++) {
+        for (unsigned i = 0; i < pairs[p].nb_lcores; i++) {
+            if (used[pairs[p].lcores[i]]) {
+                printf("Lcore %u is given to two threads\n", pairs[p].lcores[i]);
+                return -1;
+            }
+            used[pairs[p].lcores[i]] = 1;
+        }
+    }
+    if (cap_lcore != NULL && *cap_lcore != RTE_MAX_LCORE) {
+        if (used[*cap_lcore]) {
+            printf("Lcore %u is given to two threads\n", *cap_lcore);
+            return -1;
+        }
+        used[*cap_lcore] = 1;
+    }
+    RTE_LCORE_FOREACH_WORKER(lcore_id) {
+        if (!used[lcore_id])
+            free_lcores[nb_free++] = lcore_id;
+    }
+
+    need = cap_lcore != NULL && *cap_lcore == RTE_MAX_LCORE;
+    for (unsigned p = 0; p < nb_pairs; p++) {
+        if (pairs[p].nb_lcores)
+            continue;
+        if (pairs[p].nb_queues) {
+            need += 2 * pairs[p].nb_queues;
+        } else {
+            need += 2;
+            nb_auto++;
+            if (pairs[p].pps > 0) {
+                sum_pps += pairs[p].pps;
+                nb_pps++;
+            }
+        }
+    }
+    if (nb_free < need) {
+        printf("Need at least %u more worker lcores for the topology, have %u free\n",
+               need, nb_free);
+        return -1;
+    }
+    if (cap_lcore != NULL && *cap_lcore == RTE_MAX_LCORE)
+        *cap_lcore = free_lcores[next++];
+    for (unsigned p = 0; p < nb_pairs; p++) {
+        if (pairs[p].nb_lcores == 0 && pairs[p].nb_queues) {
+            for (unsigned i = 0; i < 2u * pairs[p].nb_queues; i++)
+                pairs[p].lcores[i] = free_lcores[next++];
+            pairs[p].nb_lcores = 2 * pairs[p].nb_queues;
+        }
+    }
+    if (nb_auto == 0)
+        return 0;
+
+    // queues of two lcores, shared out by weight, then what rounding left
+    // (or what the minimum of one queue took too much) goes to (or comes
+    // from) the pair whose queues carry the most (the least) each
+    const unsigned avail = (nb_free - next) / 2;
+    const double avg = nb_pps ? sum_pps / nb_pps : 1;
+    double weight[WIRE_MAX_PAIRS], total = 0;
+    unsigned given = 0;
+    for (unsigned p = 0; p < nb_pairs; p++) {
+        if (pairs[p].nb_lcores == 0) {
+            weight[p] = pairs[p].pps > 0 ? pairs[p].pps : avg;
+            total += weight[p];
+        }
+    }
+    for (unsigned p = 0; p < nb_pairs; p++) {
+        if (pairs[p].nb_lcores)
+            continue;
+        unsigned q = avail * weight[p] / total;
+        pairs[p].nb_queues = RTE_MIN(RTE_MAX(q, 1u), (unsigned)BFDEV_MAX_QUEUES);
+        given += pairs[p].nb_queues;
+    }
+    while (given != avail) {
+        int best = -1;
+        for (unsigned p = 0; p < nb_pairs; p++) {
+            const unsigned q = pairs[p].nb_queues;
+            if (pairs[p].nb_lcores || (given < avail ? q == BFDEV_MAX_QUEUES : q == 1))
+                continue;
+            if (best < 0 ||
+                (given < avail ? weight[p] / q > weight[best] / pairs[best].nb_queues :
+                                 weight[p] / q < weight[best] / pairs[best].nb_queues))
+                best = p;
+        }
+        if (best < 0)
+            break;
+        pairs[best].nb_queues += given < avail ? 1 : -1;
+        given += given < avail ? 1 : -1;
+    }
+    for (unsigned p = 0; p < nb_pairs; p++) {
+        if (pairs[p].nb_lcores)
+            continue;
+        for (unsigned i = 0; i < 2u * pairs[p].nb_queues; i++)
+            pairs[p].lcores[i] = free_lcores[next++];
+        pairs[p].nb_lcores = 2 * pairs[p].nb_queues;
+    }
+    return 0;
+}
+
+static void usage(const char *prgname) {
+    printf("Usage: %s [EAL options] -- [-q nb_queues] [-b burst] [-m mtu] [-o [port:]offloads]... [-T interval] [-H [-P punt_rules]] [-C packets] [-A acl_rules] [-W workers [-R]] [-L lcores] [-I idle_mode] [-t tx_policy] [-w file [-F filter] [-S N]] [-M [addr:]port] [-X] <network_port> <host_port> | -c topology\n", prgname);
+    printf("  -c topology: file of the port pairs to forward between, one per line:\n");
+    printf("     <port> <port> [queues=N] [pps=RATE] [lcores=LIST] [tx=POLICY] [idle=MODE] [acl=FILE]\n");
+    printf("     ports are ids or device names; pairs without queues= or lcores= share the free\n");
+    printf("     lcores by expected rate (pps=, e.g. 2mpps); -t, -I and -A are the defaults\n");
+    printf("  -q nb_queues: RSS queues per port, one lcore per direction and queue (default 1,\n");
+    printf("     with -c: shared out by rate)\n");
+    printf("  -b burst: packets per rx burst, 1..%d (default %d)\n", BFDEV_MAX_PKT_BURST, BFDEV_MAX_PKT_BURST);
+    printf("  -m mtu: port MTU, mbuf data room is sized to fit it (default: device MTU)\n");
+    printf("  -o [port:]offloads: offloads to enable on a port (or all ports), comma separated\n");
+    printf("     from fast_free,rx_cksum,tx_cksum,vlan or none/all (default fast_free)\n");
+    printf("  -T interval: stats report interval in seconds, 0 to disable (default 1)\n");
+    printf("  -H: forward in the eswitch, software only sees punted flows\n");
+    printf("  -P punt_rules: rule file of the flows to punt to software with -H\n");
+    printf("  -C packets: track flows in software, offload each to the eswitch after\n");
+    printf("     that many packets, until it is idle for %u s (implies -H without forwarding rules)\n", CT_AGE);
+    printf("  -A acl_rules: rule file classified in software on every received burst,\n");
+    printf("     rules can drop, mark or pass packets\n");
+    printf("  -W workers: pipeline of an rx stage, that many worker stages and a tx stage\n");
+    printf("     per direction, each on its own lcore (max %d)\n", WIRE_MAX_WORKERS);
+    printf("  -R: with -W, send the packets in the order they were received\n");
+    printf("  -L lcores: lcores of the threads in order, e.g. 1-6 or 2,4,6,8; with -W the\n");
+    printf("     stages of each direction are rx, workers, tx (default: the EAL lcores)\n");
+    printf("  -I idle_mode: what threads do when there is no traffic: poll (default),\n");
+    printf("     pause, sleep, monitor (sleep until the NIC writes) or intr (rx interrupts)\n");
+    printf("  -t tx_policy: packets a tx queue does not take are dropped (drop, default),\n");
+    printf("     retried up to N times (retry[:N], default %u) or sent from a tx buffer\n", TX_DEFAULT_SPINS);
+    printf("     flushed every N us and when idle (buffer[:N], default %u)\n", TX_DEFAULT_FLUSH_US);
+    printf("  -w file: capture the forwarded packets to a pcapng file, written by one more\n");
+    printf("     lcore; copies are dropped rather than slowing forwarding (disables fast_free)\n");
+    printf("  -F filter: with -w, capture the packets matching a pcap filter, e.g. \"udp port 53\"\n");
+    printf("  -S N: with -w, capture one in N packets (of those matching -F)\n");
+    printf("  -M [addr:]port: serve the metrics to Prometheus on http://addr:port/metrics\n");
+    printf("     (default address 127.0.0.1); they are also in DPDK telemetry, /bfdev/metrics\n");
+    printf("  -X: add the drops of each port by cause to the stats report: rx ring full,\n");
+    printf("     no mbuf, tx full, errors, and the driver xstats that moved most\n");
+    printf("Example: sudo %s -l 0-2 -- 2 3\n", prgname);
+    printf("Example: sudo %s -l 0-8 -- -q 4 2 3\n", prgname);
+    printf("Example: sudo %s -l 0-12 -- -W 4 -R -A rules.txt 2 3\n", prgname);
+    printf("Example: sudo %s -l 0-3 -- -w wire.pcapng -F tcp -S 100 2 3\n", prgname);
+    printf("Example: sudo %s -l 0-16 -- -c bluefield.topo\n", prgname);
+}
 
 int main(int argc, char **argv)
 {
@@ -313,59 +2334,373 @@ int main(int argc, char **argv)
     argc -= ret;
     argv += ret;
 
-    // Parse application arguments -- the two ports to forward between
-    uint16_t network_port;
-    uint16_t host_port;
-    if (argc == 3) {
-        network_port = atoi(argv[1]);
-        host_port = atoi(argv[2]);
+    // Parse application arguments -- options, then the two ports to forward
+    // between, or a topology file
+    uint16_t nb_queues = 0;
+    uint16_t mtu = 0;
+    unsigned stats_interval = 1;
+    unsigned default_offloads = BFDEV_OFFLOAD_FAST_FREE;
+    unsigned offloads[RTE_MAX_ETHPORTS];
+    int offloads_set[RTE_MAX_ETHPORTS] = {0};
+    int hw_offload = 0;
+    const char *punt_file = NULL;
+    const char *lcore_list = NULL;
+    const char *topo_file = NULL;
+    const char *cap_filter = NULL;
+    const char *metrics_listen = NULL;
+    int drop_monitor = 0;
+    int opt;
+    optind = 1;
+    while ((opt = getopt(argc, argv, "q:b:m:o:T:HP:C:A:W:RL:I:t:w:F:S:M:Xc:")) != -1) {
+        switch (opt) {
+        case 'q':
+            nb_queues = atoi(optarg);
+            if (nb_queues < 1 || nb_queues > BFDEV_MAX_QUEUES) {
+                usage(argv[0]);
+                rte_exit(EXIT_FAILURE, "Error: nb_queues must be in 1..%d\n", BFDEV_MAX_QUEUES);
+            }
+            break;
+        case 'b': {
+            int b = atoi(optarg);
+            if (b < 1 || b > BFDEV_MAX_PKT_BURST)
+                rte_exit(EXIT_FAILURE, "Error: burst must be in 1..%d\n", BFDEV_MAX_PKT_BURST);
+            rx_burst = b;
+            break;
+        }
+        case 'm':
+            mtu = atoi(optarg);
+            break;
+        case 'o': {
+            // either "<port>:<list>" or "<list>" for all ports
+            const char *list = optarg;
+            char *colon = strchr(optarg, ':');
+            unsigned flags;
+            if (bfdev_parse_offloads(colon ? colon + 1 : list, &flags) != 0) {
+                usage(argv[0]);
+                rte_exit(EXIT_FAILURE, "Error: invalid offload list '%s'\n", optarg);
+            }
+            if (colon) {
+                unsigned p = atoi(optarg);
+                if (p >= RTE_MAX_ETHPORTS)
+                    rte_exit(EXIT_FAILURE, "Error: invalid port in '%s'\n", optarg);
+                offloads[p] = flags;
+                offloads_set[p] = 1;
+            } else {
+                default_offloads = flags;
+            }
+            break;
+        }
+        case 'T':
+            stats_interval = atoi(optarg);
+            break;
+        case 'H':
+            hw_offload = 1;
+            break;
+        case 'P':
+            punt_file = optarg;
+            break;
+        case 'C':
+            ct_threshold = atoi(optarg);
+            if (ct_threshold < 1)
+                rte_exit(EXIT_FAILURE, "Error: -C needs at least 1 packet\n");
+            hw_offload = 1;
+            break;
+        case 'A':
+            pair_defaults.acl_file = optarg;
+            break;
+        case 'W':
+            nb_workers = atoi(optarg);
+            if (nb_workers < 1 || nb_workers > WIRE_MAX_WORKERS)
+                rte_exit(EXIT_FAILURE, "Error: -W must be in 1..%d\n", WIRE_MAX_WORKERS);
+            break;
+        case 'R':
+            reorder = 1;
+            break;
+        case 'L':
+            lcore_list = optarg;
+            break;
+        case 't':
+            if (parse_tx_policy(optarg, &pair_defaults) != 0) {
+                usage(argv[0]);
+                rte_exit(EXIT_FAILURE, "Error: invalid tx policy '%s'\n", optarg);
+            }
+            break;
+        case 'w':
+            cap_file = optarg;
+            break;
+        case 'F':
+            cap_filter = optarg;
+            break;
+        case 'S':
+            cap_sample = atoi(optarg);
+            if (cap_sample < 1)
+                rte_exit(EXIT_FAILURE, "Error: -S must be at least 1\n");
+            break;
+        case 'M':
+            metrics_listen = optarg;
+            break;
+        case 'X':
+            drop_monitor = 1;
+            break;
+        case 'c':
+            topo_file = optarg;
+            break;
+        case 'I': {
+            int m = parse_idle_mode(optarg);
+            if (m < 0) {
+                usage(argv[0]);
+                rte_exit(EXIT_FAILURE, "Error: invalid idle mode '%s'\n", optarg);
+            }
+            pair_defaults.idle_mode = m;
+            break;
+        }
+        default:
+            usage(argv[0]);
+            rte_exit(EXIT_FAILURE, "Error: invalid option\n");
+        }
+    }
+    if (topo_file != NULL) {
+        if (argc - optind != 0 || lcore_list != NULL)
+            rte_exit(EXIT_FAILURE, "Error: -c replaces the port arguments and -L\n");
+        if (topo_load(topo_file) != 0)
+            rte_exit(EXIT_FAILURE, "Invalid topology file %s\n", topo_file);
+        // -q is the queue count of the pairs without one
+        for (unsigned p = 0; p < nb_pairs && nb_queues; p++) {
+            if (pairs[p].nb_queues == 0)
+                pairs[p].nb_queues = nb_queues;
+        }
+    } else if (argc - optind == 2) {
+        uint16_t net = atoi(argv[optind]), host = atoi(argv[optind + 1]);
+        if (net >= RTE_MAX_ETHPORTS || host >= RTE_MAX_ETHPORTS || topo_add(net, host) == NULL)
+            rte_exit(EXIT_FAILURE, "Error: invalid port number\n");
+        pairs[0].nb_queues = nb_queues ? nb_queues : 1;
+    } else {
+        bfdev_list_ports();
+        usage(argv[0]);
+        rte_exit(EXIT_FAILURE, "Error: exactly 2 port arguments, or -c, required\n");
+    }
+
+    if (reorder && !nb_workers)
+        rte_exit(EXIT_FAILURE, "Error: -R needs the pipeline (-W)\n");
+    if (ct_threshold && nb_workers)
+        rte_exit(EXIT_FAILURE, "Error: -C and -W cannot be combined\n");
+    if ((cap_filter != NULL || cap_sample > 1) && cap_file == NULL)
+        rte_exit(EXIT_FAILURE, "Error: -F and -S need a capture file (-w)\n");
+    // the pipeline rings and the eswitch rules are those of a single pair
+    if (nb_pairs > 1 && (nb_workers || hw_offload))
+        rte_exit(EXIT_FAILURE, "Error: -W, -H and -C need a topology of one pair\n");
+
+    // Need one worker lcore per (direction, queue) pair, or per stage, and
+    // one for the capture writer
+    unsigned nb_fwd_threads = 0, nb_threads;
+    unsigned lcores[WIRE_MAX_THREADS];
+    unsigned cap_lcore = RTE_MAX_LCORE;
+    if (nb_workers) {
+        if (pairs[0].nb_lcores)
+            rte_exit(EXIT_FAILURE, "Error: with -W, the stages run on -L or the EAL lcores\n");
+        if (pairs[0].nb_queues == 0)
+            pairs[0].nb_queues = 1;
+        nb_fwd_threads = 2 * (nb_workers + 2);
+        nb_threads = nb_fwd_threads + (cap_file != NULL);
+        if (rte_lcore_count() - 1 < nb_threads)
+            rte_exit(EXIT_FAILURE, "Need at least %u worker lcores for %u workers. Run with -l 0-%u\n",
+                     nb_threads, nb_workers, nb_threads);
+        if (lcore_list != NULL &&
+            parse_lcores(lcore_list, lcores, nb_threads) != (int)nb_threads)
+            rte_exit(EXIT_FAILURE, "Error: -L needs %u distinct worker lcores\n", nb_threads);
+        if (lcore_list == NULL) {
+            unsigned n = 0, lcore_id;
+            RTE_LCORE_FOREACH_WORKER(lcore_id) {
+                if (n == nb_threads)
+                    break;
+                lcores[n++] = lcore_id;
+            }
+        }
     } else {
-        list_ports();
-        printf("Usage: %s [EAL options] -- <network_port> <host_port>\n", argv[0]);        
-        printf("Example: sudo %s -l 0-2 -- 2 3\n", argv[0]);
-        rte_exit(EXIT_FAILURE, "Error: exactly 2 port arguments required\n");
+        if (lcore_list != NULL) {
+            // the threads of the pair in order, then the capture writer
+            const unsigned n = 2 * pairs[0].nb_queues + (cap_file != NULL);
+            if (parse_lcores(lcore_list, lcores, n) != (int)n)
+                rte_exit(EXIT_FAILURE, "Error: -L needs %u distinct worker lcores\n", n);
+            memcpy(pairs[0].lcores, lcores, 2 * pairs[0].nb_queues * sizeof(lcores[0]));
+            pairs[0].nb_lcores = 2 * pairs[0].nb_queues;
+            if (cap_file != NULL)
+                cap_lcore = lcores[n - 1];
+        }
+        if (topo_lcores(cap_file != NULL ? &cap_lcore : NULL) != 0)
+            rte_exit(EXIT_FAILURE, "Cannot share out the lcores, run with more of them (-l)\n");
+        for (unsigned p = 0; p < nb_pairs; p++)
+            nb_fwd_threads += pairs[p].nb_lcores;
+        nb_threads = nb_fwd_threads + (cap_file != NULL);
     }
-     
-    
-    // Initialize the port
-    port_init(network_port);
-    port_init(host_port);
-    PORT_A = network_port;
-    PORT_B = host_port;
 
-    // Create thread arguments
-    struct wire_thread_args args1 = {.in_port = network_port, .out_port = host_port};
-    struct wire_thread_args args2 = {.in_port = host_port, .out_port = network_port};
+    // Initialize the ports, each with the queues of its pair
+    struct bfdev_port_conf conf;
+    bfdev_port_conf_init(&conf);
+    conf.mtu = mtu;
+    if (cap_file != NULL) {
+        // fast free needs mbufs with a single reference, and the capture
+        // rings can hold on to them
+        default_offloads &= ~BFDEV_OFFLOAD_FAST_FREE;
+        for (unsigned p = 0; p < RTE_MAX_ETHPORTS; p++) {
+            if (offloads_set[p])
+                offloads[p] &= ~BFDEV_OFFLOAD_FAST_FREE;
+        }
+    }
+    if (hw_offload) {
+        conf.flow_queues = 1;
+        conf.flow_counters = MAX_HW_RULES + (ct_threshold ? CT_MAX_OFFLOADED : 0);
+    }
+    for (unsigned p = 0; p < nb_pairs; p++) {
+        struct wire_pair *pair = &pairs[p];
+        conf.nb_rxq = pair->nb_queues;
+        conf.nb_txq = pair->nb_queues;
+        conf.rx_intr = pair->idle_mode == IDLE_INTR;
+        // the capture ring of every thread sending a port's packets
+        if (cap_file != NULL)
+            conf.extra_mbufs = (nb_workers ? 1 : pair->nb_queues) * CAP_RING_SIZE;
+        for (int i = 0; i < 2; i++) {
+            const uint16_t port = pair->ports[i];
+            conf.offloads = offloads_set[port] ? offloads[port] : default_offloads;
+            if (bfdev_port_init(port, &conf) != 0)
+                rte_exit(EXIT_FAILURE, "Cannot init port %u\n", port);
+        }
+        // a port that strips VLAN tags needs its peer to insert them again
+        const struct bfdev_port *net = bfdev_port_get(pair->ports[0]);
+        const struct bfdev_port *host = bfdev_port_get(pair->ports[1]);
+        if (((net->rx_offloads & RTE_ETH_RX_OFFLOAD_VLAN_STRIP) &&
+             !(host->tx_offloads & RTE_ETH_TX_OFFLOAD_VLAN_INSERT)) ||
+            ((host->rx_offloads & RTE_ETH_RX_OFFLOAD_VLAN_STRIP) &&
+             !(net->tx_offloads & RTE_ETH_TX_OFFLOAD_VLAN_INSERT)))
+            rte_exit(EXIT_FAILURE, "Error: vlan offload must be enabled on both ports %u and %u\n",
+                     pair->ports[0], pair->ports[1]);
+    }
+    if (drop_monitor) {
+        uint16_t ports[RTE_MAX_ETHPORTS];
+        for (unsigned i = 0; i < 2 * nb_pairs; i++)
+            ports[i] = pairs[i / 2].ports[i % 2];
+        if (stats_interval == 0)
+            rte_exit(EXIT_FAILURE, "Error: -X needs the stats report (-T)\n");
+        xmon = bfdev_xmon_create(ports, 2 * nb_pairs);
+        if (xmon == NULL)
+            rte_exit(EXIT_FAILURE, "Cannot monitor the drops of the ports\n");
+    }
 
-    printf("Starting bidirectional wire between ports %u and %u\n", network_port, host_port);
-    
-    // Run on first two cores that are not the main lcore (current core)
-    // note: it is okay to also run a thread on the current core, after
-    // all the setup is finished. For that, you don't use rte_eal_remote_launch,
-    // but just call the function directly after launching other threads.
-    unsigned launched_thread_ct = 0;
-    unsigned lcore_id;
-    unsigned lcore1 = 0, lcore2 = 0;
-
-    // Find two available lcores (skip main lcore)
-    RTE_LCORE_FOREACH_WORKER(lcore_id) {
-        if (launched_thread_ct == 0) {
-            lcore1 = lcore_id;
-            launched_thread_ct++;
-        } else if (launched_thread_ct == 1) {
-            lcore2 = lcore_id;
-            launched_thread_ct++;
-            break;
+    // one classifier per receiving port, on the port's socket
+    for (unsigned p = 0; p < nb_pairs; p++) {
+        struct wire_pair *pair = &pairs[p];
+        struct bfdev_rule *rules;
+        unsigned nb_rules;
+        char name[32];
+        if (pair->acl_file == NULL)
+            continue;
+        if (bfdev_rules_load(pair->acl_file, &rules, &nb_rules) != 0)
+            rte_exit(EXIT_FAILURE, "Cannot load %s\n", pair->acl_file);
+        for (int i = 0; i < 2; i++) {
+            snprintf(name, sizeof(name), "wire_acl_%u", pair->ports[i]);
+            pair->acl[i] = bfdev_acl_create(name, rules, nb_rules, pair->ports[i],
+                                            rte_eth_dev_socket_id(pair->ports[i]));
         }
+        free(rules);
+        if (pair->acl[0] == NULL || pair->acl[1] == NULL)
+            rte_exit(EXIT_FAILURE, "Cannot build the classifier of %s\n", pair->acl_file);
+        printf("Classifier: %u rules on port %u, %u on port %u\n",
+               bfdev_acl_count(pair->acl[0]), pair->ports[0],
+               bfdev_acl_count(pair->acl[1]), pair->ports[1]);
     }
-    if (launched_thread_ct < 2) {
-        rte_exit(EXIT_FAILURE, "Need at least 2 worker lcores. Run with -l 0-2\n");
+
+    // Create thread arguments: queue q of each direction of a pair is
+    // handled by one thread, on the lcores of the pair in that order
+    struct wire_thread_args args[WIRE_MAX_THREADS];
+    memset(args, 0, sizeof(args));
+    unsigned n = 0;
+    for (unsigned p = 0; p < nb_pairs && !nb_workers; p++) {
+        const struct wire_pair *pair = &pairs[p];
+        for (unsigned i = 0; i < pair->nb_lcores; i++, n++) {
+            args[n] = (struct wire_thread_args){
+                .in_port = pair->ports[i % 2], .out_port = pair->ports[!(i % 2)],
+                .queue = i / 2, .index = n, .acl = pair->acl[i % 2], .pair = pair};
+            lcores[n] = pair->lcores[i];
+        }
+    }
+    if (nb_workers)
+        pipeline_init(args, &pairs[0]);
+    if (ct_threshold)
+        ct_init(args, nb_fwd_threads);
+    if (cap_file != NULL) {
+        cap_init(args, nb_fwd_threads, cap_filter);
+        args[nb_fwd_threads] = (struct wire_thread_args){
+            .in_port = pairs[0].ports[0], .out_port = pairs[0].ports[1], .index = nb_fwd_threads,
+            .stage = STAGE_CAPTURE, .pair = &pairs[0]};
+        if (!nb_workers)
+            lcores[nb_fwd_threads] = cap_lcore;
+    }
+
+    struct wire_metrics metrics = { .args = args, .nb_args = nb_threads };
+    if (bfdev_metrics_init(metrics_listen) != 0)
+        rte_exit(EXIT_FAILURE, "Cannot serve the metrics on %s\n", metrics_listen);
+    bfdev_metrics_register(bfdev_metrics_ports, NULL);
+    bfdev_metrics_register(wire_metrics, &metrics);
+
+    // the eswitch rules go last: rte_exit() tears the EAL down, so nothing
+    // may fail between here and their removal at the end of main()
+    if (hw_offload && wire_offload(pairs[0].ports[0], pairs[0].ports[1], punt_file,
+                                   !ct_threshold) != 0) {
+        printf("Hardware offload failed, forwarding everything in software\n");
+        ct_threshold = 0;
+    }
+
+    for (unsigned p = 0; p < nb_pairs; p++) {
+        const struct wire_pair *pair = &pairs[p];
+        printf("Starting bidirectional wire between ports %u and %u with %u queue(s)",
+               pair->ports[0], pair->ports[1], pair->nb_queues);
+        if (nb_workers)
+            printf(", %u workers per direction%s", nb_workers, reorder ? ", in order" : "");
+        if (pair->pps > 0)
+            printf(", %.3f Mpps expected", pair->pps / 1e6);
+        if (nb_pairs > 1)
+            printf(", tx %s, idle %s", tx_policy_names[pair->tx_policy],
+                   idle_names[pair->idle_mode]);
+        printf("\n");
+    }
+
+    // Run each thread on its own worker lcore (skip main lcore).
+    // note: the main lcore is used to report stats.
+    for (unsigned i = 0; i < nb_threads; i++) {
+        args[i].lcore_id = lcores[i];
+        rte_eal_remote_launch(wire_lcore, &args[i], lcores[i]);
     }
-    // Launch on two different lcores
-    rte_eal_remote_launch(wire_lcore, &args1, lcore1);
-    rte_eal_remote_launch(wire_lcore, &args2, lcore2);
-    // Wait for lcores to finish (this will never happen, they run forever in this program)
+
+    // Report stats until the program is stopped
+    const uint64_t start_tsc = rte_rdtsc();
+    if (stats_interval > 0)
+        report_stats(args, nb_threads, stats_interval);
+    else
+        main_wait(args, UINT64_MAX);
     rte_eal_mp_wait_lcore();
+    printf("\nWire threads stopped, closing the ports\n");
 
+    // nothing reads the ports or the rules after this
+    bfdev_metrics_stop();
+    // the flow rules first, they live on the ports
+    wire_offload_remove();
+    // give the NICs a moment to send what is on their tx rings
+    usleep(WIRE_DRAIN_US / 10);
+    report_interval(args, nb_threads, NULL, (double)(rte_rdtsc() - start_tsc) / rte_get_tsc_hz(),
+                    "Final wire stats");
+    for (unsigned i = 0; i < 2 * nb_pairs; i++) {
+        uint16_t port = pairs[i / 2].ports[i % 2];
+        ret = rte_eth_dev_stop(port);
+        if (ret != 0)
+            printf("Port %u: stop failed: %s\n", port, strerror(-ret));
+        rte_eth_dev_close(port);
+    }
+    for (unsigned p = 0; p < nb_pairs; p++) {
+        bfdev_acl_free(pairs[p].acl[0]);
+        bfdev_acl_free(pairs[p].acl[1]);
+    }
+    rte_bpf_destroy(cap_bpf);
+    bfdev_xmon_free(xmon);
+    rte_eal_cleanup();
     return 0;
 }
@@ -0,0 +1,304 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+
+#include <rte_acl.h>
+#include <rte_ether.h>
+#include <rte_ip.h>
+#include <rte_mbuf.h>
+#include <rte_malloc.h>
+#include <rte_prefetch.h>
+
+#include "bfdev_port.h"
+#include "bfdev_flow.h"
+#include "bfdev_acl.h"
+
+// Packets ahead of the one being parsed whose headers are prefetched
+#define ACL_PREFETCH_OFFSET 4
+
+// What the classifier looks at, extracted from each packet so that VLAN
+// tags and IP options do not move the fields. Values are in network byte
+// order, as rte_acl reads them.
+struct acl_key {
+    uint8_t proto;
+    uint8_t pad[3];
+    uint32_t src_ip;
+    uint32_t dst_ip;
+    uint16_t src_port;
+    uint16_t dst_port;
+};
+
+enum {
+    ACL_FIELD_PROTO,
+    ACL_FIELD_SRC_IP,
+    ACL_FIELD_DST_IP,
+    ACL_FIELD_SRC_PORT,
+    ACL_FIELD_DST_PORT,
+    ACL_NB_FIELDS
+};
+
+// rte_acl reads its input 4 bytes at a time: the protocol has a group of
+// its own and both ports share one
+static const struct rte_acl_field_def acl_defs[ACL_NB_FIELDS] = {
+    {
+        .type = RTE_ACL_FIELD_TYPE_BITMASK, .size = sizeof(uint8_t),
+        .field_index = ACL_FIELD_PROTO, .input_index = 0,
+        .offset = offsetof(struct acl_key, proto),
+    },
+    {
+        .type = RTE_ACL_FIELD_TYPE_MASK, .size = sizeof(uint32_t),
+        .field_index = ACL_FIELD_SRC_IP, .input_index = 1,
+        .offset = offsetof(struct acl_key, src_ip),
+    },
+    {
+        .type = RTE_ACL_FIELD_TYPE_MASK, .size = sizeof(uint32_t),
+        .field_index = ACL_FIELD_DST_IP, .input_index = 2,
+        .offset = offsetof(struct acl_key, dst_ip),
+    },
+    {
+        .type = RTE_ACL_FIELD_TYPE_RANGE, .size = sizeof(uint16_t),
+        .field_index = ACL_FIELD_SRC_PORT, .input_index = 3,
+        .offset = offsetof(struct acl_key, src_port),
+    },
+    {
+        .type = RTE_ACL_FIELD_TYPE_RANGE, .size = sizeof(uint16_t),
+        .field_index = ACL_FIELD_DST_PORT, .input_index = 3,
+        .offset = offsetof(struct acl_key, dst_port),
+    },
+};
+
+RTE_ACL_RULE_DEF(acl_rule, ACL_NB_FIELDS);
+
+// Action of a classifier rule, indexed by the rte_acl userdata - 1
+struct acl_action {
+    enum bfdev_action action;
+    uint16_t mark;
+};
+
+struct bfdev_acl {
+    struct rte_acl_ctx *ctx;
+    unsigned nb_rules;
+    struct acl_action actions[];
+};
+
+#define ACL_MATCH_SUPPORTED (BFDEV_MATCH_SRC_IP | BFDEV_MATCH_DST_IP | BFDEV_MATCH_PROTO | \
+                             BFDEV_MATCH_SRC_PORT | BFDEV_MATCH_DST_PORT | BFDEV_MATCH_IN_PORT)
+
+static const struct bfdev_rule *sort_rules;
+
+// Order of precedence: lower prio first, then file order
+static int cmp_precedence(const void *a, const void *b) {
+    const struct bfdev_rule *x = &sort_rules[*(const unsigned *)a];
+    const struct bfdev_rule *y = &sort_rules[*(const unsigned *)b];
+
+    if (x->priority != y->priority)
+        return x->priority < y->priority ? -1 : 1;
+    return *(const unsigned *)a < *(const unsigned *)b ? -1 : 1;
+}
+
+static void acl_rule_init(struct acl_rule *ar, const struct bfdev_rule *r) {
+    const unsigned m = r->match;
+
+    memset(ar, 0, sizeof(*ar));
+    if (m & BFDEV_MATCH_PROTO) {
+        ar->field[ACL_FIELD_PROTO].value.u8 = r->proto;
+        ar->field[ACL_FIELD_PROTO].mask_range.u8 = 0xFF;
+    }
+    // for MASK fields mask_range is a prefix length
+    if (m & BFDEV_MATCH_SRC_IP) {
+        ar->field[ACL_FIELD_SRC_IP].value.u32 = r->src_ip;
+        ar->field[ACL_FIELD_SRC_IP].mask_range.u32 = r->src_ip_len;
+    }
+    if (m & BFDEV_MATCH_DST_IP) {
+        ar->field[ACL_FIELD_DST_IP].value.u32 = r->dst_ip;
+        ar->field[ACL_FIELD_DST_IP].mask_range.u32 = r->dst_ip_len;
+    }
+    ar->field[ACL_FIELD_SRC_PORT].value.u16 = (m & BFDEV_MATCH_SRC_PORT) ? r->src_port : 0;
+    ar->field[ACL_FIELD_SRC_PORT].mask_range.u16 =
+        (m & BFDEV_MATCH_SRC_PORT) ? r->src_port : UINT16_MAX;
+    ar->field[ACL_FIELD_DST_PORT].value.u16 = (m & BFDEV_MATCH_DST_PORT) ? r->dst_port : 0;
+    ar->field[ACL_FIELD_DST_PORT].mask_range.u16 =
+        (m & BFDEV_MATCH_DST_PORT) ? r->dst_port : UINT16_MAX;
+}
+
+struct bfdev_acl *bfdev_acl_create(const char *name, const struct bfdev_rule *rules,
+                                   unsigned nb_rules, uint16_t in_port, int socket) {
+    struct bfdev_acl *acl = NULL;
+    unsigned *order = NULL;
+    unsigned n = 0;
+
+    if (nb_rules > BFDEV_ACL_MAX_RULES) {
+        printf("ACL %s: %u rules, at most %u\n", name, nb_rules, BFDEV_ACL_MAX_RULES);
+        return NULL;
+    }
+    order = malloc((nb_rules + 1) * sizeof(*order));
+    acl = rte_zmalloc_socket(name, sizeof(*acl) + nb_rules * sizeof(acl->actions[0]),
+                             RTE_CACHE_LINE_SIZE, socket);
+    if (order == NULL || acl == NULL)
+        goto fail;
+
+    for (unsigned i = 0; i < nb_rules; i++) {
+        const struct bfdev_rule *r = &rules[i];
+        if ((r->match & ~ACL_MATCH_SUPPORTED) ||
+            (r->action != BFDEV_ACTION_DROP && r->action != BFDEV_ACTION_MARK &&
+             r->action != BFDEV_ACTION_PASS)) {
+            char line[256];
+            bfdev_rule_format(r, line, sizeof(line));
+            printf("ACL %s: rule not supported in software: %s\n", name, line);
+            goto fail;
+        }
+        if ((r->match & BFDEV_MATCH_IN_PORT) && r->in_port != in_port)
+            continue;
+        order[n++] = i;
+    }
+    sort_rules = rules;
+    qsort(order, n, sizeof(*order), cmp_precedence);
+
+    struct rte_acl_param param = {
+        .name = name,
+        .socket_id = socket,
+        .rule_size = RTE_ACL_RULE_SZ(ACL_NB_FIELDS),
+        .max_rule_num = RTE_MAX(n, 1u),
+    };
+    acl->ctx = rte_acl_create(&param);
+    if (acl->ctx == NULL)
+        goto fail;
+
+    for (unsigned rank = 0; rank < n; rank++) {
+        const struct bfdev_rule *r = &rules[order[rank]];
+        struct acl_rule ar;
+        acl_rule_init(&ar, r);
+        ar.data.category_mask = 1;
+        ar.data.priority = RTE_ACL_MAX_PRIORITY - rank;
+        ar.data.userdata = rank + 1;  // 0 means no match
+        acl->actions[rank].action = r->action;
+        acl->actions[rank].mark = r->action_arg;
+        if (rte_acl_add_rules(acl->ctx, (const struct rte_acl_rule *)&ar, 1) != 0)
+            goto fail;
+    }
+
+    struct rte_acl_config cfg;
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.num_categories = 1;
+    cfg.num_fields = ACL_NB_FIELDS;
+    memcpy(cfg.defs, acl_defs, sizeof(acl_defs));
+    if (rte_acl_build(acl->ctx, &cfg) != 0)
+        goto fail;
+    acl->nb_rules = n;
+    free(order);
+    return acl;
+
+fail:
+    printf("ACL %s: cannot build the classifier\n", name);
+    free(order);
+    bfdev_acl_free(acl);
+    return NULL;
+}
+
+void bfdev_acl_free(struct bfdev_acl *acl) {
+    if (acl == NULL)
+        return;
+    rte_acl_free(acl->ctx);
+    rte_free(acl);
+}
+
+unsigned bfdev_acl_count(const struct bfdev_acl *acl) {
+    return acl->nb_rules;
+}
+
+// Fill the key of an IPv4 packet. Returns -1 for other packets.
+static inline int acl_parse(const struct rte_mbuf *m, struct acl_key *key) {
+    const struct rte_ether_hdr *eth = rte_pktmbuf_mtod(m, const struct rte_ether_hdr *);
+    uint16_t type = eth->ether_type;
+    uint32_t off = sizeof(*eth);
+
+    if (type == rte_cpu_to_be_16(RTE_ETHER_TYPE_VLAN)) {
+        const struct rte_vlan_hdr *vh = (const struct rte_vlan_hdr *)(eth + 1);
+        type = vh->eth_proto;
+        off += sizeof(*vh);
+    }
+    if (type != rte_cpu_to_be_16(RTE_ETHER_TYPE_IPV4) ||
+        m->data_len < off + sizeof(struct rte_ipv4_hdr))
+        return -1;
+    const struct rte_ipv4_hdr *ip = rte_pktmbuf_mtod_offset(m, const struct rte_ipv4_hdr *, off);
+    key->proto = ip->next_proto_id;
+    key->src_ip = ip->src_addr;
+    key->dst_ip = ip->dst_addr;
+    key->src_port = 0;
+    key->dst_port = 0;
+
+    // ports of TCP/UDP packets that are not later fragments
+    off += rte_ipv4_hdr_len(ip);
+    if ((key->proto == IPPROTO_TCP || key->proto == IPPROTO_UDP) &&
+        !(ip->fragment_offset & rte_cpu_to_be_16(RTE_IPV4_HDR_OFFSET_MASK)) &&
+        m->data_len >= off + 2 * sizeof(uint16_t)) {
+        const uint16_t *ports = rte_pktmbuf_mtod_offset(m, const uint16_t *, off);
+        key->src_port = ports[0];
+        key->dst_port = ports[1];
+    }
+    return 0;
+}
+
+uint16_t bfdev_acl_apply(const struct bfdev_acl *acl, struct rte_mbuf **bufs,
+                         uint16_t nb_pkts, struct bfdev_acl_stats *stats) {
+    struct acl_key keys[BFDEV_MAX_PKT_BURST];
+    const uint8_t *data[BFDEV_MAX_PKT_BURST];
+    uint32_t results[BFDEV_MAX_PKT_BURST];
+    uint16_t idx[BFDEV_MAX_PKT_BURST];
+    uint8_t drop[BFDEV_MAX_PKT_BURST];
+    struct rte_mbuf *dropped[BFDEV_MAX_PKT_BURST];
+    uint16_t nb = 0, nb_fwd = 0, nb_drop = 0;
+
+    RTE_ASSERT(nb_pkts <= BFDEV_MAX_PKT_BURST);
+    for (uint16_t i = 0; i < ACL_PREFETCH_OFFSET && i < nb_pkts; i++)
+        rte_prefetch0(rte_pktmbuf_mtod(bufs[i], void *));
+    for (uint16_t i = 0; i < nb_pkts; i++) {
+        if (i + ACL_PREFETCH_OFFSET < nb_pkts)
+            rte_prefetch0(rte_pktmbuf_mtod(bufs[i + ACL_PREFETCH_OFFSET], void *));
+        drop[i] = 0;
+        if (acl_parse(bufs[i], &keys[nb]) == 0) {
+            data[nb] = (const uint8_t *)&keys[nb];
+            idx[nb++] = i;
+        }
+    }
+    if (nb == 0 || acl->nb_rules == 0)
+        return nb_pkts;
+
+    // one call for the whole burst, rte_acl uses the widest vector
+    // classifier the CPU has (NEON on the BlueField cores)
+    rte_acl_classify(acl->ctx, data, results, nb, 1);
+    stats->classified += nb;
+
+    for (uint16_t k = 0; k < nb; k++) {
+        if (results[k] == 0)
+            continue;
+        const struct acl_action *a = &acl->actions[results[k] - 1];
+        struct rte_mbuf *m = bufs[idx[k]];
+        stats->matched++;
+        switch (a->action) {
+        case BFDEV_ACTION_DROP:
+            drop[idx[k]] = 1;
+            break;
+        case BFDEV_ACTION_MARK:
+            m->hash.fdir.hi = a->mark;
+            m->ol_flags |= RTE_MBUF_F_RX_FDIR | RTE_MBUF_F_RX_FDIR_ID;
+            stats->marked++;
+            break;
+        default:
+            break;
+        }
+    }
+
+    for (uint16_t i = 0; i < nb_pkts; i++) {
+        if (drop[i])
+            dropped[nb_drop++] = bufs[i];
+        else
+            bufs[nb_fwd++] = bufs[i];
+    }
+    if (nb_drop > 0) {
+        rte_pktmbuf_free_bulk(dropped, nb_drop);
+        stats->dropped += nb_drop;
+    }
+    return nb_fwd;
+}
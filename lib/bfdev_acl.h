@@ -0,0 +1,45 @@
+// libbfdev software classifier: a ruleset (see bfdev_flow.h) compiled into
+// an rte_acl context and applied to bursts of received packets.
+#ifndef BFDEV_ACL_H
+#define BFDEV_ACL_H
+
+#include <stdint.h>
+#include <rte_mbuf.h>
+
+#include "bfdev_flow.h"
+
+// Most rules in one classifier
+#define BFDEV_ACL_MAX_RULES 65536
+
+struct bfdev_acl;
+
+// Per-caller counters of bfdev_acl_apply(), never shared between lcores
+struct bfdev_acl_stats {
+    uint64_t classified;         // IPv4 packets looked up
+    uint64_t matched;
+    uint64_t dropped;
+    uint64_t marked;
+};
+
+// Build a classifier from the rules that apply to packets received on
+// in_port (rules without in_port, or with this in_port). Rules can match
+// src_ip, dst_ip, proto, src_port and dst_port, and drop, mark or pass.
+// When several rules match, the lowest prio wins, then the first rule.
+// Returns NULL (and logs why) on failure.
+struct bfdev_acl *bfdev_acl_create(const char *name, const struct bfdev_rule *rules,
+                                   unsigned nb_rules, uint16_t in_port, int socket);
+
+void bfdev_acl_free(struct bfdev_acl *acl);
+
+// Number of rules of the classifier
+unsigned bfdev_acl_count(const struct bfdev_acl *acl);
+
+// Classify up to BFDEV_MAX_PKT_BURST packets and apply the actions: dropped
+// packets are freed, marked ones get the mark in hash.fdir.hi with
+// RTE_MBUF_F_RX_FDIR_ID set. The packets to forward are moved to the front
+// of bufs, in order. Returns their number. Packets that are not IPv4 are
+// not classified and always forwarded.
+uint16_t bfdev_acl_apply(const struct bfdev_acl *acl, struct rte_mbuf **bufs,
+                         uint16_t nb_pkts, struct bfdev_acl_stats *stats);
+
+#endif
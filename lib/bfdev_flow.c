@@ -0,0 +1,866 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <rte_ethdev.h>
+#include <rte_flow.h>
+#include <rte_cycles.h>
+
+#include "bfdev_port.h"
+#include "bfdev_flow.h"
+
+// Template tables are sized for at least this many rules, so that rules
+// added later to a shape still fit
+#define FLOW_TABLE_MIN_RULES 4096
+#define MAX_SHAPES 64
+
+/***  Rule files ***/
+
+static int parse_ip_prefix(const char *str, uint32_t *ip, uint8_t *len) {
+    char buf[32];
+    char *slash;
+    struct in_addr addr;
+
+    snprintf(buf, sizeof(buf), "%s", str);
+    *len = 32;
+    slash = strchr(buf, '/');
+    if (slash != NULL) {
+        *slash++ = '\0';
+        int l = atoi(slash);
+        if (l < 1 || l > 32)
+            return -1;
+        *len = l;
+    }
+    if (inet_pton(AF_INET, buf, &addr) != 1)
+        return -1;
+    *ip = ntohl(addr.s_addr);
+    if (*len < 32)
+        *ip &= ~(UINT32_MAX >> *len);
+    return 0;
+}
+
+static int parse_u16(const char *str, unsigned max, uint16_t *v) {
+    char *end;
+    unsigned long n = strtoul(str, &end, 0);
+
+    if (end == str || *end != '\0' || n > max)
+        return -1;
+    *v = n;
+    return 0;
+}
+
+int bfdev_rule_parse(const char *line, struct bfdev_rule *rule) {
+    char buf[512];
+    char *tok, *save, *val, *end;
+    int have_action = 0;
+
+    snprintf(buf, sizeof(buf), "%s", line);
+    if ((tok = strchr(buf, '#')) != NULL)
+        *tok = '\0';
+    memset(rule, 0, sizeof(*rule));
+
+    tok = strtok_r(buf, " \t\r\n", &save);
+    if (tok == NULL)
+        return 1;
+    unsigned long id = strtoul(tok, &end, 0);
+    if (end == tok || *end != '\0' || id > UINT32_MAX)
+        return -1;
+    rule->id = id;
+
+    while ((tok = strtok_r(NULL, " \t\r\n", &save)) != NULL) {
+        val = strchr(tok, '=');
+        if (val != NULL)
+            *val++ = '\0';
+
+        if (strcmp(tok, "drop") == 0 && val == NULL) {
+            rule->action = BFDEV_ACTION_DROP;
+            have_action++;
+        } else if (strcmp(tok, "punt") == 0 && val == NULL) {
+            rule->action = BFDEV_ACTION_PUNT;
+            have_action++;
+        } else if (strcmp(tok, "pass") == 0 && val == NULL) {
+            rule->action = BFDEV_ACTION_PASS;
+            have_action++;
+        } else if (val == NULL) {
+            return -1;
+        } else if (strcmp(tok, "queue") == 0) {
+            if (parse_u16(val, UINT16_MAX, &rule->action_arg) != 0)
+                return -1;
+            rule->action = BFDEV_ACTION_QUEUE;
+            have_action++;
+        } else if (strcmp(tok, "mark") == 0) {
+            if (parse_u16(val, UINT16_MAX, &rule->action_arg) != 0)
+                return -1;
+            rule->action = BFDEV_ACTION_MARK;
+            have_action++;
+        } else if (strcmp(tok, "port") == 0) {
+            if (parse_u16(val, RTE_MAX_ETHPORTS - 1, &rule->action_arg) != 0)
+                return -1;
+            rule->action = BFDEV_ACTION_PORT;
+            have_action++;
+        } else if (strcmp(tok, "prio") == 0) {
+            unsigned long prio = strtoul(val, &end, 0);
+            if (end == val || *end != '\0' || prio > UINT16_MAX)
+                return -1;
+            rule->priority = prio;
+        } else if (strcmp(tok, "age") == 0) {
+            unsigned long age = strtoul(val, &end, 0);
+            if (end == val || *end != '\0' || age == 0 || age > BFDEV_FLOW_MAX_AGE)
+                return -1;
+            rule->age = age;
+        } else if (strcmp(tok, "in_port") == 0) {
+            if (parse_u16(val, RTE_MAX_ETHPORTS - 1, &rule->in_port) != 0)
+                return -1;
+            rule->match |= BFDEV_MATCH_IN_PORT;
+        } else if (strcmp(tok, "src_mac") == 0) {
+            if (rte_ether_unformat_addr(val, &rule->src_mac) != 0)
+                return -1;
+            rule->match |= BFDEV_MATCH_SRC_MAC;
+        } else if (strcmp(tok, "dst_mac") == 0) {
+            if (rte_ether_unformat_addr(val, &rule->dst_mac) != 0)
+                return -1;
+            rule->match |= BFDEV_MATCH_DST_MAC;
+        } else if (strcmp(tok, "vlan") == 0) {
+            if (parse_u16(val, RTE_VLAN_ID_MASK, &rule->vlan) != 0)
+                return -1;
+            rule->match |= BFDEV_MATCH_VLAN;
+        } else if (strcmp(tok, "src_ip") == 0) {
+            if (parse_ip_prefix(val, &rule->src_ip, &rule->src_ip_len) != 0)
+                return -1;
+            rule->match |= BFDEV_MATCH_SRC_IP;
+        } else if (strcmp(tok, "dst_ip") == 0) {
+            if (parse_ip_prefix(val, &rule->dst_ip, &rule->dst_ip_len) != 0)
+                return -1;
+            rule->match |= BFDEV_MATCH_DST_IP;
+        } else if (strcmp(tok, "proto") == 0) {
+            if (strcmp(val, "udp") == 0)
+                rule->proto = IPPROTO_UDP;
+            else if (strcmp(val, "tcp") == 0)
+                rule->proto = IPPROTO_TCP;
+            else
+                return -1;
+            rule->match |= BFDEV_MATCH_PROTO;
+        } else if (strcmp(tok, "src_port") == 0) {
+            if (parse_u16(val, UINT16_MAX, &rule->src_port) != 0)
+                return -1;
+            rule->match |= BFDEV_MATCH_SRC_PORT;
+        } else if (strcmp(tok, "dst_port") == 0) {
+            if (parse_u16(val, UINT16_MAX, &rule->dst_port) != 0)
+                return -1;
+            rule->match |= BFDEV_MATCH_DST_PORT;
+        } else {
+            return -1;
+        }
+    }
+
+    // exactly one action, and ports only make sense with a protocol
+    if (have_action != 1)
+        return -1;
+    if ((rule->match & (BFDEV_MATCH_SRC_PORT | BFDEV_MATCH_DST_PORT)) &&
+        !(rule->match & BFDEV_MATCH_PROTO))
+        return -1;
+    return 0;
+}
+
+int bfdev_rules_load(const char *path, struct bfdev_rule **rules, unsigned *nb_rules) {
+    FILE *f = fopen(path, "r");
+    char line[512];
+    unsigned n = 0, cap = 0, lineno = 0;
+    struct bfdev_rule *r = NULL;
+
+    if (f == NULL) {
+        printf("Cannot open rule file %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f) != NULL) {
+        struct bfdev_rule rule;
+        lineno++;
+        int ret = bfdev_rule_parse(line, &rule);
+        if (ret == 1)
+            continue;
+        if (ret < 0) {
+            printf("%s:%u: invalid rule\n", path, lineno);
+            goto fail;
+        }
+        if (n == cap) {
+            cap = cap ? 2 * cap : 1024;
+            struct bfdev_rule *grown = realloc(r, cap * sizeof(*r));
+            if (grown == NULL) {
+                printf("Out of memory loading %s\n", path);
+                goto fail;
+            }
+            r = grown;
+        }
+        r[n++] = rule;
+    }
+    fclose(f);
+    *rules = r;
+    *nb_rules = n;
+    return 0;
+
+fail:
+    fclose(f);
+    free(r);
+    return -1;
+}
+
+static int format_ip_prefix(char *buf, size_t len, const char *key, uint32_t ip,
+                            uint8_t prefix) {
+    struct in_addr addr = { .s_addr = htonl(ip) };
+    char str[INET_ADDRSTRLEN];
+
+    inet_ntop(AF_INET, &addr, str, sizeof(str));
+    if (prefix < 32)
+        return snprintf(buf, len, " %s=%s/%u", key, str, prefix);
+    return snprintf(buf, len, " %s=%s", key, str);
+}
+
+int bfdev_rule_format(const struct bfdev_rule *r, char *buf, size_t len) {
+    char mac[RTE_ETHER_ADDR_FMT_SIZE];
+    size_t n = snprintf(buf, len, "%u", r->id);
+
+#define APPEND(...) \
+    do { if (n < len) n += snprintf(buf + n, len - n, __VA_ARGS__); } while (0)
+    if (r->match & BFDEV_MATCH_IN_PORT)
+        APPEND(" in_port=%u", r->in_port);
+    if (r->match & BFDEV_MATCH_SRC_MAC) {
+        rte_ether_format_addr(mac, sizeof(mac), &r->src_mac);
+        APPEND(" src_mac=%s", mac);
+    }
+    if (r->match & BFDEV_MATCH_DST_MAC) {
+        rte_ether_format_addr(mac, sizeof(mac), &r->dst_mac);
+        APPEND(" dst_mac=%s", mac);
+    }
+    if (r->match & BFDEV_MATCH_VLAN)
+        APPEND(" vlan=%u", r->vlan);
+    if (r->match & BFDEV_MATCH_SRC_IP && n < len)
+        n += format_ip_prefix(buf + n, len - n, "src_ip", r->src_ip, r->src_ip_len);
+    if (r->match & BFDEV_MATCH_DST_IP && n < len)
+        n += format_ip_prefix(buf + n, len - n, "dst_ip", r->dst_ip, r->dst_ip_len);
+    if (r->match & BFDEV_MATCH_PROTO)
+        APPEND(" proto=%s", r->proto == IPPROTO_TCP ? "tcp" : "udp");
+    if (r->match & BFDEV_MATCH_SRC_PORT)
+        APPEND(" src_port=%u", r->src_port);
+    if (r->match & BFDEV_MATCH_DST_PORT)
+        APPEND(" dst_port=%u", r->dst_port);
+    if (r->priority != 0)
+        APPEND(" prio=%u", r->priority);
+    if (r->age != 0)
+        APPEND(" age=%u", r->age);
+    switch (r->action) {
+    case BFDEV_ACTION_QUEUE:
+        APPEND(" queue=%u", r->action_arg);
+        break;
+    case BFDEV_ACTION_PORT:
+        APPEND(" port=%u", r->action_arg);
+        break;
+    case BFDEV_ACTION_PUNT:
+        APPEND(" punt");
+        break;
+    case BFDEV_ACTION_MARK:
+        APPEND(" mark=%u", r->action_arg);
+        break;
+    case BFDEV_ACTION_PASS:
+        APPEND(" pass");
+        break;
+    default:
+        APPEND(" drop");
+        break;
+    }
+#undef APPEND
+    return n;
+}
+
+int bfdev_rule_equal(const struct bfdev_rule *a, const struct bfdev_rule *b) {
+    const unsigned m = a->match;
+
+    if (a->id != b->id || m != b->match || a->action != b->action ||
+        a->priority != b->priority || a->age != b->age)
+        return 0;
+    if ((a->action == BFDEV_ACTION_QUEUE || a->action == BFDEV_ACTION_PORT ||
+         a->action == BFDEV_ACTION_MARK) &&
+        a->action_arg != b->action_arg)
+        return 0;
+    if ((m & BFDEV_MATCH_SRC_MAC) && !rte_is_same_ether_addr(&a->src_mac, &b->src_mac))
+        return 0;
+    if ((m & BFDEV_MATCH_DST_MAC) && !rte_is_same_ether_addr(&a->dst_mac, &b->dst_mac))
+        return 0;
+    if ((m & BFDEV_MATCH_VLAN) && a->vlan != b->vlan)
+        return 0;
+    if ((m & BFDEV_MATCH_SRC_IP) &&
+        (a->src_ip != b->src_ip || a->src_ip_len != b->src_ip_len))
+        return 0;
+    if ((m & BFDEV_MATCH_DST_IP) &&
+        (a->dst_ip != b->dst_ip || a->dst_ip_len != b->dst_ip_len))
+        return 0;
+    if ((m & BFDEV_MATCH_PROTO) && a->proto != b->proto)
+        return 0;
+    if ((m & BFDEV_MATCH_SRC_PORT) && a->src_port != b->src_port)
+        return 0;
+    if ((m & BFDEV_MATCH_DST_PORT) && a->dst_port != b->dst_port)
+        return 0;
+    if ((m & BFDEV_MATCH_IN_PORT) && a->in_port != b->in_port)
+        return 0;
+    return 1;
+}
+
+/***  rte_flow patterns and actions of a rule ***/
+
+// Storage for the items of one rule. With spec == 0 only the masks are
+// filled, which is what a pattern template needs.
+struct pattern_buf {
+    struct rte_flow_item items[6];
+    struct rte_flow_item_ethdev in_spec, in_mask;
+    struct rte_flow_item_eth eth_spec, eth_mask;
+    struct rte_flow_item_vlan vlan_spec, vlan_mask;
+    struct rte_flow_item_ipv4 ip_spec, ip_mask;
+    struct rte_flow_item_udp udp_spec, udp_mask;
+    struct rte_flow_item_tcp tcp_spec, tcp_mask;
+};
+
+static uint32_t prefix_mask(uint8_t len) {
+    return len == 0 ? 0 : UINT32_MAX << (32 - len);
+}
+
+static void build_pattern(const struct bfdev_rule *r, struct pattern_buf *pb, int spec) {
+    const unsigned m = r->match;
+    int n = 0;
+
+    memset(pb, 0, sizeof(*pb));
+
+    if (m & BFDEV_MATCH_IN_PORT) {
+        pb->in_spec.port_id = r->in_port;
+        pb->in_mask.port_id = UINT16_MAX;
+        pb->items[n].type = RTE_FLOW_ITEM_TYPE_REPRESENTED_PORT;
+        pb->items[n].spec = spec ? &pb->in_spec : NULL;
+        pb->items[n].mask = &pb->in_mask;
+        n++;
+    }
+
+    pb->items[n].type = RTE_FLOW_ITEM_TYPE_ETH;
+    if (m & (BFDEV_MATCH_SRC_MAC | BFDEV_MATCH_DST_MAC)) {
+        if (m & BFDEV_MATCH_SRC_MAC) {
+            memset(&pb->eth_mask.src, 0xFF, RTE_ETHER_ADDR_LEN);
+            pb->eth_spec.src = r->src_mac;
+        }
+        if (m & BFDEV_MATCH_DST_MAC) {
+            memset(&pb->eth_mask.dst, 0xFF, RTE_ETHER_ADDR_LEN);
+            pb->eth_spec.dst = r->dst_mac;
+        }
+        pb->items[n].spec = spec ? &pb->eth_spec : NULL;
+        pb->items[n].mask = &pb->eth_mask;
+    }
+    n++;
+
+    if (m & BFDEV_MATCH_VLAN) {
+        pb->vlan_spec.tci = rte_cpu_to_be_16(r->vlan);
+        pb->vlan_mask.tci = rte_cpu_to_be_16(RTE_VLAN_ID_MASK);
+        pb->items[n].type = RTE_FLOW_ITEM_TYPE_VLAN;
+        pb->items[n].spec = spec ? &pb->vlan_spec : NULL;
+        pb->items[n].mask = &pb->vlan_mask;
+        n++;
+    }
+
+    if (m & (BFDEV_MATCH_SRC_IP | BFDEV_MATCH_DST_IP | BFDEV_MATCH_PROTO)) {
+        if (m & BFDEV_MATCH_SRC_IP) {
+            pb->ip_spec.hdr.src_addr = rte_cpu_to_be_32(r->src_ip);
+            pb->ip_mask.hdr.src_addr = rte_cpu_to_be_32(prefix_mask(r->src_ip_len));
+        }
+        if (m & BFDEV_MATCH_DST_IP) {
+            pb->ip_spec.hdr.dst_addr = rte_cpu_to_be_32(r->dst_ip);
+            pb->ip_mask.hdr.dst_addr = rte_cpu_to_be_32(prefix_mask(r->dst_ip_len));
+        }
+        if (m & BFDEV_MATCH_PROTO) {
+            pb->ip_spec.hdr.next_proto_id = r->proto;
+            pb->ip_mask.hdr.next_proto_id = 0xFF;
+        }
+        pb->items[n].type = RTE_FLOW_ITEM_TYPE_IPV4;
+        pb->items[n].spec = spec ? &pb->ip_spec : NULL;
+        pb->items[n].mask = &pb->ip_mask;
+        n++;
+    }
+
+    if (m & (BFDEV_MATCH_SRC_PORT | BFDEV_MATCH_DST_PORT)) {
+        rte_be16_t src_mask = (m & BFDEV_MATCH_SRC_PORT) ? 0xFFFF : 0;
+        rte_be16_t dst_mask = (m & BFDEV_MATCH_DST_PORT) ? 0xFFFF : 0;
+        if (r->proto == IPPROTO_UDP) {
+            pb->udp_spec.hdr.src_port = rte_cpu_to_be_16(r->src_port);
+            pb->udp_spec.hdr.dst_port = rte_cpu_to_be_16(r->dst_port);
+            pb->udp_mask.hdr.src_port = src_mask;
+            pb->udp_mask.hdr.dst_port = dst_mask;
+            pb->items[n].type = RTE_FLOW_ITEM_TYPE_UDP;
+            pb->items[n].spec = spec ? &pb->udp_spec : NULL;
+            pb->items[n].mask = &pb->udp_mask;
+        } else {
+            pb->tcp_spec.hdr.src_port = rte_cpu_to_be_16(r->src_port);
+            pb->tcp_spec.hdr.dst_port = rte_cpu_to_be_16(r->dst_port);
+            pb->tcp_mask.hdr.src_port = src_mask;
+            pb->tcp_mask.hdr.dst_port = dst_mask;
+            pb->items[n].type = RTE_FLOW_ITEM_TYPE_TCP;
+            pb->items[n].spec = spec ? &pb->tcp_spec : NULL;
+            pb->items[n].mask = &pb->tcp_mask;
+        }
+        n++;
+    }
+
+    pb->items[n].type = RTE_FLOW_ITEM_TYPE_END;
+}
+
+// Storage for the actions of one rule: COUNT when count is set, AGE when
+// the rule has an age, then the fate action. With conf == 0 the per-rule
+// configurations are left NULL, which makes an actions template take them
+// from each rule.
+struct actions_buf {
+    struct rte_flow_action actions[4];
+    struct rte_flow_action_age age;
+    struct rte_flow_action_queue queue;
+    struct rte_flow_action_ethdev port;
+    struct rte_flow_action_mark mark;
+};
+
+static void build_actions(const struct bfdev_rule *r, int count, struct actions_buf *ab,
+                          int conf) {
+    int n = 0;
+
+    memset(ab, 0, sizeof(*ab));
+    if (count)
+        ab->actions[n++].type = RTE_FLOW_ACTION_TYPE_COUNT;
+    if (r->age != 0) {
+        // the context is how bfdev_flow_aged() finds the rule back
+        ab->age.timeout = r->age;
+        ab->age.context = (void *)(uintptr_t)r->id;
+        ab->actions[n].type = RTE_FLOW_ACTION_TYPE_AGE;
+        ab->actions[n++].conf = conf ? &ab->age : NULL;
+    }
+    switch (r->action) {
+    case BFDEV_ACTION_QUEUE:
+        ab->queue.index = r->action_arg;
+        ab->actions[n].type = RTE_FLOW_ACTION_TYPE_QUEUE;
+        ab->actions[n].conf = conf ? &ab->queue : NULL;
+        break;
+    case BFDEV_ACTION_PORT:
+        ab->port.port_id = r->action_arg;
+        ab->actions[n].type = RTE_FLOW_ACTION_TYPE_REPRESENTED_PORT;
+        ab->actions[n].conf = conf ? &ab->port : NULL;
+        break;
+    case BFDEV_ACTION_PUNT:
+        ab->port.port_id = r->in_port;
+        ab->actions[n].type = RTE_FLOW_ACTION_TYPE_PORT_REPRESENTOR;
+        ab->actions[n].conf = conf ? &ab->port : NULL;
+        break;
+    case BFDEV_ACTION_MARK:
+        ab->mark.id = r->action_arg;
+        ab->actions[n].type = RTE_FLOW_ACTION_TYPE_MARK;
+        ab->actions[n].conf = conf ? &ab->mark : NULL;
+        break;
+    case BFDEV_ACTION_PASS:
+        ab->actions[n].type = RTE_FLOW_ACTION_TYPE_PASSTHRU;
+        break;
+    default:
+        ab->actions[n].type = RTE_FLOW_ACTION_TYPE_DROP;
+        break;
+    }
+    ab->actions[n + 1].type = RTE_FLOW_ACTION_TYPE_END;
+}
+
+/***  Template tables ***/
+
+// Rules with the same shape (matched fields, prefix lengths, protocol,
+// action type and priority) share a pattern template, an actions template
+// and a table
+struct flow_shape {
+    unsigned match;
+    uint32_t priority;
+    int aging;
+    uint8_t src_ip_len;
+    uint8_t dst_ip_len;
+    uint8_t proto;
+    enum bfdev_action action;
+    struct bfdev_flow_attr attr;
+    struct rte_flow_pattern_template *pattern;
+    struct rte_flow_actions_template *actions;
+    struct rte_flow_template_table *table;
+};
+
+static struct flow_shape shapes[RTE_MAX_ETHPORTS][MAX_SHAPES];
+static unsigned nb_shapes[RTE_MAX_ETHPORTS];
+
+static int shape_matches(const struct flow_shape *s, const struct bfdev_rule *r,
+                         const struct bfdev_flow_attr *attr) {
+    return s->match == r->match && s->action == r->action && s->priority == r->priority &&
+           s->aging == (r->age != 0) &&
+           s->src_ip_len == r->src_ip_len && s->dst_ip_len == r->dst_ip_len &&
+           s->proto == r->proto && memcmp(&s->attr, attr, sizeof(*attr)) == 0;
+}
+
+// Find the template table of the rule's shape, creating it on first use.
+// capacity is the number of rules the table is created for.
+static struct flow_shape *get_shape(uint16_t port, const struct bfdev_flow_attr *attr,
+                                    const struct bfdev_rule *r, unsigned capacity) {
+    struct rte_flow_error err;
+    struct pattern_buf pb;
+    struct actions_buf ab, ab_mask;
+    struct flow_shape *s;
+
+    for (unsigned i = 0; i < nb_shapes[port]; i++) {
+        if (shape_matches(&shapes[port][i], r, attr))
+            return &shapes[port][i];
+    }
+    if (nb_shapes[port] == MAX_SHAPES)
+        return NULL;
+
+    s = &shapes[port][nb_shapes[port]];
+    memset(s, 0, sizeof(*s));
+    s->match = r->match;
+    s->priority = r->priority;
+    s->aging = r->age != 0;
+    s->src_ip_len = r->src_ip_len;
+    s->dst_ip_len = r->dst_ip_len;
+    s->proto = r->proto;
+    s->action = r->action;
+    s->attr = *attr;
+
+    struct rte_flow_pattern_template_attr pt_attr = {
+        .relaxed_matching = 0,
+        .ingress = !attr->transfer,
+        .transfer = !!attr->transfer,
+    };
+    build_pattern(r, &pb, 0);
+    s->pattern = rte_flow_pattern_template_create(port, &pt_attr, pb.items, &err);
+    if (s->pattern == NULL)
+        goto fail;
+
+    struct rte_flow_actions_template_attr at_attr = {
+        .ingress = !attr->transfer,
+        .transfer = !!attr->transfer,
+    };
+    build_actions(r, attr->count, &ab, 0);
+    build_actions(r, attr->count, &ab_mask, 0);
+    s->actions = rte_flow_actions_template_create(port, &at_attr, ab.actions,
+                                                  ab_mask.actions, &err);
+    if (s->actions == NULL)
+        goto fail;
+
+    struct rte_flow_template_table_attr table_attr = {
+        .flow_attr = {
+            .group = attr->group,
+            .priority = attr->priority + r->priority,
+            .ingress = !attr->transfer,
+            .transfer = !!attr->transfer,
+        },
+        .nb_flows = RTE_MAX(rte_align32pow2(capacity), FLOW_TABLE_MIN_RULES),
+    };
+    s->table = rte_flow_template_table_create(port, &table_attr, &s->pattern, 1,
+                                              &s->actions, 1, &err);
+    if (s->table == NULL)
+        goto fail;
+
+    nb_shapes[port]++;
+    return s;
+
+fail:
+    printf("Port %u: cannot create flow template: %s\n", port,
+           err.message ? err.message : "(no message)");
+    if (s->actions != NULL)
+        rte_flow_actions_template_destroy(port, s->actions, &err);
+    if (s->pattern != NULL)
+        rte_flow_pattern_template_destroy(port, s->pattern, &err);
+    return NULL;
+}
+
+/***  Installation ***/
+
+int bfdev_flow_configure(uint16_t port, uint16_t nb_queues, uint32_t queue_size,
+                         uint32_t nb_counters) {
+    struct rte_flow_port_info port_info;
+    struct rte_flow_queue_info queue_info;
+    struct rte_flow_error err;
+    int ret;
+
+    memset(&port_info, 0, sizeof(port_info));
+    memset(&queue_info, 0, sizeof(queue_info));
+    ret = rte_flow_info_get(port, &port_info, &queue_info, &err);
+    if (ret != 0 || port_info.max_nb_queues == 0) {
+        printf("Port %u: no async flow API, rules will use rte_flow_create\n", port);
+        return -ENOTSUP;
+    }
+
+    if (nb_queues > port_info.max_nb_queues || nb_queues > BFDEV_MAX_QUEUES) {
+        printf("Port %u supports at most %u async flow queues, %u requested\n",
+               port, RTE_MIN(port_info.max_nb_queues, BFDEV_MAX_QUEUES), nb_queues);
+        return -EINVAL;
+    }
+    struct rte_flow_port_attr port_attr;
+    memset(&port_attr, 0, sizeof(port_attr));
+    // template rules can only count with counters reserved up front
+    port_attr.nb_counters = port_info.max_nb_counters ?
+        RTE_MIN(nb_counters, port_info.max_nb_counters) : nb_counters;
+    port_attr.nb_aging_objects = nb_counters;
+    struct rte_flow_queue_attr queue_attr = {
+        .size = queue_info.max_size ? RTE_MIN(queue_size, queue_info.max_size) : queue_size,
+    };
+    const struct rte_flow_queue_attr *queue_attrs[BFDEV_MAX_QUEUES];
+    for (uint16_t q = 0; q < nb_queues; q++)
+        queue_attrs[q] = &queue_attr;
+
+    ret = rte_flow_configure(port, &port_attr, nb_queues, queue_attrs, &err);
+    if (ret != 0) {
+        printf("Port %u: rte_flow_configure failed (%s), rules will use rte_flow_create\n",
+               port, err.message ? err.message : strerror(-ret));
+        return ret;
+    }
+    printf("Port %u: %u async flow queue(s) of %u entries, %u counters\n", port, nb_queues,
+           queue_attr.size, port_attr.nb_counters);
+    return queue_attr.size;
+}
+
+static void install_sync(uint16_t port, const struct bfdev_flow_attr *attr,
+                         const struct bfdev_rule *rules, unsigned nb_rules,
+                         struct rte_flow **handles, struct bfdev_flow_stats *stats) {
+    struct rte_flow_attr fattr = {
+        .group = attr->group,
+        .ingress = !attr->transfer,
+        .transfer = !!attr->transfer,
+    };
+    struct rte_flow_error err;
+    struct pattern_buf pb;
+    struct actions_buf ab;
+
+    for (unsigned i = 0; i < nb_rules; i++) {
+        fattr.priority = attr->priority + rules[i].priority;
+        build_pattern(&rules[i], &pb, 1);
+        build_actions(&rules[i], attr->count, &ab, 1);
+        handles[i] = rte_flow_create(port, &fattr, pb.items, ab.actions, &err);
+        if (handles[i] == NULL) {
+            if (stats->failed++ == 0)
+                printf("Port %u: rule %u: %s\n", port, rules[i].id,
+                       err.message ? err.message : "(no message)");
+        }
+    }
+}
+
+// Pull completions of async operations on queue 0. When handles is set,
+// user_data is the index of a created rule and a failed creation clears its
+// handle. Returns the number of completions or a negative errno.
+static int pull_results(uint16_t port, struct rte_flow **handles,
+                        const struct bfdev_rule *rules, unsigned *failed) {
+    struct rte_flow_op_result res[BFDEV_FLOW_BATCH];
+    struct rte_flow_error err;
+    int n = rte_flow_pull(port, 0, res, BFDEV_FLOW_BATCH, &err);
+
+    for (int k = 0; k < n; k++) {
+        if (res[k].status == RTE_FLOW_OP_SUCCESS)
+            continue;
+        if (handles == NULL) {
+            (*failed)++;
+            continue;
+        }
+        unsigned i = (uintptr_t)res[k].user_data;
+        handles[i] = NULL;
+        if ((*failed)++ == 0)
+            printf("Port %u: rule %u failed in hardware\n", port, rules[i].id);
+    }
+    return n;
+}
+
+// Wait until at most limit operations are in flight, pushing the postponed
+// ones first: they cannot complete before. Returns 0, or the negative errno
+// of rte_flow_pull, after which the operations in flight are given up. Given
+// up destructions count as failed. Given up creations keep their handle and
+// count as installed: the handle is valid and destroying it works either way.
+static int wait_inflight(uint16_t port, struct rte_flow **handles,
+                         const struct bfdev_rule *rules, unsigned *failed,
+                         unsigned *inflight, unsigned *unpushed, unsigned limit) {
+    struct rte_flow_error err;
+
+    if (*inflight > limit && *unpushed > 0) {
+        rte_flow_push(port, 0, &err);
+        *unpushed = 0;
+    }
+    while (*inflight > limit) {
+        int n = pull_results(port, handles, rules, failed);
+        if (n < 0) {
+            printf("Port %u: cannot pull the flow operation results: %s\n", port,
+                   strerror(-n));
+            if (handles == NULL)
+                *failed += *inflight;
+            *inflight = 0;
+            return n;
+        }
+        *inflight -= n;
+    }
+    return 0;
+}
+
+static int install_async(uint16_t port, const struct bfdev_flow_attr *attr,
+                         const struct bfdev_rule *rules, unsigned nb_rules,
+                         unsigned capacity, struct rte_flow **handles,
+                         struct bfdev_flow_stats *stats) {
+    const uint32_t queue_size = bfdev_port_get(port)->flow_queue_size;
+    // keep room in the queue for the next batch
+    const unsigned limit = queue_size > BFDEV_FLOW_BATCH ? queue_size - BFDEV_FLOW_BATCH : 0;
+    const struct rte_flow_op_attr op_attr = { .postpone = 1 };
+    struct rte_flow_error err;
+    struct pattern_buf pb;
+    struct actions_buf ab;
+    unsigned inflight = 0, unpushed = 0;
+    unsigned shapes_before = nb_shapes[port];
+
+    for (unsigned i = 0; i < nb_rules; i++) {
+        struct flow_shape *s = get_shape(port, attr, &rules[i], capacity);
+        if (s == NULL) {
+            if (i == 0)
+                return -ENOTSUP;  // nothing queued yet, the caller falls back
+            handles[i] = NULL;
+            stats->failed++;
+            continue;
+        }
+        build_pattern(&rules[i], &pb, 1);
+        build_actions(&rules[i], attr->count, &ab, 1);
+        handles[i] = rte_flow_async_create(port, 0, &op_attr, s->table, pb.items, 0,
+                                           ab.actions, 0, (void *)(uintptr_t)i, &err);
+        if (handles[i] == NULL) {
+            if (stats->failed++ == 0)
+                printf("Port %u: rule %u: %s\n", port, rules[i].id,
+                       err.message ? err.message : "(no message)");
+            continue;
+        }
+        inflight++;
+        if (++unpushed == BFDEV_FLOW_BATCH) {
+            rte_flow_push(port, 0, &err);
+            unpushed = 0;
+        }
+        if (wait_inflight(port, handles, rules, &stats->failed, &inflight, &unpushed,
+                          limit) != 0) {
+            // the queue is broken, the rules not queued yet are not tried
+            for (unsigned j = i + 1; j < nb_rules; j++)
+                handles[j] = NULL;
+            stats->failed += nb_rules - i - 1;
+            break;
+        }
+    }
+
+    wait_inflight(port, handles, rules, &stats->failed, &inflight, &unpushed, 0);
+    stats->tables = nb_shapes[port] - shapes_before;
+    return 0;
+}
+
+int bfdev_flow_install(uint16_t port, const struct bfdev_flow_attr *attr,
+                       const struct bfdev_rule *rules, unsigned nb_rules,
+                       unsigned capacity, struct rte_flow **handles,
+                       struct bfdev_flow_stats *stats) {
+    const struct bfdev_port *p = bfdev_port_get(port);
+    uint64_t start = rte_rdtsc();
+
+    memset(stats, 0, sizeof(*stats));
+    if (p == NULL)
+        return -ENODEV;
+
+    stats->async = p->flow_queues > 0;
+    if (stats->async && install_async(port, attr, rules, nb_rules, RTE_MAX(capacity, nb_rules),
+                                        handles, stats) != 0) {
+        printf("Port %u: templates not supported for these rules, using rte_flow_create\n",
+               port);
+        stats->async = 0;
+    }
+    if (!stats->async)
+        install_sync(port, attr, rules, nb_rules, handles, stats);
+    stats->installed = nb_rules - stats->failed;
+
+    stats->seconds = (double)(rte_rdtsc() - start) / rte_get_tsc_hz();
+    return stats->failed == 0 ? 0 : -EIO;
+}
+
+int bfdev_flow_destroy(uint16_t port, struct rte_flow **flows, unsigned nb_flows, int async) {
+    const struct bfdev_port *p = bfdev_port_get(port);
+    const struct rte_flow_op_attr op_attr = { .postpone = 1 };
+    struct rte_flow_error err;
+    unsigned failed = 0, inflight = 0, unpushed = 0, limit;
+
+    if (p == NULL)
+        return -ENODEV;
+    if (async && p->flow_queues == 0)
+        return -EINVAL;
+    limit = p->flow_queue_size > BFDEV_FLOW_BATCH ? p->flow_queue_size - BFDEV_FLOW_BATCH : 0;
+
+    for (unsigned i = 0; i < nb_flows; i++) {
+        if (flows[i] == NULL)
+            continue;
+        if (!async) {
+            if (rte_flow_destroy(port, flows[i], &err) != 0)
+                failed++;
+            continue;
+        }
+        if (rte_flow_async_destroy(port, 0, &op_attr, flows[i], NULL, &err) != 0) {
+            failed++;
+            continue;
+        }
+        inflight++;
+        if (++unpushed == BFDEV_FLOW_BATCH) {
+            rte_flow_push(port, 0, &err);
+            unpushed = 0;
+        }
+        if (wait_inflight(port, NULL, NULL, &failed, &inflight, &unpushed, limit) != 0) {
+            // the flows left are not tried
+            for (unsigned j = i + 1; j < nb_flows; j++)
+                failed += flows[j] != NULL;
+            break;
+        }
+    }
+    if (async)
+        wait_inflight(port, NULL, NULL, &failed, &inflight, &unpushed, 0);
+    if (failed > 0)
+        printf("Port %u: %u flow(s) could not be destroyed\n", port, failed);
+    return failed == 0 ? 0 : -EIO;
+}
+
+void bfdev_flow_release(uint16_t port) {
+    struct rte_flow_error err;
+
+    for (unsigned i = 0; i < nb_shapes[port]; i++) {
+        struct flow_shape *s = &shapes[port][i];
+        rte_flow_template_table_destroy(port, s->table, &err);
+        rte_flow_actions_template_destroy(port, s->actions, &err);
+        rte_flow_pattern_template_destroy(port, s->pattern, &err);
+    }
+    nb_shapes[port] = 0;
+}
+
+int bfdev_flow_query_count(uint16_t port, struct rte_flow *flow, uint64_t *hits,
+                           uint64_t *bytes) {
+    static const struct rte_flow_action count_action = {
+        .type = RTE_FLOW_ACTION_TYPE_COUNT,
+    };
+    struct rte_flow_query_count qc;
+    struct rte_flow_error err;
+    int ret;
+
+    memset(&qc, 0, sizeof(qc));
+    ret = rte_flow_query(port, flow, &count_action, &qc, &err);
+    if (ret != 0)
+        return ret;
+    *hits = qc.hits_set ? qc.hits : 0;
+    *bytes = qc.bytes_set ? qc.bytes : 0;
+    return 0;
+}
+
+int bfdev_flow_aged(uint16_t port, uint32_t *ids, unsigned max) {
+    void *contexts[BFDEV_FLOW_BATCH];
+    struct rte_flow_error err;
+    unsigned n = 0;
+
+    while (n < max) {
+        int ret = rte_flow_get_aged_flows(port, contexts,
+                                          RTE_MIN(max - n, (unsigned)BFDEV_FLOW_BATCH), &err);
+        if (ret < 0)
+            return n > 0 ? (int)n : ret;
+        for (int i = 0; i < ret; i++)
+            ids[n++] = (uintptr_t)contexts[i];
+        if (ret < BFDEV_FLOW_BATCH)
+            break;
+    }
+    return n;
+}
@@ -0,0 +1,136 @@
+// libbfdev flow helpers: rule files and bulk rte_flow rule installation,
+// with the async template API when the port supports it.
+#ifndef BFDEV_FLOW_H
+#define BFDEV_FLOW_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <rte_ether.h>
+#include <rte_flow.h>
+
+// Rules are installed in batches of this many operations per push
+#define BFDEV_FLOW_BATCH 64
+// Default depth of the async flow queue created by bfdev_port_init()
+#define BFDEV_FLOW_QUEUE_SIZE 1024
+// Largest rule age in seconds (the AGE action timeout has 24 bits)
+#define BFDEV_FLOW_MAX_AGE ((1u << 24) - 1)
+
+// Match fields of a rule
+#define BFDEV_MATCH_SRC_MAC  (1u << 0)
+#define BFDEV_MATCH_DST_MAC  (1u << 1)
+#define BFDEV_MATCH_VLAN     (1u << 2)
+#define BFDEV_MATCH_SRC_IP   (1u << 3)
+#define BFDEV_MATCH_DST_IP   (1u << 4)
+#define BFDEV_MATCH_PROTO    (1u << 5)
+#define BFDEV_MATCH_SRC_PORT (1u << 6)
+#define BFDEV_MATCH_DST_PORT (1u << 7)
+#define BFDEV_MATCH_IN_PORT  (1u << 8)  // eswitch port the packet came from (transfer rules only)
+
+enum bfdev_action {
+    BFDEV_ACTION_DROP = 0,
+    BFDEV_ACTION_QUEUE,   // to an rx queue of the port
+    BFDEV_ACTION_PORT,    // to another port of the eswitch (transfer rules only)
+    BFDEV_ACTION_PUNT,    // to the DPDK port of in_port (which the rule should match),
+                          // i.e. to software (transfer rules only)
+    BFDEV_ACTION_MARK,    // let the packet through with a mark (action_arg)
+    BFDEV_ACTION_PASS,    // let the packet through, to exempt it from later rules
+};
+
+// One rule of a rule file, e.g.
+//   1 dst_mac=a0:88:c2:ab:7e:a2 drop
+//   2 src_ip=10.1.0.0/16 proto=udp dst_port=4789 queue=3
+//   3 vlan=100 port=3
+//   4 in_port=2 proto=tcp dst_port=22 prio=1 punt
+struct bfdev_rule {
+    uint32_t id;
+    unsigned match;              // BFDEV_MATCH_* bits
+    struct rte_ether_addr src_mac;
+    struct rte_ether_addr dst_mac;
+    uint16_t vlan;
+    uint32_t src_ip;             // host order
+    uint32_t dst_ip;
+    uint8_t src_ip_len;          // prefix lengths
+    uint8_t dst_ip_len;
+    uint8_t proto;               // IPPROTO_UDP or IPPROTO_TCP
+    uint16_t src_port;
+    uint16_t dst_port;
+    uint16_t in_port;            // DPDK port id
+    enum bfdev_action action;
+    uint16_t action_arg;         // queue index, port id or mark
+    uint32_t priority;           // added to bfdev_flow_attr.priority, lower wins
+    uint32_t age;                // seconds without traffic before the flow is
+                                 // reported by bfdev_flow_aged(), 0 = never
+};
+
+// Attributes shared by all the rules of an install
+struct bfdev_flow_attr {
+    uint32_t group;
+    uint32_t priority;
+    int transfer;                // eswitch rules instead of ingress rules
+    int count;                   // add a COUNT action to every rule
+};
+
+// Result of bfdev_flow_install()
+struct bfdev_flow_stats {
+    unsigned installed;
+    unsigned failed;
+    unsigned tables;             // template tables created (async only)
+    int async;                   // the template API was used
+    double seconds;
+};
+
+// Parse one line of a rule file. Returns 0 for a rule, 1 for a blank or
+// comment line and -1 on error.
+int bfdev_rule_parse(const char *line, struct bfdev_rule *rule);
+
+// Write rule in rule file syntax, like snprintf
+int bfdev_rule_format(const struct bfdev_rule *rule, char *buf, size_t len);
+
+// Whether two rules have the same id, match and action
+int bfdev_rule_equal(const struct bfdev_rule *a, const struct bfdev_rule *b);
+
+// Load a rule file into a malloc'ed array. Returns 0 or -1 (error logged).
+int bfdev_rules_load(const char *path, struct bfdev_rule **rules, unsigned *nb_rules);
+
+// Configure nb_queues async flow queues of queue_size operations and
+// nb_counters flow counters and aging objects on a stopped port, called by
+// bfdev_port_init().
+// Returns the queue size granted or a negative errno when the port only
+// supports rte_flow_create.
+int bfdev_flow_configure(uint16_t port, uint16_t nb_queues, uint32_t queue_size,
+                         uint32_t nb_counters);
+
+// Install nb_rules rules on port. handles[i] gets the flow of rules[i], or
+// NULL if it failed. The async template API is used when the port was
+// started with flow queues (see bfdev_port_conf), one template table per
+// rule shape, otherwise rules are created one by one with rte_flow_create.
+// A template table is created by the first install that has a rule of its
+// shape, for max(capacity, nb_rules) rules, and never grows: rules of that
+// shape past its size fail in hardware. Callers that install rules a few at
+// a time pass the most rules they will ever have as capacity.
+// Returns 0 if every rule was installed.
+int bfdev_flow_install(uint16_t port, const struct bfdev_flow_attr *attr,
+                       const struct bfdev_rule *rules, unsigned nb_rules,
+                       unsigned capacity, struct rte_flow **handles,
+                       struct bfdev_flow_stats *stats);
+
+// Destroy flows created by bfdev_flow_install() (NULL entries are
+// skipped), in batches when async is set. async must match how the flows
+// were created (bfdev_flow_stats.async). Returns 0 if all were destroyed.
+int bfdev_flow_destroy(uint16_t port, struct rte_flow **flows, unsigned nb_flows, int async);
+
+// Read the COUNT action of a flow installed with bfdev_flow_attr.count.
+// Counters are cumulative. Returns 0 or a negative errno.
+int bfdev_flow_query_count(uint16_t port, struct rte_flow *flow, uint64_t *hits,
+                           uint64_t *bytes);
+
+// Ids of up to max rules installed with an age that saw no traffic for that
+// long. Each aged flow is reported once; it stays installed until destroyed.
+// Returns the number of ids or a negative errno.
+int bfdev_flow_aged(uint16_t port, uint32_t *ids, unsigned max);
+
+// Destroy the template tables of the port. Every flow of the port must have
+// been destroyed first.
+void bfdev_flow_release(uint16_t port);
+
+#endif
@@ -0,0 +1,455 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <ctype.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <rte_ethdev.h>
+#include <rte_lcore.h>
+#include <rte_telemetry.h>
+
+#include "bfdev_port.h"
+#include "bfdev_metrics.h"
+
+#define METRICS_MAX_SOURCES 8
+#define METRICS_NAME_LEN 96
+#define METRICS_HELP_LEN 160
+#define METRICS_LABELS_LEN 160
+#define METRICS_POLL_MS 200          // how soon the HTTP thread sees a stop
+#define METRICS_REQ_LEN 2048
+#define METRICS_RECV_TIMEOUT_S 2
+
+struct metric_family {
+    char name[METRICS_NAME_LEN];
+    char help[METRICS_HELP_LEN];
+    enum bfdev_metric_type type;
+    unsigned first;              // index of its first sample
+    unsigned nb;
+};
+
+struct metric_sample {
+    char labels[METRICS_LABELS_LEN];
+    uint64_t value;
+};
+
+struct bfdev_metrics {
+    struct metric_family *families;
+    unsigned nb_families;
+    unsigned max_families;
+    struct metric_sample *samples;
+    unsigned nb_samples;
+    unsigned max_samples;
+};
+
+static struct {
+    bfdev_metrics_fn fn;
+    void *arg;
+} sources[METRICS_MAX_SOURCES];
+static unsigned nb_sources;
+static uint64_t last_update_ms;
+
+// The last published snapshot. The lock is only taken by the main loop
+// that publishes and by the control threads that read; the forwarding
+// lcores never see it.
+static pthread_mutex_t published_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct bfdev_metrics *published;
+
+static int listen_fd = -1;
+static pthread_t http_thread;
+static volatile int http_stop;
+
+static const char *type_names[] = {"counter", "gauge"};
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void metrics_free(struct bfdev_metrics *m) {
+    if (m == NULL)
+        return;
+    free(m->families);
+    free(m->samples);
+    free(m);
+}
+
+void bfdev_metrics_family(struct bfdev_metrics *m, const char *name,
+                          enum bfdev_metric_type type, const char *help) {
+    if (m->nb_families == m->max_families) {
+        unsigned max = m->max_families ? 2 * m->max_families : 32;
+        struct metric_family *f = realloc(m->families, max * sizeof(*f));
+        if (f == NULL)
+            return;
+        m->families = f;
+        m->max_families = max;
+    }
+    struct metric_family *f = &m->families[m->nb_families++];
+    snprintf(f->name, sizeof(f->name), "%s", name);
+    snprintf(f->help, sizeof(f->help), "%s", help);
+    f->type = type;
+    f->first = m->nb_samples;
+    f->nb = 0;
+}
+
+void bfdev_metrics_add(struct bfdev_metrics *m, uint64_t value, const char *labels, ...) {
+    if (m->nb_families == 0)
+        return;
+    if (m->nb_samples == m->max_samples) {
+        unsigned max = m->max_samples ? 2 * m->max_samples : 256;
+        struct metric_sample *s = realloc(m->samples, max * sizeof(*s));
+        if (s == NULL)
+            return;
+        m->samples = s;
+        m->max_samples = max;
+    }
+    struct metric_sample *s = &m->samples[m->nb_samples++];
+    s->value = value;
+    s->labels[0] = '\0';
+    if (labels != NULL) {
+        va_list ap;
+        va_start(ap, labels);
+        vsnprintf(s->labels, sizeof(s->labels), labels, ap);
+        va_end(ap);
+    }
+    m->families[m->nb_families - 1].nb++;
+}
+
+int bfdev_metrics_register(bfdev_metrics_fn fn, void *arg) {
+    if (nb_sources == METRICS_MAX_SOURCES)
+        return -ENOSPC;
+    sources[nb_sources].fn = fn;
+    sources[nb_sources].arg = arg;
+    nb_sources++;
+    return 0;
+}
+
+void bfdev_metrics_update(int force) {
+    const uint64_t now = now_ms();
+
+    if (nb_sources == 0 || (!force && now - last_update_ms < BFDEV_METRICS_PERIOD_MS))
+        return;
+    last_update_ms = now;
+    struct bfdev_metrics *m = calloc(1, sizeof(*m));
+    if (m == NULL)
+        return;
+    for (unsigned i = 0; i < nb_sources; i++)
+        sources[i].fn(m, sources[i].arg);
+
+    pthread_mutex_lock(&published_lock);
+    struct bfdev_metrics *old = published;
+    published = m;
+    pthread_mutex_unlock(&published_lock);
+    metrics_free(old);
+}
+
+// Telemetry keys may only hold letters, digits, '_', '-' and '/': the
+// label values of a sample, joined by '/'
+static void telemetry_key(const char *labels, char *key, size_t len) {
+    size_t n = 0;
+    int in_value = 0;
+
+    for (const char *p = labels; *p != '\0' && n + 1 < len; p++) {
+        if (*p == '"') {
+            in_value = !in_value;
+            if (!in_value && p[1] == ',')
+                key[n++] = '/';
+            continue;
+        }
+        if (!in_value)
+            continue;
+        key[n++] = (isalnum((unsigned char)*p) || *p == '_' || *p == '-') ? *p : '_';
+    }
+    key[n] = '\0';
+}
+
+// The samples of a family as a dict of label values to value. Dicts hold
+// a limited number of entries, the samples past it are left out.
+static struct rte_tel_data *telemetry_family(const struct bfdev_metrics *m,
+                                             const struct metric_family *f) {
+    struct rte_tel_data *d = rte_tel_data_alloc();
+    char key[RTE_TEL_MAX_STRING_LEN];
+
+    if (d == NULL)
+        return NULL;
+    rte_tel_data_start_dict(d);
+    for (unsigned i = 0; i < f->nb; i++) {
+        const struct metric_sample *s = &m->samples[f->first + i];
+        telemetry_key(s->labels, key, sizeof(key));
+        rte_tel_data_add_dict_u64(d, key[0] ? key : "value", s->value);
+    }
+    return d;
+}
+
+// /bfdev/metrics: every family, or with a family name as parameter only
+// that one. A family with a single unlabeled sample is a plain value.
+static int telemetry_metrics(const char *cmd, const char *params, struct rte_tel_data *d) {
+    (void)cmd;
+    rte_tel_data_start_dict(d);
+    pthread_mutex_lock(&published_lock);
+    const struct bfdev_metrics *m = published;
+    for (unsigned i = 0; m != NULL && i < m->nb_families; i++) {
+        const struct metric_family *f = &m->families[i];
+        if (params != NULL && params[0] != '\0' && strcmp(params, f->name) != 0)
+            continue;
+        if (f->nb == 1 && m->samples[f->first].labels[0] == '\0') {
+            rte_tel_data_add_dict_u64(d, f->name, m->samples[f->first].value);
+            continue;
+        }
+        struct rte_tel_data *c = telemetry_family(m, f);
+        if (c != NULL && rte_tel_data_add_dict_container(d, f->name, c, 0) != 0)
+            rte_tel_data_free(c);
+    }
+    pthread_mutex_unlock(&published_lock);
+    return 0;
+}
+
+struct text_buf {
+    char *buf;
+    size_t len;
+    size_t size;
+};
+
+static void text_printf(struct text_buf *t, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+static void text_printf(struct text_buf *t, const char *fmt, ...) {
+    va_list ap;
+
+    for (;;) {
+        size_t room = t->size - t->len;
+        va_start(ap, fmt);
+        int n = vsnprintf(t->buf ? t->buf + t->len : NULL, t->buf ? room : 0, fmt, ap);
+        va_end(ap);
+        if (n < 0)
+            return;
+        if (t->buf != NULL && (size_t)n < room) {
+            t->len += n;
+            return;
+        }
+        size_t size = t->size ? 2 * t->size : 64 * 1024;
+        while (size < t->len + n + 1)
+            size *= 2;
+        char *b = realloc(t->buf, size);
+        if (b == NULL)
+            return;
+        t->buf = b;
+        t->size = size;
+    }
+}
+
+// The published snapshot in the Prometheus text format
+static void prometheus_render(struct text_buf *t) {
+    pthread_mutex_lock(&published_lock);
+    const struct bfdev_metrics *m = published;
+    for (unsigned i = 0; m != NULL && i < m->nb_families; i++) {
+        const struct metric_family *f = &m->families[i];
+        text_printf(t, "# HELP %s %s\n# TYPE %s %s\n", f->name, f->help, f->name,
+                    type_names[f->type]);
+        for (unsigned k = 0; k < f->nb; k++) {
+            const struct metric_sample *s = &m->samples[f->first + k];
+            if (s->labels[0] != '\0')
+                text_printf(t, "%s{%s} %" PRIu64 "\n", f->name, s->labels, s->value);
+            else
+                text_printf(t, "%s %" PRIu64 "\n", f->name, s->value);
+        }
+    }
+    pthread_mutex_unlock(&published_lock);
+}
+
+static void send_all(int fd, const char *p, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n <= 0)
+            return;
+        p += n;
+        len -= n;
+    }
+}
+
+// One request per connection: GET /metrics, anything else is a 404
+static void http_serve(int fd) {
+    char req[METRICS_REQ_LEN];
+    size_t len = 0;
+    char hdr[256];
+
+    while (len < sizeof(req) - 1) {
+        ssize_t n = recv(fd, req + len, sizeof(req) - 1 - len, 0);
+        if (n <= 0)
+            break;
+        len += n;
+        req[len] = '\0';
+        if (strstr(req, "\r\n\r\n") != NULL)
+            break;
+    }
+    req[len] = '\0';
+    if (strncmp(req, "GET /metrics", strlen("GET /metrics")) != 0 ||
+        (req[12] != ' ' && req[12] != '?')) {
+        static const char not_found[] = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n"
+                                        "Connection: close\r\n\r\n";
+        send_all(fd, not_found, strlen(not_found));
+        return;
+    }
+    struct text_buf body = {0};
+    prometheus_render(&body);
+    int n = snprintf(hdr, sizeof(hdr), "HTTP/1.1 200 OK\r\n"
+                     "Content-Type: text/plain; version=0.0.4\r\n"
+                     "Content-Length: %zu\r\nConnection: close\r\n\r\n", body.len);
+    send_all(fd, hdr, n);
+    send_all(fd, body.buf, body.len);
+    free(body.buf);
+}
+
+static void *http_loop(void *arg) {
+    (void)arg;
+    while (!http_stop) {
+        struct pollfd pfd = { .fd = listen_fd, .events = POLLIN };
+        if (poll(&pfd, 1, METRICS_POLL_MS) <= 0)
+            continue;
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0)
+            continue;
+        struct timeval tv = { .tv_sec = METRICS_RECV_TIMEOUT_S };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        http_serve(fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+// Listen on "[addr:]port". Returns the socket or a negative errno.
+static int http_listen(const char *listen_addr) {
+    struct sockaddr_in sa = { .sin_family = AF_INET };
+    const char *colon = strrchr(listen_addr, ':');
+    char addr[INET_ADDRSTRLEN] = "127.0.0.1";
+    char *end;
+    int one = 1;
+
+    if (colon != NULL)
+        snprintf(addr, sizeof(addr), "%.*s", (int)(colon - listen_addr), listen_addr);
+    unsigned long port = strtoul(colon ? colon + 1 : listen_addr, &end, 10);
+    if (*end != '\0' || port == 0 || port > 65535 || inet_pton(AF_INET, addr, &sa.sin_addr) != 1)
+        return -EINVAL;
+    sa.sin_port = htons(port);
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -errno;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) != 0 || listen(fd, 8) != 0) {
+        int ret = -errno;
+        close(fd);
+        return ret;
+    }
+    return fd;
+}
+
+int bfdev_metrics_init(const char *listen_addr) {
+    int ret = rte_telemetry_register_cmd("/bfdev/metrics", telemetry_metrics,
+                                         "Returns the bfdev metrics of the tool. "
+                                         "Parameters: none, or a metric name");
+    if (ret != 0)
+        printf("Cannot register the bfdev telemetry command: %s\n", strerror(-ret));
+    if (listen_addr == NULL)
+        return 0;
+
+    listen_fd = http_listen(listen_addr);
+    if (listen_fd < 0) {
+        ret = listen_fd;
+        printf("Cannot listen on %s: %s\n", listen_addr, strerror(-ret));
+        return ret;
+    }
+    // a plain thread, the HTTP server needs nothing from the EAL (and
+    // rte_ctrl_thread_create is gone since DPDK 23.11). It inherits the
+    // affinity of the main lcore, which mostly sleeps.
+    ret = pthread_create(&http_thread, NULL, http_loop, NULL);
+    if (ret != 0) {
+        close(listen_fd);
+        listen_fd = -1;
+        return -ret;
+    }
+    printf("Metrics on http://%s/metrics\n", listen_addr);
+    return 0;
+}
+
+void bfdev_metrics_stop(void) {
+    if (listen_fd >= 0) {
+        http_stop = 1;
+        pthread_join(http_thread, NULL);
+        close(listen_fd);
+        listen_fd = -1;
+    }
+    nb_sources = 0;
+    pthread_mutex_lock(&published_lock);
+    struct bfdev_metrics *old = published;
+    published = NULL;
+    pthread_mutex_unlock(&published_lock);
+    metrics_free(old);
+}
+
+// Basic counters of every port
+static const struct {
+    const char *name;
+    const char *help;
+    size_t offset;
+} port_counters[] = {
+    {"bfdev_port_rx_packets_total", "Packets received", offsetof(struct rte_eth_stats, ipackets)},
+    {"bfdev_port_tx_packets_total", "Packets sent", offsetof(struct rte_eth_stats, opackets)},
+    {"bfdev_port_rx_bytes_total", "Bytes received", offsetof(struct rte_eth_stats, ibytes)},
+    {"bfdev_port_tx_bytes_total", "Bytes sent", offsetof(struct rte_eth_stats, obytes)},
+    {"bfdev_port_rx_missed_total", "Packets dropped by the NIC, rx ring full (imissed)",
+     offsetof(struct rte_eth_stats, imissed)},
+    {"bfdev_port_rx_nombuf_total", "Rx mbuf allocation failures (rx_nombuf)",
+     offsetof(struct rte_eth_stats, rx_nombuf)},
+    {"bfdev_port_rx_errors_total", "Erroneous received packets", offsetof(struct rte_eth_stats, ierrors)},
+    {"bfdev_port_tx_errors_total", "Failed transmitted packets", offsetof(struct rte_eth_stats, oerrors)},
+};
+
+void bfdev_metrics_ports(struct bfdev_metrics *m, void *arg) {
+    struct rte_eth_stats stats[RTE_MAX_ETHPORTS];
+    uint16_t ports[RTE_MAX_ETHPORTS];
+    unsigned nb_ports = 0;
+    uint16_t port;
+    (void)arg;
+
+    RTE_ETH_FOREACH_DEV(port) {
+        if (bfdev_port_get(port) != NULL && rte_eth_stats_get(port, &stats[nb_ports]) == 0)
+            ports[nb_ports++] = port;
+    }
+    for (unsigned c = 0; c < RTE_DIM(port_counters); c++) {
+        bfdev_metrics_family(m, port_counters[c].name, BFDEV_METRIC_COUNTER, port_counters[c].help);
+        for (unsigned i = 0; i < nb_ports; i++)
+            bfdev_metrics_add(m, *(const uint64_t *)((const char *)&stats[i] + port_counters[c].offset),
+                              "port=\"%u\"", ports[i]);
+    }
+
+    bfdev_metrics_family(m, "bfdev_port_xstats_total", BFDEV_METRIC_COUNTER,
+                         "Extended stats of the port driver");
+    for (unsigned i = 0; i < nb_ports; i++) {
+        int n = rte_eth_xstats_get(ports[i], NULL, 0);
+        if (n <= 0)
+            continue;
+        struct rte_eth_xstat *xstats = malloc(n * sizeof(*xstats));
+        struct rte_eth_xstat_name *names = malloc(n * sizeof(*names));
+        if (xstats != NULL && names != NULL &&
+            rte_eth_xstats_get_names(ports[i], names, n) == n &&
+            rte_eth_xstats_get(ports[i], xstats, n) == n) {
+            for (int k = 0; k < n; k++)
+                bfdev_metrics_add(m, xstats[k].value, "port=\"%u\",name=\"%s\"", ports[i],
+                                  names[xstats[k].id].name);
+        }
+        free(xstats);
+        free(names);
+    }
+}
@@ -0,0 +1,53 @@
+// libbfdev metrics: the counters of a tool, collected on its main loop and
+// served to DPDK telemetry (/bfdev/metrics) and to a Prometheus scrape
+// endpoint, without ever touching the forwarding lcores.
+#ifndef BFDEV_METRICS_H
+#define BFDEV_METRICS_H
+
+#include <stdint.h>
+
+#define BFDEV_METRICS_PERIOD_MS 1000   // least time between two collections
+
+enum bfdev_metric_type {
+    BFDEV_METRIC_COUNTER = 0,
+    BFDEV_METRIC_GAUGE,
+};
+
+// A snapshot being collected
+struct bfdev_metrics;
+
+// A source adds its families and samples to m
+typedef void (*bfdev_metrics_fn)(struct bfdev_metrics *m, void *arg);
+
+// Register the /bfdev/metrics telemetry command and, when listen is not
+// NULL, serve GET /metrics over HTTP on "[addr:]port" (default address
+// 127.0.0.1) from a control thread. Returns 0 or a negative errno.
+int bfdev_metrics_init(const char *listen);
+
+// Add a source. Sources run in registration order. Returns 0 or -ENOSPC.
+int bfdev_metrics_register(bfdev_metrics_fn fn, void *arg);
+
+// Run the sources and publish what they collected, at most once per
+// BFDEV_METRICS_PERIOD_MS unless force is set. Call it from the thread that
+// owns what the sources read (the main loop of the tool): readers only ever
+// see the last published snapshot.
+void bfdev_metrics_update(int force);
+
+// Stop the HTTP endpoint and drop the snapshot. The sources are not called
+// after this returns.
+void bfdev_metrics_stop(void);
+
+// Start a family of samples, named in Prometheus style, e.g.
+// bfdev_port_rx_packets_total for a counter
+void bfdev_metrics_family(struct bfdev_metrics *m, const char *name,
+                          enum bfdev_metric_type type, const char *help);
+
+// Add a sample to the current family. labels is NULL or a printf format of
+// Prometheus labels, e.g. "port=\"%u\"".
+void bfdev_metrics_add(struct bfdev_metrics *m, uint64_t value, const char *labels, ...)
+    __attribute__((format(printf, 3, 4)));
+
+// Source of the stats and xstats of the ports set up with bfdev_port_init()
+void bfdev_metrics_ports(struct bfdev_metrics *m, void *arg);
+
+#endif
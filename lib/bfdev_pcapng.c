@@ -0,0 +1,228 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <rte_ethdev.h>
+#include <rte_mbuf.h>
+
+#include "bfdev_pcapng.h"
+
+// pcapng blocks (draft-ietf-opsawg-pcapng): a section header, one interface
+// description per port, then one enhanced packet block per packet. Blocks
+// and options are padded to 32 bits and written in host byte order, which
+// readers tell from the byte order magic.
+#define PCAPNG_SHB 0x0A0D0D0A
+#define PCAPNG_IDB 0x00000001
+#define PCAPNG_EPB 0x00000006
+#define PCAPNG_BYTE_ORDER_MAGIC 0x1A2B3C4D
+#define PCAPNG_LINKTYPE_ETHERNET 1
+#define PCAPNG_OPT_END 0
+#define PCAPNG_OPT_IF_NAME 2
+#define PCAPNG_OPT_IF_TSRESOL 9
+#define PCAPNG_TSRESOL_NS 9          // timestamps in units of 10^-9 s
+#define PCAPNG_MAX_IFACES 32
+
+struct pcapng_block {
+    uint32_t type;
+    uint32_t len;
+};
+
+struct pcapng_shb {
+    struct pcapng_block hdr;
+    uint32_t magic;
+    uint16_t major;
+    uint16_t minor;
+    int64_t section_len;     // -1: not given
+};
+
+struct pcapng_idb {
+    struct pcapng_block hdr;
+    uint16_t linktype;
+    uint16_t reserved;
+    uint32_t snaplen;
+};
+
+struct pcapng_epb {
+    struct pcapng_block hdr;
+    uint32_t iface;
+    uint32_t ts_high;
+    uint32_t ts_low;
+    uint32_t cap_len;
+    uint32_t orig_len;
+};
+
+struct pcapng_opt {
+    uint16_t code;
+    uint16_t len;
+};
+
+struct bfdev_pcapng {
+    int fd;
+    int err;                 // first write error, the writer drops everything after it
+    uint8_t *buf;
+    size_t size;
+    size_t len;
+    uint32_t nb_ifaces;
+    uint32_t snaplen[PCAPNG_MAX_IFACES];
+    uint64_t packets;
+    uint64_t bytes;
+};
+
+static inline size_t pad4(size_t len) {
+    return (len + 3) & ~(size_t)3;
+}
+
+static int write_all(int fd, const uint8_t *p, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int bfdev_pcapng_flush(struct bfdev_pcapng *w) {
+    if (w->err == 0 && w->len > 0)
+        w->err = write_all(w->fd, w->buf, w->len);
+    w->len = 0;
+    return w->err;
+}
+
+// Room for a block of len bytes at the end of the buffer, zeroed for the
+// padding, or NULL
+static void *reserve(struct bfdev_pcapng *w, size_t len) {
+    if (w->len + len > w->size && bfdev_pcapng_flush(w) != 0)
+        return NULL;
+    if (len > w->size)
+        return NULL;
+    void *p = w->buf + w->len;
+    memset(p, 0, len);
+    w->len += len;
+    w->bytes += len;
+    return p;
+}
+
+static uint8_t *put_opt(uint8_t *p, uint16_t code, const void *val, uint16_t len) {
+    struct pcapng_opt opt = { .code = code, .len = len };
+    memcpy(p, &opt, sizeof(opt));
+    memcpy(p + sizeof(opt), val, len);
+    return p + sizeof(opt) + pad4(len);
+}
+
+struct bfdev_pcapng *bfdev_pcapng_open(const char *path, size_t buf_size) {
+    struct bfdev_pcapng *w = calloc(1, sizeof(*w));
+
+    if (w == NULL)
+        return NULL;
+    w->size = buf_size ? buf_size : BFDEV_PCAPNG_BUF_SIZE;
+    w->buf = malloc(w->size);
+    w->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (w->buf == NULL || w->fd < 0) {
+        printf("Cannot open %s: %s\n", path, strerror(w->buf == NULL ? ENOMEM : errno));
+        if (w->fd >= 0)
+            close(w->fd);
+        free(w->buf);
+        free(w);
+        return NULL;
+    }
+
+    const uint32_t len = sizeof(struct pcapng_shb) + sizeof(uint32_t);
+    struct pcapng_shb *shb = reserve(w, len);
+    *shb = (struct pcapng_shb){
+        .hdr = { .type = PCAPNG_SHB, .len = len },
+        .magic = PCAPNG_BYTE_ORDER_MAGIC,
+        .major = 1, .minor = 0,
+        .section_len = -1,
+    };
+    memcpy((uint8_t *)shb + len - sizeof(uint32_t), &len, sizeof(len));
+    return w;
+}
+
+int bfdev_pcapng_close(struct bfdev_pcapng *w) {
+    if (w == NULL)
+        return 0;
+    int ret = bfdev_pcapng_flush(w);
+    if (close(w->fd) != 0 && ret == 0)
+        ret = -errno;
+    free(w->buf);
+    free(w);
+    return ret;
+}
+
+int bfdev_pcapng_add_interface(struct bfdev_pcapng *w, uint16_t port, uint32_t snaplen) {
+    char name[RTE_ETH_NAME_MAX_LEN];
+    const uint8_t tsresol = PCAPNG_TSRESOL_NS;
+
+    if (w->nb_ifaces == PCAPNG_MAX_IFACES)
+        return -ENOSPC;
+    if (rte_eth_dev_get_name_by_port(port, name) != 0)
+        snprintf(name, sizeof(name), "port%u", port);
+    const uint16_t name_len = strlen(name);
+    const uint32_t len = sizeof(struct pcapng_idb) +
+                         sizeof(struct pcapng_opt) + pad4(name_len) +
+                         sizeof(struct pcapng_opt) + pad4(sizeof(tsresol)) +
+                         sizeof(struct pcapng_opt) + sizeof(uint32_t);
+    struct pcapng_idb *idb = reserve(w, len);
+    if (idb == NULL)
+        return w->err ? w->err : -ENOBUFS;
+    *idb = (struct pcapng_idb){
+        .hdr = { .type = PCAPNG_IDB, .len = len },
+        .linktype = PCAPNG_LINKTYPE_ETHERNET,
+        .snaplen = snaplen,
+    };
+    uint8_t *p = (uint8_t *)(idb + 1);
+    p = put_opt(p, PCAPNG_OPT_IF_NAME, name, name_len);
+    p = put_opt(p, PCAPNG_OPT_IF_TSRESOL, &tsresol, sizeof(tsresol));
+    p = put_opt(p, PCAPNG_OPT_END, NULL, 0);
+    memcpy(p, &len, sizeof(len));
+    w->snaplen[w->nb_ifaces] = snaplen;
+    return w->nb_ifaces++;
+}
+
+int bfdev_pcapng_write(struct bfdev_pcapng *w, uint32_t iface, uint64_t ts_ns,
+                       const struct rte_mbuf *m) {
+    if (w->err != 0)
+        return w->err;
+    if (iface >= w->nb_ifaces)
+        return -EINVAL;
+    const uint32_t cap_len = RTE_MIN(m->pkt_len, w->snaplen[iface]);
+    const uint32_t len = sizeof(struct pcapng_epb) + pad4(cap_len) + sizeof(uint32_t);
+    struct pcapng_epb *epb = reserve(w, len);
+    if (epb == NULL)
+        return w->err ? w->err : -ENOBUFS;
+    *epb = (struct pcapng_epb){
+        .hdr = { .type = PCAPNG_EPB, .len = len },
+        .iface = iface,
+        .ts_high = ts_ns >> 32,
+        .ts_low = (uint32_t)ts_ns,
+        .cap_len = cap_len,
+        .orig_len = m->pkt_len,
+    };
+    uint8_t *p = (uint8_t *)(epb + 1);
+    uint32_t left = cap_len;
+    for (const struct rte_mbuf *seg = m; seg != NULL && left > 0; seg = seg->next) {
+        uint32_t n = RTE_MIN(left, (uint32_t)seg->data_len);
+        memcpy(p, rte_pktmbuf_mtod(seg, const void *), n);
+        p += n;
+        left -= n;
+    }
+    memcpy((uint8_t *)epb + len - sizeof(uint32_t), &len, sizeof(len));
+    w->packets++;
+    return 0;
+}
+
+uint64_t bfdev_pcapng_packets(const struct bfdev_pcapng *w) {
+    return w->packets;
+}
+
+uint64_t bfdev_pcapng_bytes(const struct bfdev_pcapng *w) {
+    return w->bytes;
+}
@@ -0,0 +1,41 @@
+// libbfdev pcapng writer: packets written from mbufs to a pcapng file
+// through a large buffer, so that the file sees few big writes.
+#ifndef BFDEV_PCAPNG_H
+#define BFDEV_PCAPNG_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <rte_mbuf.h>
+
+#define BFDEV_PCAPNG_BUF_SIZE (4u << 20)   // default buffer size
+#define BFDEV_PCAPNG_SNAPLEN 65535
+
+struct bfdev_pcapng;
+
+// Create (or truncate) path and write the section header. buf_size 0
+// takes BFDEV_PCAPNG_BUF_SIZE. Returns NULL (and logs why) on failure.
+struct bfdev_pcapng *bfdev_pcapng_open(const char *path, size_t buf_size);
+
+// Flush the buffer and close the file. Returns 0 or a negative errno of
+// the last write.
+int bfdev_pcapng_close(struct bfdev_pcapng *w);
+
+// Describe an Ethernet interface, named after the DPDK port. Packets refer
+// to interfaces by the ids this returns, from 0 up. Returns the id or a
+// negative errno.
+int bfdev_pcapng_add_interface(struct bfdev_pcapng *w, uint16_t port, uint32_t snaplen);
+
+// Write one packet, all segments of m up to the snaplen of its interface,
+// with a timestamp in ns since the epoch. The mbuf is only read. Returns 0
+// or a negative errno; after a write error the writer drops everything.
+int bfdev_pcapng_write(struct bfdev_pcapng *w, uint32_t iface, uint64_t ts_ns,
+                       const struct rte_mbuf *m);
+
+// Write the buffer to the file. Returns 0 or a negative errno.
+int bfdev_pcapng_flush(struct bfdev_pcapng *w);
+
+// Packets and bytes (of the file) written so far
+uint64_t bfdev_pcapng_packets(const struct bfdev_pcapng *w);
+uint64_t bfdev_pcapng_bytes(const struct bfdev_pcapng *w);
+
+#endif
@@ -0,0 +1,484 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <ifaddrs.h>
+#include <sys/socket.h>
+#include <linux/if_packet.h>
+#include <net/if.h>
+
+#include <rte_ethdev.h>
+#include <rte_dev.h>
+#include <rte_errno.h>
+#include <rte_lcore.h>
+#include <rte_mbuf.h>
+
+#include "bfdev_port.h"
+#include "bfdev_flow.h"
+
+// mbuf pool sizing. Mbufs from a port's pool can sit in:
+//  - the port's rx descriptors (refilled as soon as a packet is received)
+//  - the tx descriptors of the port they are sent on (until the NIC
+//    completes the send). The wire sends on a peer with the same conf, so
+//    the port's own tx ring size is used.
+//  - the per-lcore mempool caches
+//  - the burst arrays of the lcores that are in the middle of forwarding
+//  - whatever the caller holds on to besides (conf->extra_mbufs)
+// If the pool is smaller than the sum, rx refill fails under bursty load
+// and packets are dropped by the NIC (imissed / rx_nombuf).
+#define MBUF_CACHE_SIZE_MAX 256
+#define MBUF_POOL_HEADROOM 1024  // spare mbufs for tx retries and buffering
+
+static struct bfdev_port ports[RTE_MAX_ETHPORTS];
+
+void bfdev_port_conf_init(struct bfdev_port_conf *conf) {
+    memset(conf, 0, sizeof(*conf));
+    conf->nb_rxq = 1;
+    conf->nb_txq = 1;
+    conf->nb_rxd = BFDEV_RING_SIZE;
+    conf->nb_txd = BFDEV_RING_SIZE;
+    conf->offloads = BFDEV_OFFLOAD_FAST_FREE;
+    conf->promisc = 1;
+    conf->pool_policy = BFDEV_POOL_PER_PORT;
+    conf->flow_queue_size = BFDEV_FLOW_QUEUE_SIZE;
+}
+
+const struct bfdev_port *bfdev_port_get(uint16_t port) {
+    if (port >= RTE_MAX_ETHPORTS || !ports[port].initialized)
+        return NULL;
+    return &ports[port];
+}
+
+uint32_t bfdev_max_frame_len(uint16_t mtu) {
+    return (uint32_t)(mtu > 0 ? mtu : RTE_ETHER_MTU) + RTE_ETHER_HDR_LEN +
+           RTE_ETHER_CRC_LEN + 2 * RTE_VLAN_HLEN;
+}
+
+// The data room holds a full frame of the configured MTU so that rx
+// never needs to chain mbufs
+uint16_t bfdev_mbuf_data_room(uint16_t mtu) {
+    uint32_t room = RTE_PKTMBUF_HEADROOM + bfdev_max_frame_len(mtu);
+    if (room < RTE_MBUF_DEFAULT_BUF_SIZE)
+        return RTE_MBUF_DEFAULT_BUF_SIZE;
+    return RTE_MIN(room, (uint32_t)UINT16_MAX);
+}
+
+// the cache must stay well below the pool size (mempool requires
+// cache_size * 1.5 <= n), and large caches only hide mbufs
+static unsigned pool_cache_size(unsigned nb_mbufs) {
+    unsigned cache = RTE_MIN(MBUF_CACHE_SIZE_MAX, RTE_MEMPOOL_CACHE_MAX_SIZE);
+    return RTE_MIN(cache, nb_mbufs / 3 * 2);
+}
+
+struct rte_mempool *bfdev_pool_create(const char *name, unsigned nb_mbufs,
+                                      uint16_t mtu, int socket) {
+    uint16_t data_room = bfdev_mbuf_data_room(mtu);
+    struct rte_mempool *pool = rte_pktmbuf_pool_create(name, nb_mbufs,
+        pool_cache_size(nb_mbufs), 0, data_room, socket);
+    if (pool == NULL)
+        printf("Cannot create mbuf pool %s on socket %d (%u mbufs, ~%.1f MB): %s\n",
+               name, socket, nb_mbufs,
+               (double)nb_mbufs * (sizeof(struct rte_mbuf) + data_room) / (1 << 20),
+               rte_strerror(rte_errno));
+    return pool;
+}
+
+// Create the pool of a port, sized from the final descriptor counts and
+// placed on the NUMA node of the port so that the NIC DMAs locally
+static struct rte_mempool *port_pool_create(uint16_t port, const struct bfdev_port_conf *conf,
+                                            uint16_t nb_rxd, uint16_t nb_txd, int socket) {
+    unsigned nb_lcores = conf->pool_lcores ? conf->pool_lcores : rte_lcore_count();
+    unsigned cache_size = RTE_MIN(MBUF_CACHE_SIZE_MAX, RTE_MEMPOOL_CACHE_MAX_SIZE);
+    unsigned in_rings = (unsigned)conf->nb_rxq * nb_rxd + (unsigned)conf->nb_txq * nb_txd;
+    unsigned in_flight = nb_lcores * BFDEV_MAX_PKT_BURST;
+    unsigned n = in_rings + nb_lcores * cache_size + in_flight + conf->extra_mbufs +
+                 MBUF_POOL_HEADROOM;
+    // mempools built on rings are most memory efficient at 2^k - 1 objects
+    unsigned nb_mbufs = rte_align32pow2(n + 1) - 1;
+    uint16_t data_room = bfdev_mbuf_data_room(conf->mtu);
+
+    printf("Port %u mbuf pool: %u mbufs (rx %ux%u + tx %ux%u + cache %ux%u lcores"
+           " + bursts + %u extra + %u spare), cache %u, data room %u, socket %d, ~%.1f MB\n",
+           port, nb_mbufs, conf->nb_rxq, nb_rxd, conf->nb_txq, nb_txd,
+           cache_size, nb_lcores, conf->extra_mbufs, MBUF_POOL_HEADROOM, cache_size, data_room, socket,
+           (double)nb_mbufs * (sizeof(struct rte_mbuf) + data_room) / (1 << 20));
+
+    char name[RTE_MEMPOOL_NAMESIZE];
+    snprintf(name, sizeof(name), "MBUF_POOL_%u", port);
+    return bfdev_pool_create(name, nb_mbufs, conf->mtu, socket);
+}
+
+static const struct {
+    const char *name;
+    unsigned flag;
+} offload_names[] = {
+    {"fast_free", BFDEV_OFFLOAD_FAST_FREE},
+    {"rx_cksum", BFDEV_OFFLOAD_RX_CKSUM},
+    {"tx_cksum", BFDEV_OFFLOAD_TX_CKSUM},
+    {"vlan", BFDEV_OFFLOAD_VLAN},
+};
+
+int bfdev_parse_offloads(const char *str, unsigned *flags) {
+    char buf[128];
+    char *tok, *save;
+
+    snprintf(buf, sizeof(buf), "%s", str);
+    *flags = 0;
+    for (tok = strtok_r(buf, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save)) {
+        if (strcmp(tok, "none") == 0)
+            continue;
+        if (strcmp(tok, "all") == 0) {
+            *flags |= BFDEV_OFFLOAD_ALL;
+            continue;
+        }
+        unsigned i;
+        for (i = 0; i < RTE_DIM(offload_names); i++) {
+            if (strcmp(tok, offload_names[i].name) == 0) {
+                *flags |= offload_names[i].flag;
+                break;
+            }
+        }
+        if (i == RTE_DIM(offload_names))
+            return -1;
+    }
+    return 0;
+}
+
+static void print_offload_list(const char *what, uint64_t offloads,
+                               const char *(*name_fn)(uint64_t)) {
+    printf("  %s:", what);
+    if (offloads == 0)
+        printf(" none");
+    for (int bit = 0; bit < 64; bit++) {
+        if (offloads & (1ULL << bit))
+            printf(" %s", name_fn(1ULL << bit));
+    }
+    printf("\n");
+}
+
+// Fill port_conf rx/tx offloads from the requested profile and the device
+// capabilities, and log the result. RX scatter and multi-segment TX are only
+// turned on when a max_frame sized packet does not fit in one mbuf.
+static void negotiate_offloads(uint16_t port, const struct rte_eth_dev_info *dev_info,
+                               unsigned want, uint32_t max_frame, uint16_t data_room,
+                               struct rte_eth_conf *port_conf) {
+    uint64_t rx_want = 0, tx_want = 0;
+
+    if (want & BFDEV_OFFLOAD_FAST_FREE)
+        tx_want |= RTE_ETH_TX_OFFLOAD_MBUF_FAST_FREE;
+    if (want & BFDEV_OFFLOAD_RX_CKSUM)
+        rx_want |= RTE_ETH_RX_OFFLOAD_CHECKSUM;
+    if (want & BFDEV_OFFLOAD_TX_CKSUM)
+        tx_want |= RTE_ETH_TX_OFFLOAD_IPV4_CKSUM | RTE_ETH_TX_OFFLOAD_UDP_CKSUM |
+                   RTE_ETH_TX_OFFLOAD_TCP_CKSUM;
+    if (want & BFDEV_OFFLOAD_VLAN) {
+        rx_want |= RTE_ETH_RX_OFFLOAD_VLAN_STRIP;
+        tx_want |= RTE_ETH_TX_OFFLOAD_VLAN_INSERT;
+    }
+    if (max_frame > (uint32_t)data_room - RTE_PKTMBUF_HEADROOM) {
+        rx_want |= RTE_ETH_RX_OFFLOAD_SCATTER;
+        tx_want |= RTE_ETH_TX_OFFLOAD_MULTI_SEGS;
+    }
+
+    uint64_t rx_got = rx_want & dev_info->rx_offload_capa;
+    uint64_t tx_got = tx_want & dev_info->tx_offload_capa;
+    // a stripped tag must be put back on tx, otherwise packets change
+    if ((rx_got & RTE_ETH_RX_OFFLOAD_VLAN_STRIP) &&
+        !(tx_got & RTE_ETH_TX_OFFLOAD_VLAN_INSERT)) {
+        rx_got &= ~RTE_ETH_RX_OFFLOAD_VLAN_STRIP;
+        tx_got &= ~RTE_ETH_TX_OFFLOAD_VLAN_INSERT;
+    }
+    port_conf->rxmode.offloads = rx_got;
+    port_conf->txmode.offloads = tx_got;
+
+    printf("Port %u offloads:\n", port);
+    print_offload_list("rx", rx_got, rte_eth_dev_rx_offload_name);
+    print_offload_list("tx", tx_got, rte_eth_dev_tx_offload_name);
+    if (rx_want & ~rx_got)
+        print_offload_list("rx unsupported", rx_want & ~rx_got, rte_eth_dev_rx_offload_name);
+    if (tx_want & ~tx_got)
+        print_offload_list("tx unsupported", tx_want & ~tx_got, rte_eth_dev_tx_offload_name);
+    if ((rx_want & RTE_ETH_RX_OFFLOAD_SCATTER) && !(rx_got & RTE_ETH_RX_OFFLOAD_SCATTER))
+        printf("  warning: frames over %u bytes will be dropped\n",
+               data_room - RTE_PKTMBUF_HEADROOM);
+}
+
+int bfdev_port_init(uint16_t port, const struct bfdev_port_conf *conf) {
+    struct bfdev_port *p;
+    struct rte_mempool *mbuf_pool;
+    struct rte_eth_conf port_conf;
+    const uint16_t rx_rings = conf->nb_rxq, tx_rings = conf->nb_txq;
+    uint16_t nb_rxd = conf->nb_rxd;
+    uint16_t nb_txd = conf->nb_txd;
+    int retval;
+    uint16_t q;
+    struct rte_eth_dev_info dev_info;
+    struct rte_eth_rxconf rxconf;
+    struct rte_eth_txconf txconf;
+
+    if (!rte_eth_dev_is_valid_port(port))
+        return -ENODEV;
+    p = &ports[port];
+    if (p->initialized)
+        return -EALREADY;
+    if (rx_rings == 0 || tx_rings == 0 ||
+        (conf->pool_policy == BFDEV_POOL_SHARED && conf->pool == NULL))
+        return -EINVAL;
+
+    // set up the port configuration
+    memset(&port_conf, 0, sizeof(struct rte_eth_conf));
+
+    // get device info
+    retval = rte_eth_dev_info_get(port, &dev_info);
+    if (retval != 0) {
+        printf("Error during getting device (port %u) info: %s\n",
+                port, strerror(-retval));
+        return retval;
+    }
+
+    if (rx_rings > dev_info.max_rx_queues || tx_rings > dev_info.max_tx_queues) {
+        printf("Port %u supports at most %u rx / %u tx queues, %u/%u requested\n",
+                port, dev_info.max_rx_queues, dev_info.max_tx_queues, rx_rings, tx_rings);
+        return -EINVAL;
+    }
+
+    if (conf->mtu > 0) {
+        if (conf->mtu < dev_info.min_mtu || conf->mtu > dev_info.max_mtu) {
+            printf("Port %u supports MTU %u..%u, %u requested\n",
+                    port, dev_info.min_mtu, dev_info.max_mtu, conf->mtu);
+            return -EINVAL;
+        }
+        port_conf.rxmode.mtu = conf->mtu;
+    }
+
+    // spread flows over the rx queues with RSS, using only the hash
+    // fields that the device supports
+    if (rx_rings > 1) {
+        port_conf.rxmode.mq_mode = RTE_ETH_MQ_RX_RSS;
+        port_conf.rx_adv_conf.rss_conf.rss_key = NULL;
+        port_conf.rx_adv_conf.rss_conf.rss_hf =
+            BFDEV_RSS_HF & dev_info.flow_type_rss_offloads;
+        if (port_conf.rx_adv_conf.rss_conf.rss_hf == 0) {
+            printf("Port %u: RSS not supported, all flows will use queue 0\n", port);
+            port_conf.rxmode.mq_mode = RTE_ETH_MQ_RX_NONE;
+        }
+    }
+
+    // fast-free requires every mbuf sent on a tx queue to come from one
+    // pool with refcnt 1. The tools only send mbufs they own, from one pool.
+    negotiate_offloads(port, &dev_info, conf->offloads, bfdev_max_frame_len(conf->mtu),
+                       bfdev_mbuf_data_room(conf->mtu), &port_conf);
+
+    /* Configure the Ethernet device. */
+    port_conf.intr_conf.rxq = !!conf->rx_intr;
+    retval = rte_eth_dev_configure(port, rx_rings, tx_rings, &port_conf);
+    if (retval != 0 && conf->rx_intr) {
+        // not every PMD has rx interrupts, the caller can keep polling
+        printf("Port %u: no rx queue interrupts (%s)\n", port, strerror(-retval));
+        port_conf.intr_conf.rxq = 0;
+        retval = rte_eth_dev_configure(port, rx_rings, tx_rings, &port_conf);
+    }
+    if (retval != 0)
+        return retval;
+    p->rx_intr = port_conf.intr_conf.rxq;
+
+    retval = rte_eth_dev_adjust_nb_rx_tx_desc(port, &nb_rxd, &nb_txd);
+    if (retval != 0)
+        return retval;
+
+    int socket = rte_eth_dev_socket_id(port);
+    if (socket < 0)
+        socket = rte_socket_id();
+    if (conf->pool_policy == BFDEV_POOL_SHARED) {
+        mbuf_pool = conf->pool;
+    } else {
+        mbuf_pool = port_pool_create(port, conf, nb_rxd, nb_txd, socket);
+        if (mbuf_pool == NULL)
+            return -ENOMEM;
+    }
+
+    rxconf = dev_info.default_rxconf;
+    rxconf.offloads = port_conf.rxmode.offloads;
+    /* Allocate and set up the RX queues. */
+    for (q = 0; q < rx_rings; q++) {
+        retval = rte_eth_rx_queue_setup(port, q, nb_rxd,
+                socket, &rxconf, mbuf_pool);
+        if (retval < 0)
+            return retval;
+    }
+
+    txconf = dev_info.default_txconf;
+    txconf.offloads = port_conf.txmode.offloads;
+    /* Allocate and set up the TX queues. */
+    for (q = 0; q < tx_rings; q++) {
+        retval = rte_eth_tx_queue_setup(port, q, nb_txd,
+                socket, &txconf);
+        if (retval < 0)
+            return retval;
+    }
+
+    // the async flow queues can only be configured on a stopped port. If
+    // the device refuses them, rules are installed with rte_flow_create.
+    p->flow_queues = 0;
+    p->flow_queue_size = 0;
+    if (conf->flow_queues > 0) {
+        retval = bfdev_flow_configure(port, conf->flow_queues, conf->flow_queue_size,
+                                      conf->flow_counters);
+        if (retval > 0) {
+            p->flow_queues = conf->flow_queues;
+            p->flow_queue_size = retval;
+        }
+    }
+
+    /* Starting Ethernet port. 8< */
+    retval = rte_eth_dev_start(port);
+    /* >8 End of starting of ethernet port. */
+    if (retval < 0)
+        return retval;
+
+    /* Display the port MAC address. */
+    struct rte_ether_addr addr;
+    retval = rte_eth_macaddr_get(port, &addr);
+    if (retval != 0)
+        return retval;
+
+    printf("Port %u MAC: %02" PRIx8 " %02" PRIx8 " %02" PRIx8
+               " %02" PRIx8 " %02" PRIx8 " %02" PRIx8 "\n",
+            port, RTE_ETHER_ADDR_BYTES(&addr));
+
+    /* Enable RX in promiscuous mode for the Ethernet device. */
+    if (conf->promisc) {
+        retval = rte_eth_promiscuous_enable(port);
+        if (retval != 0)
+            return retval;
+    }
+
+    p->socket = socket;
+    p->nb_rxq = rx_rings;
+    p->nb_txq = tx_rings;
+    p->nb_rxd = nb_rxd;
+    p->nb_txd = nb_txd;
+    p->rx_offloads = port_conf.rxmode.offloads;
+    p->tx_offloads = port_conf.txmode.offloads;
+    p->pool = mbuf_pool;
+    p->initialized = 1;
+    return 0;
+}
+
+/***  Helper functions to get info about available DPDK ports ***/
+int bfdev_get_linux_ifname_by_mac(struct rte_ether_addr *mac, char *ifname, size_t ifname_len) {
+    struct ifaddrs *ifaddr, *ifa;
+    int found = 0;
+
+    if (getifaddrs(&ifaddr) == -1) {
+        return -1;
+    }
+    // Iterate through all interfaces
+    for (ifa = ifaddr; ifa != NULL; ifa = ifa->ifa_next) {
+        if (ifa->ifa_addr == NULL)
+            continue;
+
+        // Check if this is a packet socket (has MAC address)
+        if (ifa->ifa_addr->sa_family == AF_PACKET) {
+            struct sockaddr_ll *s = (struct sockaddr_ll*)ifa->ifa_addr;
+
+            // Compare MAC addresses
+            if (s->sll_halen == RTE_ETHER_ADDR_LEN &&
+                memcmp(s->sll_addr, mac->addr_bytes, RTE_ETHER_ADDR_LEN) == 0) {
+                snprintf(ifname, ifname_len, "%s", ifa->ifa_name);
+                found = 1;
+                break;
+            }
+        }
+    }
+    freeifaddrs(ifaddr);
+    return found ? 0 : -1;
+}
+
+void bfdev_list_ports(void) {
+    uint16_t port_id;
+    uint16_t nb_ports;
+    struct rte_eth_dev_info dev_info;
+    struct rte_ether_addr addr;
+    char name[RTE_ETH_NAME_MAX_LEN];
+    char linux_ifname[IFNAMSIZ];
+    int retval;
+
+    nb_ports = rte_eth_dev_count_avail();
+    printf("\n=== Available DPDK Ports ===\n");
+    printf("Total ports available: %u\n\n", nb_ports);
+
+    if (nb_ports == 0) {
+        printf("No DPDK ports found!\n");
+        return;
+    }
+
+    RTE_ETH_FOREACH_DEV(port_id) {
+        // Get MAC address first
+        retval = rte_eth_macaddr_get(port_id, &addr);
+        if (retval != 0) {
+            continue; // Skip if we can't get MAC
+        }
+
+        // Try to find Linux interface by MAC address
+        if (bfdev_get_linux_ifname_by_mac(&addr, linux_ifname, sizeof(linux_ifname)) != 0) {
+            continue; // Skip ports without Linux interfaces
+        }
+
+        printf("Port %u:\n", port_id);
+
+        // Get device name
+        retval = rte_eth_dev_get_name_by_port(port_id, name);
+        if (retval == 0) {
+            printf("  DPDK Name: %s\n", name);
+
+            // Check if this is a representor port
+            if (strstr(name, "_representor_")) {
+                printf("  Type: Representor Port\n");
+            }
+        }
+
+        printf("  Linux Interface: %s\n", linux_ifname);
+
+        printf("  MAC Address: %02X:%02X:%02X:%02X:%02X:%02X\n",
+               addr.addr_bytes[0], addr.addr_bytes[1],
+               addr.addr_bytes[2], addr.addr_bytes[3],
+               addr.addr_bytes[4], addr.addr_bytes[5]);
+
+        // Get device info
+        retval = rte_eth_dev_info_get(port_id, &dev_info);
+        if (retval != 0) {
+            printf("  Error getting device info: %s\n", strerror(-retval));
+            continue;
+        }
+
+        // Print driver name
+        if (dev_info.driver_name) {
+            printf("  Driver: %s\n", dev_info.driver_name);
+        }
+
+        // Print device name if available
+        if (dev_info.device && rte_dev_name(dev_info.device)) {
+            printf("  Device: %s\n", rte_dev_name(dev_info.device));
+        }
+
+        // Print capabilities
+        printf("  Max RX queues: %u\n", dev_info.max_rx_queues);
+        printf("  Max TX queues: %u\n", dev_info.max_tx_queues);
+
+        // Print link status
+        struct rte_eth_link link;
+        retval = rte_eth_link_get_nowait(port_id, &link);
+        if (retval == 0) {
+            printf("  Link Status: %s\n",
+                   link.link_status ? "UP" : "DOWN");
+            if (link.link_status) {
+                printf("  Link Speed: %u Mbps\n", link.link_speed);
+                printf("  Link Duplex: %s\n",
+                       link.link_duplex == RTE_ETH_LINK_FULL_DUPLEX ? "Full" : "Half");
+            }
+        }
+
+        printf("\n");
+    }
+    printf("============================\n\n");
+}
@@ -0,0 +1,100 @@
+// libbfdev port helpers: port discovery and port/queue/mempool setup shared
+// by all the bluefielddev tools.
+#ifndef BFDEV_PORT_H
+#define BFDEV_PORT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <rte_ethdev.h>
+#include <rte_mempool.h>
+
+#define BFDEV_RING_SIZE 1024
+#define BFDEV_MAX_QUEUES 16
+#define BFDEV_MAX_PKT_BURST 32
+
+// Hash fields used to spread flows across rx queues. Every packet of a flow
+// hashes to the same queue, so per-flow ordering is kept.
+#define BFDEV_RSS_HF (RTE_ETH_RSS_IP | RTE_ETH_RSS_TCP | RTE_ETH_RSS_UDP)
+
+// Offload profile bits. A profile is requested per port and negotiated
+// against the device capabilities in bfdev_port_init().
+#define BFDEV_OFFLOAD_FAST_FREE (1u << 0)  // tx: free sent mbufs without refcnt/pool checks
+#define BFDEV_OFFLOAD_RX_CKSUM  (1u << 1)  // rx: NIC validates IPv4/TCP/UDP checksums
+#define BFDEV_OFFLOAD_TX_CKSUM  (1u << 2)  // tx: NIC computes IPv4/TCP/UDP checksums
+#define BFDEV_OFFLOAD_VLAN      (1u << 3)  // rx: strip VLAN tag into the mbuf, tx: insert it
+#define BFDEV_OFFLOAD_ALL (BFDEV_OFFLOAD_FAST_FREE | BFDEV_OFFLOAD_RX_CKSUM | \
+                           BFDEV_OFFLOAD_TX_CKSUM | BFDEV_OFFLOAD_VLAN)
+
+// How a port gets the mempool its rx queues allocate from
+enum bfdev_pool_policy {
+    BFDEV_POOL_PER_PORT = 0,  // create a pool for the port, sized from the conf
+    BFDEV_POOL_SHARED,        // use conf->pool, created by the caller
+};
+
+// Port configuration, set defaults with bfdev_port_conf_init()
+struct bfdev_port_conf {
+    uint16_t nb_rxq;        // rx queues, RSS is enabled when > 1
+    uint16_t nb_txq;        // tx queues
+    uint16_t nb_rxd;        // rx descriptors per queue, adjusted to the device limits
+    uint16_t nb_txd;        // tx descriptors per queue, adjusted to the device limits
+    uint16_t mtu;           // 0 keeps the device default
+    unsigned offloads;      // BFDEV_OFFLOAD_* bits to request
+    int promisc;            // enable promiscuous mode
+    enum bfdev_pool_policy pool_policy;
+    struct rte_mempool *pool;  // BFDEV_POOL_SHARED: pool for the rx queues
+    unsigned pool_lcores;      // lcores using the pool, 0 = all EAL lcores
+    unsigned extra_mbufs;      // mbufs the caller holds outside the rings, e.g. a capture
+    uint16_t flow_queues;      // async rte_flow queues, 0 = rte_flow_create only
+    uint32_t flow_queue_size;  // operations per flow queue
+    uint32_t flow_counters;    // counters (and aging objects) for async rules
+    int rx_intr;               // rx queue interrupts, for rte_eth_dev_rx_intr_enable()
+};
+
+// State of a port after bfdev_port_init()
+struct bfdev_port {
+    int initialized;
+    int socket;                 // NUMA socket of the port (or of the caller)
+    uint16_t nb_rxq;
+    uint16_t nb_txq;
+    uint16_t nb_rxd;            // descriptors after adjustment
+    uint16_t nb_txd;
+    uint64_t rx_offloads;       // offloads granted by the device
+    uint64_t tx_offloads;
+    struct rte_mempool *pool;   // pool the rx queues allocate from
+    uint16_t flow_queues;       // async flow queues configured, 0 if none
+    uint32_t flow_queue_size;
+    int rx_intr;                // rx queue interrupts are available
+};
+
+// Fill conf with defaults: 1 rx/tx queue of BFDEV_RING_SIZE descriptors,
+// device MTU, fast-free, promiscuous, per-port pool.
+void bfdev_port_conf_init(struct bfdev_port_conf *conf);
+
+// Configure and start a port. Returns 0 on success or a negative errno.
+int bfdev_port_init(uint16_t port, const struct bfdev_port_conf *conf);
+
+// State of an initialized port, NULL if the port was not initialized
+const struct bfdev_port *bfdev_port_get(uint16_t port);
+
+// Create an mbuf pool whose data room fits a full frame of the given MTU,
+// with a per-lcore cache. Returns NULL (and logs why) on failure.
+struct rte_mempool *bfdev_pool_create(const char *name, unsigned nb_mbufs,
+                                      uint16_t mtu, int socket);
+
+// Parse a comma separated list of offload names
+// (fast_free, rx_cksum, tx_cksum, vlan), or "none" / "all"
+int bfdev_parse_offloads(const char *str, unsigned *flags);
+
+// Largest frame for the given MTU (0 = default), with room for two VLAN tags
+uint32_t bfdev_max_frame_len(uint16_t mtu);
+
+// Mbuf data room that holds a full frame of the given MTU
+uint16_t bfdev_mbuf_data_room(uint16_t mtu);
+
+// Find the Linux interface with the given MAC. Returns 0 if found.
+int bfdev_get_linux_ifname_by_mac(struct rte_ether_addr *mac, char *ifname, size_t ifname_len);
+
+// Print information about the available DPDK ports that have a Linux interface
+void bfdev_list_ports(void);
+
+#endif
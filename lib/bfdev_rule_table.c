@@ -0,0 +1,450 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+
+#include <rte_ethdev.h>
+#include <rte_flow.h>
+#include <rte_hash.h>
+#include <rte_hash_crc.h>
+#include <rte_cycles.h>
+
+#include "bfdev_port.h"
+#include "bfdev_flow.h"
+#include "bfdev_rule_table.h"
+
+struct rule_entry {
+    struct bfdev_rule rule;
+    struct rte_flow *flow;
+    int async;                   // created with the async API
+    uint32_t gen;                // last apply that kept the rule
+    struct bfdev_rule_counters counters;
+    uint16_t idle;               // queries in a row without new hits
+    uint16_t visits;             // polls that reached the rule while idle
+};
+
+struct bfdev_rule_table {
+    uint16_t port;
+    struct bfdev_flow_attr attr;
+    unsigned max_rules;
+    uint32_t gen;
+    struct rte_hash *ids;        // rule id -> index in entries
+    struct rule_entry *entries;
+    uint32_t poll_iter;          // rte_hash_iterate cursor of the poller
+};
+
+// Counter polling: after this many queries without new hits a rule is only
+// queried on every COUNTER_IDLE_PERIOD-th visit
+#define COUNTER_IDLE_QUERIES 4
+#define COUNTER_IDLE_PERIOD 8
+
+struct bfdev_rule_table *bfdev_rule_table_create(uint16_t port,
+                                                 const struct bfdev_flow_attr *attr,
+                                                 unsigned max_rules) {
+    static unsigned nb_tables;
+    const struct bfdev_port *p = bfdev_port_get(port);
+    char name[RTE_HASH_NAMESIZE];
+    struct bfdev_rule_table *t;
+
+    if (p == NULL || max_rules == 0) {
+        printf("Port %u: cannot create a rule table\n", port);
+        return NULL;
+    }
+    t = calloc(1, sizeof(*t));
+    if (t == NULL)
+        return NULL;
+    t->port = port;
+    t->attr = *attr;
+    t->max_rules = RTE_MAX(max_rules, 8u);  // rte_hash minimum
+
+    snprintf(name, sizeof(name), "BFDEV_RULES_%u_%u", port, nb_tables++);
+    struct rte_hash_parameters params = {
+        .name = name,
+        .entries = t->max_rules,
+        .key_len = sizeof(uint32_t),
+        .hash_func = rte_hash_crc,
+        .socket_id = p->socket,
+        // buckets overflow into an extended table, so that max_rules ids
+        // always fit however they hash
+        .extra_flag = RTE_HASH_EXTRA_FLAGS_EXT_TABLE,
+    };
+    t->ids = rte_hash_create(&params);
+    t->entries = calloc(t->max_rules, sizeof(*t->entries));
+    if (t->ids == NULL || t->entries == NULL) {
+        printf("Port %u: cannot allocate a rule table of %u rules\n", port, max_rules);
+        bfdev_rule_table_free(t);
+        return NULL;
+    }
+    return t;
+}
+
+void bfdev_rule_table_free(struct bfdev_rule_table *t) {
+    if (t == NULL)
+        return;
+    rte_hash_free(t->ids);
+    free(t->entries);
+    free(t);
+}
+
+unsigned bfdev_rule_table_count(const struct bfdev_rule_table *t) {
+    return rte_hash_count(t->ids);
+}
+
+struct rte_flow *bfdev_rule_table_lookup(const struct bfdev_rule_table *t, uint32_t id) {
+    int32_t pos = rte_hash_lookup(t->ids, &id);
+    return pos < 0 ? NULL : t->entries[pos].flow;
+}
+
+void bfdev_rule_table_dump(const struct bfdev_rule_table *t, FILE *f) {
+    const void *key;
+    void *data;
+    uint32_t iter = 0;
+    int32_t pos;
+    char line[256];
+
+    while ((pos = rte_hash_iterate(t->ids, &key, &data, &iter)) >= 0) {
+        bfdev_rule_format(&t->entries[pos].rule, line, sizeof(line));
+        fprintf(f, "%s\n", line);
+    }
+}
+
+unsigned bfdev_rule_table_poll(struct bfdev_rule_table *t, unsigned budget) {
+    const uint64_t hz = rte_get_tsc_hz();
+    const unsigned count = bfdev_rule_table_count(t);
+    unsigned visited = 0, queried = 0;
+    const void *key;
+    void *data;
+    int32_t pos;
+
+    if (!t->attr.count)
+        return 0;
+    // each rule is visited at most once per call
+    while (queried < budget && visited < count) {
+        pos = rte_hash_iterate(t->ids, &key, &data, &t->poll_iter);
+        if (pos < 0) {
+            t->poll_iter = 0;
+            pos = rte_hash_iterate(t->ids, &key, &data, &t->poll_iter);
+            if (pos < 0)
+                break;
+        }
+        visited++;
+
+        struct rule_entry *e = &t->entries[pos];
+        if (e->flow == NULL)
+            continue;
+        if (e->idle >= COUNTER_IDLE_QUERIES && ++e->visits % COUNTER_IDLE_PERIOD != 0)
+            continue;
+
+        uint64_t hits, bytes;
+        if (bfdev_flow_query_count(t->port, e->flow, &hits, &bytes) != 0)
+            continue;
+        queried++;
+
+        struct bfdev_rule_counters *c = &e->counters;
+        const uint64_t now = rte_rdtsc();
+        if (c->tsc != 0 && now > c->tsc) {
+            double seconds = (double)(now - c->tsc) / hz;
+            c->pps = (hits - c->hits) / seconds;
+            c->bps = (bytes - c->bytes) * 8 / seconds;
+        }
+        e->idle = hits == c->hits ? RTE_MIN(e->idle + 1, UINT16_MAX) : 0;
+        c->hits = hits;
+        c->bytes = bytes;
+        c->tsc = now;
+    }
+    return queried;
+}
+
+int bfdev_rule_table_counters(const struct bfdev_rule_table *t, uint32_t id,
+                              struct bfdev_rule_counters *c) {
+    int32_t pos = rte_hash_lookup(t->ids, &id);
+
+    if (pos < 0)
+        return -ENOENT;
+    *c = t->entries[pos].counters;
+    return 0;
+}
+
+void bfdev_rule_table_foreach(const struct bfdev_rule_table *t,
+                              void (*fn)(const struct bfdev_rule *rule,
+                                         const struct bfdev_rule_counters *c, void *arg),
+                              void *arg) {
+    const void *key;
+    void *data;
+    uint32_t iter = 0;
+    int32_t pos;
+
+    while ((pos = rte_hash_iterate(t->ids, &key, &data, &iter)) >= 0)
+        fn(&t->entries[pos].rule, &t->entries[pos].counters, arg);
+}
+
+unsigned bfdev_rule_table_dump_counters(const struct bfdev_rule_table *t, FILE *f,
+                                        int active_only) {
+    const void *key;
+    void *data;
+    uint32_t iter = 0;
+    int32_t pos;
+    unsigned n = 0;
+    char line[256];
+
+    while ((pos = rte_hash_iterate(t->ids, &key, &data, &iter)) >= 0) {
+        const struct rule_entry *e = &t->entries[pos];
+        const struct bfdev_rule_counters *c = &e->counters;
+        if (active_only && c->pps == 0)
+            continue;
+        bfdev_rule_format(&e->rule, line, sizeof(line));
+        fprintf(f, "%-60s hits %" PRIu64 " bytes %" PRIu64 " %.0f pps %.2f Mbps\n",
+                line, c->hits, c->bytes, c->pps, c->bps / 1e6);
+        n++;
+    }
+    return n;
+}
+
+static int cmp_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static int has_duplicate_ids(const struct bfdev_rule *rules, unsigned nb_rules) {
+    uint32_t *ids = malloc((nb_rules + 1) * sizeof(*ids));
+    int dup = 0;
+
+    if (ids == NULL)
+        return -ENOMEM;
+    for (unsigned i = 0; i < nb_rules; i++)
+        ids[i] = rules[i].id;
+    qsort(ids, nb_rules, sizeof(*ids), cmp_u32);
+    for (unsigned i = 1; i < nb_rules && !dup; i++) {
+        if (ids[i] == ids[i - 1]) {
+            printf("Duplicate rule id %u\n", ids[i]);
+            dup = 1;
+        }
+    }
+    free(ids);
+    return dup;
+}
+
+// Destroy the flows of entries, in one batch per creation API
+static void destroy_entries(struct bfdev_rule_table *t, const int32_t *pos, unsigned n,
+                            struct rte_flow **flows) {
+    for (int async = 0; async <= 1; async++) {
+        unsigned nb_flows = 0;
+        for (unsigned i = 0; i < n; i++) {
+            struct rule_entry *e = &t->entries[pos[i]];
+            if (e->flow != NULL && e->async == async)
+                flows[nb_flows++] = e->flow;
+        }
+        if (nb_flows > 0)
+            bfdev_flow_destroy(t->port, flows, nb_flows, async);
+    }
+    for (unsigned i = 0; i < n; i++)
+        t->entries[pos[i]].flow = NULL;
+}
+
+static void entry_init(struct rule_entry *e, const struct bfdev_rule *rule, uint32_t gen) {
+    e->rule = *rule;
+    e->flow = NULL;
+    e->gen = gen;
+    memset(&e->counters, 0, sizeof(e->counters));
+    e->idle = 0;
+    e->visits = 0;
+}
+
+// Install the rules of entries that were just added to the table, the ones
+// that fail are taken out again. The template tables are sized for the whole
+// rule table, not for this batch. Returns the number of failures.
+static unsigned install_entries(struct bfdev_rule_table *t, const struct bfdev_rule *rules,
+                                const int32_t *pos, unsigned n, struct rte_flow **flows) {
+    struct bfdev_flow_stats stats;
+
+    if (n == 0)
+        return 0;
+    bfdev_flow_install(t->port, &t->attr, rules, n, t->max_rules, flows, &stats);
+    for (unsigned i = 0; i < n; i++) {
+        struct rule_entry *e = &t->entries[pos[i]];
+        e->flow = flows[i];
+        e->async = stats.async;
+        if (e->flow == NULL)
+            rte_hash_del_key(t->ids, &rules[i].id);
+    }
+    return stats.failed;
+}
+
+int bfdev_rule_table_add(struct bfdev_rule_table *t, const struct bfdev_rule *rules,
+                         unsigned nb_rules) {
+    int32_t *pos = malloc((nb_rules + 1) * sizeof(*pos));
+    struct bfdev_rule *add = malloc((nb_rules + 1) * sizeof(*add));
+    struct rte_flow **flows = malloc((nb_rules + 1) * sizeof(*flows));
+    unsigned n = 0;
+    int ret = -ENOMEM;
+
+    if (pos == NULL || add == NULL || flows == NULL)
+        goto out;
+    for (unsigned i = 0; i < nb_rules; i++) {
+        if (rte_hash_lookup(t->ids, &rules[i].id) >= 0)
+            continue;
+        int32_t p = rte_hash_add_key(t->ids, &rules[i].id);
+        if (p < 0)
+            break;  // table full
+        entry_init(&t->entries[p], &rules[i], t->gen);
+        pos[n] = p;
+        add[n++] = rules[i];
+    }
+    ret = n - install_entries(t, add, pos, n, flows);
+out:
+    free(pos);
+    free(add);
+    free(flows);
+    return ret;
+}
+
+int bfdev_rule_table_remove(struct bfdev_rule_table *t, const uint32_t *ids,
+                            unsigned nb_ids) {
+    int32_t *pos = malloc((nb_ids + 1) * sizeof(*pos));
+    struct rte_flow **flows = malloc((nb_ids + 1) * sizeof(*flows));
+    unsigned n = 0;
+    int ret = -ENOMEM;
+
+    if (pos == NULL || flows == NULL)
+        goto out;
+    for (unsigned i = 0; i < nb_ids; i++) {
+        int32_t p = rte_hash_lookup(t->ids, &ids[i]);
+        if (p < 0)
+            continue;
+        // a repeated id is removed once
+        rte_hash_del_key(t->ids, &ids[i]);
+        pos[n++] = p;
+    }
+    destroy_entries(t, pos, n, flows);
+    ret = n;
+out:
+    free(pos);
+    free(flows);
+    return ret;
+}
+
+int bfdev_rule_table_apply(struct bfdev_rule_table *t, const struct bfdev_rule *rules,
+                           unsigned nb_rules, struct bfdev_rule_diff *diff) {
+    const uint64_t start = rte_rdtsc();
+    const unsigned count = bfdev_rule_table_count(t);
+    const unsigned size = RTE_MAX(nb_rules, count) + 1;
+    int32_t *add_pos = malloc(size * sizeof(*add_pos));       // -1 for new ids
+    struct bfdev_rule *add = malloc(size * sizeof(*add));
+    int32_t *del_pos = malloc(size * sizeof(*del_pos));
+    struct rte_flow **flows = malloc(size * sizeof(*flows));
+    unsigned nb_add = 0, nb_del = 0, nb_removed = 0;
+    int ret = 0;
+
+    memset(diff, 0, sizeof(*diff));
+    if (add_pos == NULL || add == NULL || del_pos == NULL || flows == NULL) {
+        ret = -ENOMEM;
+        goto out;
+    }
+    ret = has_duplicate_ids(rules, nb_rules);
+    if (ret != 0) {
+        ret = ret < 0 ? ret : -EINVAL;
+        goto out;
+    }
+
+    // mark the rules that are kept, and collect the new and changed ones
+    const uint32_t gen = ++t->gen;
+    for (unsigned i = 0; i < nb_rules; i++) {
+        int32_t pos = rte_hash_lookup(t->ids, &rules[i].id);
+        if (pos >= 0) {
+            t->entries[pos].gen = gen;
+            if (bfdev_rule_equal(&t->entries[pos].rule, &rules[i])) {
+                diff->unchanged++;
+                continue;
+            }
+            diff->changed++;
+            del_pos[nb_del++] = pos;
+        } else {
+            diff->added++;
+        }
+        add_pos[nb_add] = pos;
+        add[nb_add++] = rules[i];
+    }
+    if (nb_rules > t->max_rules) {
+        printf("Port %u: %u rules do not fit a table of %u\n", t->port, nb_rules,
+               t->max_rules);
+        ret = -ENOSPC;
+        goto out;
+    }
+
+    // rules that are not in the new set go, before anything is added so
+    // that their slots and hardware resources are free again
+    const void *key;
+    void *data;
+    uint32_t iter = 0;
+    int32_t pos;
+    while ((pos = rte_hash_iterate(t->ids, &key, &data, &iter)) >= 0) {
+        if (t->entries[pos].gen != gen)
+            del_pos[nb_del + nb_removed++] = pos;
+    }
+    diff->removed = nb_removed;
+    destroy_entries(t, del_pos, nb_del + nb_removed, flows);
+    for (unsigned i = nb_del; i < nb_del + nb_removed; i++)
+        rte_hash_del_key(t->ids, &t->entries[del_pos[i]].rule.id);
+
+    // a new id that finds no slot fails like a rule the device refused
+    unsigned nb_install = 0, nb_full = 0;
+    for (unsigned i = 0; i < nb_add; i++) {
+        int32_t p = add_pos[i];
+        if (p < 0)
+            p = rte_hash_add_key(t->ids, &add[i].id);
+        if (p < 0) {
+            nb_full++;
+            continue;
+        }
+        entry_init(&t->entries[p], &add[i], gen);
+        add_pos[nb_install] = p;
+        add[nb_install++] = add[i];
+    }
+
+    diff->failed = nb_full + install_entries(t, add, add_pos, nb_install, flows);
+    if (diff->failed > 0)
+        ret = -EIO;
+
+out:
+    free(add_pos);
+    free(add);
+    free(del_pos);
+    free(flows);
+    diff->seconds = (double)(rte_rdtsc() - start) / rte_get_tsc_hz();
+    return ret;
+}
+
+int bfdev_rule_table_flush(struct bfdev_rule_table *t) {
+    const unsigned count = bfdev_rule_table_count(t);
+    int32_t *pos = malloc((count + 1) * sizeof(*pos));
+    struct rte_flow **flows = malloc((count + 1) * sizeof(*flows));
+    struct rte_flow_error err;
+    const void *key;
+    void *data;
+    uint32_t iter = 0;
+    unsigned n = 0;
+    int32_t p;
+    int ret;
+
+    if (pos == NULL || flows == NULL) {
+        free(pos);
+        free(flows);
+        return -ENOMEM;
+    }
+    while ((p = rte_hash_iterate(t->ids, &key, &data, &iter)) >= 0)
+        pos[n++] = p;
+    destroy_entries(t, pos, n, flows);
+    for (unsigned i = 0; i < n; i++)
+        rte_hash_del_key(t->ids, &t->entries[pos[i]].rule.id);
+    free(pos);
+    free(flows);
+
+    // catch flows that were not tracked, then the tables can go
+    ret = rte_flow_flush(t->port, &err);
+    if (ret != 0)
+        printf("Port %u: rte_flow_flush failed: %s\n", t->port,
+               err.message ? err.message : "(no message)");
+    bfdev_flow_release(t->port);
+    return ret;
+}
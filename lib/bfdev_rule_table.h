@@ -0,0 +1,97 @@
+// libbfdev rule table: the rules installed on a port and their flows, keyed
+// by rule id, so that a new ruleset is applied as a diff against it.
+#ifndef BFDEV_RULE_TABLE_H
+#define BFDEV_RULE_TABLE_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "bfdev_flow.h"
+
+struct bfdev_rule_table;
+
+// Result of bfdev_rule_table_apply()
+struct bfdev_rule_diff {
+    unsigned added;
+    unsigned removed;
+    unsigned changed;            // same id, new match or action: replaced
+    unsigned unchanged;          // left untouched in hardware
+    unsigned failed;             // new or changed rules that could not be installed
+    double seconds;
+};
+
+// Counters of a rule installed with bfdev_flow_attr.count, as of its last
+// query by bfdev_rule_table_poll()
+struct bfdev_rule_counters {
+    uint64_t hits;
+    uint64_t bytes;
+    double pps;                  // rates between the last two queries
+    double bps;
+    uint64_t tsc;                // time of the last query, 0 if never queried
+};
+
+// Create an empty table for up to max_rules rules on port, installed with
+// attr. Every template table the rules need is created for max_rules rules.
+// Returns NULL (and logs why) on failure.
+struct bfdev_rule_table *bfdev_rule_table_create(uint16_t port,
+                                                 const struct bfdev_flow_attr *attr,
+                                                 unsigned max_rules);
+
+// Make the installed rules equal to rules[]: rules whose id is new are
+// installed, rules whose id is gone are destroyed, rules whose match or
+// action changed are replaced and the others are not touched. Rule ids must
+// be unique. Returns 0, -EINVAL (duplicate id), -ENOSPC (table full) or
+// -EIO if some rules could not be installed (they are left out of the table).
+int bfdev_rule_table_apply(struct bfdev_rule_table *t, const struct bfdev_rule *rules,
+                           unsigned nb_rules, struct bfdev_rule_diff *diff);
+
+// Install the rules whose id is not in the table yet, leaving the others
+// alone. Rules that do not fit or fail to install are skipped. Returns the
+// number of rules installed or a negative errno.
+int bfdev_rule_table_add(struct bfdev_rule_table *t, const struct bfdev_rule *rules,
+                         unsigned nb_rules);
+
+// Destroy the rules with the given ids, unknown ids are skipped. Returns the
+// number of rules removed or a negative errno.
+int bfdev_rule_table_remove(struct bfdev_rule_table *t, const uint32_t *ids,
+                            unsigned nb_ids);
+
+// Number of installed rules
+unsigned bfdev_rule_table_count(const struct bfdev_rule_table *t);
+
+// Flow of the installed rule with the given id, NULL if there is none
+struct rte_flow *bfdev_rule_table_lookup(const struct bfdev_rule_table *t, uint32_t id);
+
+// Print the installed rules in rule file syntax
+void bfdev_rule_table_dump(const struct bfdev_rule_table *t, FILE *f);
+
+// Query the counters of up to budget rules, continuing where the previous
+// call stopped. Rules that had no new hits for a few queries are queried 8x
+// less often, so the cost of a call stays bounded with many rules while
+// busy rules stay fresh. Returns the number of counters queried.
+unsigned bfdev_rule_table_poll(struct bfdev_rule_table *t, unsigned budget);
+
+// Counters of the rule with the given id. Returns 0 or -ENOENT.
+int bfdev_rule_table_counters(const struct bfdev_rule_table *t, uint32_t id,
+                              struct bfdev_rule_counters *c);
+
+// Call fn on every installed rule with its counters, in no particular order
+void bfdev_rule_table_foreach(const struct bfdev_rule_table *t,
+                              void (*fn)(const struct bfdev_rule *rule,
+                                         const struct bfdev_rule_counters *c, void *arg),
+                              void *arg);
+
+// Print the counters of the installed rules, one rule per line, only those
+// with traffic at their last query when active_only is set. Returns the
+// number of rules printed.
+unsigned bfdev_rule_table_dump_counters(const struct bfdev_rule_table *t, FILE *f,
+                                        int active_only);
+
+// Destroy every rule of the table, then rte_flow_flush the port and release
+// its template tables. The table is empty and reusable afterwards.
+int bfdev_rule_table_flush(struct bfdev_rule_table *t);
+
+// Free the table. Its rules stay installed, flush it first.
+void bfdev_rule_table_free(struct bfdev_rule_table *t);
+
+#endif
@@ -0,0 +1,263 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+
+#include <rte_ethdev.h>
+#include <rte_cycles.h>
+
+#include "bfdev_xmon.h"
+
+// Words of the xstat names that count lost packets, across PMDs: e.g.
+// rx_out_of_buffer, rx_discards_phy (mlx5), rx_missed_errors, rx_q0_errors
+static const char *drop_words[] = {
+    "drop", "discard", "miss", "nombuf", "no_mbuf", "out_of_buffer", "error",
+    "full", "fail", "undersize", "oversize", "fragment", "jabber", "crc",
+};
+
+struct xmon_port {
+    uint16_t port;
+    char name[RTE_ETH_NAME_MAX_LEN];
+    unsigned nb_xstats;
+    struct rte_eth_xstat_name *names;
+    uint8_t *is_drop;
+    struct rte_eth_xstat *xstats;    // read buffer
+    uint64_t *prev;                  // xstat values by id
+    uint64_t *cur;
+    struct rte_eth_stats prev_stats;
+    struct rte_eth_stats stats;
+};
+
+struct bfdev_xmon {
+    unsigned nb_ports;
+    uint64_t prev_tsc;
+    uint64_t tsc;
+    struct xmon_port ports[];
+};
+
+static int is_drop_name(const char *name) {
+    for (unsigned i = 0; i < RTE_DIM(drop_words); i++) {
+        if (strstr(name, drop_words[i]) != NULL)
+            return 1;
+    }
+    return 0;
+}
+
+static void port_free(struct xmon_port *p) {
+    free(p->names);
+    free(p->is_drop);
+    free(p->xstats);
+    free(p->prev);
+    free(p->cur);
+    p->names = NULL;
+    p->is_drop = NULL;
+    p->xstats = NULL;
+    p->prev = NULL;
+    p->cur = NULL;
+    p->nb_xstats = 0;
+}
+
+// (Re)read the xstat names of a port and size the buffers for them.
+// Returns 0 or a negative errno.
+static int port_names(struct xmon_port *p) {
+    int n = rte_eth_xstats_get_names(p->port, NULL, 0);
+
+    port_free(p);
+    if (n < 0)
+        return n;
+    p->names = calloc(n + 1, sizeof(*p->names));
+    p->is_drop = calloc(n + 1, sizeof(*p->is_drop));
+    p->xstats = calloc(n + 1, sizeof(*p->xstats));
+    p->prev = calloc(n + 1, sizeof(*p->prev));
+    p->cur = calloc(n + 1, sizeof(*p->cur));
+    if (p->names == NULL || p->is_drop == NULL || p->xstats == NULL ||
+        p->prev == NULL || p->cur == NULL) {
+        port_free(p);
+        return -ENOMEM;
+    }
+    if (rte_eth_xstats_get_names(p->port, p->names, n) != n) {
+        port_free(p);
+        return -EAGAIN;
+    }
+    for (int i = 0; i < n; i++)
+        p->is_drop[i] = is_drop_name(p->names[i].name);
+    p->nb_xstats = n;
+    return 0;
+}
+
+// Read the stats and xstats of a port into cur, keeping the last ones in
+// prev. Returns 0 or a negative errno.
+static int port_read(struct xmon_port *p) {
+    int ret = rte_eth_stats_get(p->port, &p->stats);
+
+    if (ret != 0)
+        return ret;
+    int n = rte_eth_xstats_get(p->port, p->xstats, p->nb_xstats);
+    const int grew = n > (int)p->nb_xstats;
+    if (grew) {
+        // the driver added xstats, e.g. for new queues: start them over
+        ret = port_names(p);
+        if (ret != 0)
+            return ret;
+        n = rte_eth_xstats_get(p->port, p->xstats, p->nb_xstats);
+    }
+    if (n < 0)
+        return n;
+    for (int i = 0; i < n; i++) {
+        if (p->xstats[i].id < p->nb_xstats)
+            p->cur[p->xstats[i].id] = p->xstats[i].value;
+    }
+    if (grew)
+        memcpy(p->prev, p->cur, p->nb_xstats * sizeof(*p->cur));
+    return 0;
+}
+
+struct bfdev_xmon *bfdev_xmon_create(const uint16_t *ports, unsigned nb_ports) {
+    struct bfdev_xmon *mon = calloc(1, sizeof(*mon) + nb_ports * sizeof(mon->ports[0]));
+
+    if (mon == NULL)
+        return NULL;
+    mon->nb_ports = nb_ports;
+    for (unsigned i = 0; i < nb_ports; i++) {
+        struct xmon_port *p = &mon->ports[i];
+        p->port = ports[i];
+        if (!rte_eth_dev_is_valid_port(p->port)) {
+            printf("Port %u: no such port\n", p->port);
+            bfdev_xmon_free(mon);
+            return NULL;
+        }
+        if (rte_eth_dev_get_name_by_port(p->port, p->name) != 0)
+            snprintf(p->name, sizeof(p->name), "port%u", p->port);
+        int ret = port_names(p);
+        if (ret == 0)
+            ret = port_read(p);
+        if (ret != 0) {
+            printf("Port %u: cannot read the stats: %s\n", p->port, strerror(-ret));
+            bfdev_xmon_free(mon);
+            return NULL;
+        }
+        p->prev_stats = p->stats;
+        memcpy(p->prev, p->cur, p->nb_xstats * sizeof(*p->cur));
+    }
+    mon->tsc = rte_rdtsc();
+    return mon;
+}
+
+void bfdev_xmon_free(struct bfdev_xmon *mon) {
+    if (mon == NULL)
+        return;
+    for (unsigned i = 0; i < mon->nb_ports; i++)
+        port_free(&mon->ports[i]);
+    free(mon);
+}
+
+int bfdev_xmon_sample(struct bfdev_xmon *mon) {
+    int err = 0;
+
+    mon->prev_tsc = mon->tsc;
+    mon->tsc = rte_rdtsc();
+    for (unsigned i = 0; i < mon->nb_ports; i++) {
+        struct xmon_port *p = &mon->ports[i];
+        p->prev_stats = p->stats;
+        memcpy(p->prev, p->cur, p->nb_xstats * sizeof(*p->cur));
+        int ret = port_read(p);
+        if (ret != 0 && err == 0)
+            err = ret;
+    }
+    return err;
+}
+
+// Counters can go back when a port is reset: count that as no change
+static inline uint64_t delta(uint64_t cur, uint64_t prev) {
+    return cur > prev ? cur - prev : 0;
+}
+
+void bfdev_xmon_drops(const struct bfdev_xmon *mon, unsigned i, struct bfdev_xmon_drops *d) {
+    const struct xmon_port *p = &mon->ports[i];
+
+    d->imissed = delta(p->stats.imissed, p->prev_stats.imissed);
+    d->rx_nombuf = delta(p->stats.rx_nombuf, p->prev_stats.rx_nombuf);
+    d->ierrors = delta(p->stats.ierrors, p->prev_stats.ierrors);
+    d->oerrors = delta(p->stats.oerrors, p->prev_stats.oerrors);
+    d->tx_full = 0;
+}
+
+// What the largest cause of drops means
+static const char *drop_hint(const struct bfdev_xmon_drops *d) {
+    const struct {
+        uint64_t n;
+        const char *hint;
+    } causes[] = {
+        {d->imissed, "rx rings full: the polling lcores do not keep up (more queues or lcores, "
+                     "larger bursts, more rx descriptors)"},
+        {d->rx_nombuf, "mbuf pool empty: mbufs are held too long or the pool is too small"},
+        {d->tx_full, "tx queues full: the peer port or the link is slower than the rx side"},
+        {d->ierrors, "rx errors: bad frames from the link (see the xstats)"},
+        {d->oerrors, "tx errors: the NIC rejected packets (see the xstats)"},
+    };
+    unsigned best = 0;
+
+    for (unsigned c = 1; c < RTE_DIM(causes); c++) {
+        if (causes[c].n > causes[best].n)
+            best = c;
+    }
+    return causes[best].n > 0 ? causes[best].hint : NULL;
+}
+
+void bfdev_xmon_report(const struct bfdev_xmon *mon, FILE *f, unsigned top,
+                       const uint64_t *tx_full) {
+    const double secs = mon->tsc > mon->prev_tsc ?
+                        (double)(mon->tsc - mon->prev_tsc) / rte_get_tsc_hz() : 0;
+    unsigned best[top + 1];
+
+    if (secs <= 0)
+        return;
+    for (unsigned i = 0; i < mon->nb_ports; i++) {
+        const struct xmon_port *p = &mon->ports[i];
+        struct bfdev_xmon_drops d;
+        bfdev_xmon_drops(mon, i, &d);
+        if (tx_full != NULL)
+            d.tx_full = tx_full[p->port];
+
+        fprintf(f, "Port %u %s: rx %.3f Mpps %.3f Gbps, tx %.3f Mpps %.3f Gbps\n", p->port,
+                p->name, delta(p->stats.ipackets, p->prev_stats.ipackets) / secs / 1e6,
+                delta(p->stats.ibytes, p->prev_stats.ibytes) * 8 / secs / 1e9,
+                delta(p->stats.opackets, p->prev_stats.opackets) / secs / 1e6,
+                delta(p->stats.obytes, p->prev_stats.obytes) * 8 / secs / 1e9);
+        // the drop xstats that moved most, kept sorted in best[]. Some
+        // drops only show there, e.g. rx_discards_phy of mlx5.
+        unsigned nb_best = 0;
+        for (unsigned k = 0; k < p->nb_xstats; k++) {
+            if (!p->is_drop[k] || p->cur[k] <= p->prev[k])
+                continue;
+            unsigned pos = nb_best < top ? nb_best++ : top;
+            while (pos > 0 && delta(p->cur[k], p->prev[k]) >
+                   delta(p->cur[best[pos - 1]], p->prev[best[pos - 1]])) {
+                if (pos < top)
+                    best[pos] = best[pos - 1];
+                pos--;
+            }
+            if (pos < top)
+                best[pos] = k;
+        }
+        const char *hint = drop_hint(&d);
+        if (hint == NULL && nb_best == 0) {
+            fprintf(f, "  no drops\n");
+            continue;
+        }
+        fprintf(f, "  drops/s: rx ring full %.0f, no mbuf %.0f", d.imissed / secs,
+                d.rx_nombuf / secs);
+        if (tx_full != NULL)
+            fprintf(f, ", tx full %.0f", d.tx_full / secs);
+        fprintf(f, ", rx errors %.0f, tx errors %.0f\n", d.ierrors / secs, d.oerrors / secs);
+        if (nb_best > 0) {
+            fprintf(f, "  top:");
+            for (unsigned b = 0; b < nb_best; b++)
+                fprintf(f, "%s %s %.0f/s (%" PRIu64 ")", b ? "," : "", p->names[best[b]].name,
+                        delta(p->cur[best[b]], p->prev[best[b]]) / secs, p->cur[best[b]]);
+            fprintf(f, "\n");
+        }
+        fprintf(f, "  cause: %s\n", hint ? hint : "only in the driver counters above");
+    }
+}
@@ -0,0 +1,46 @@
+// libbfdev drop monitor: samples the stats and xstats of ports and tells
+// where packets are lost, the NIC rx rings (imissed), the mbuf pool
+// (rx_nombuf) or the tx queues, with the driver counters that moved most.
+#ifndef BFDEV_XMON_H
+#define BFDEV_XMON_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define BFDEV_XMON_TOP 5             // default number of drop xstats per port
+
+// Drops of a port between the last two samples
+struct bfdev_xmon_drops {
+    uint64_t imissed;            // rx rings full: the pollers do not keep up
+    uint64_t rx_nombuf;          // no mbuf to refill an rx ring
+    uint64_t ierrors;
+    uint64_t oerrors;
+    uint64_t tx_full;            // given by the caller, see bfdev_xmon_report()
+};
+
+struct bfdev_xmon;
+
+// Monitor the given ports. They only need to be probed, by this process or
+// by the primary process of a secondary one. The xstat names are read
+// once here, so that sampling only reads values. Returns NULL (and logs
+// why) on failure.
+struct bfdev_xmon *bfdev_xmon_create(const uint16_t *ports, unsigned nb_ports);
+
+void bfdev_xmon_free(struct bfdev_xmon *mon);
+
+// Read the counters of every port. The deltas are those since the
+// previous sample, or since creation for the first one. Returns 0 or the
+// negative errno of the first port that could not be read.
+int bfdev_xmon_sample(struct bfdev_xmon *mon);
+
+// Drops of the i-th port of the monitor between the last two samples
+void bfdev_xmon_drops(const struct bfdev_xmon *mon, unsigned i, struct bfdev_xmon_drops *d);
+
+// Print the rates of each port between the last two samples, its drops by
+// cause and its top drop xstats. tx_full, indexed by port id, holds the
+// packets the caller's tx queues did not take since the previous sample,
+// which the NIC cannot count; NULL when unknown.
+void bfdev_xmon_report(const struct bfdev_xmon *mon, FILE *f, unsigned top,
+                       const uint64_t *tx_full);
+
+#endif